@@ -0,0 +1,94 @@
+#!/usr/bin/env ruby
+#
+# dispatch.rb
+#
+# Measures what FuseFS's dispatch layer costs per operation, without
+# mounting anything: FuseFS::Harness calls the same handlers FUSE would.
+# Each operation is run against a MetaDir, a NativeMetaDir, a synthetic
+# root that answers every method as cheaply as Ruby can, and a raw root, so
+# the cost of FuseFS itself can be told apart from the cost of the root.
+#
+# Usage: ruby bench/dispatch.rb [iterations]
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+require 'fusefs'
+require 'benchmark'
+
+ITERATIONS = (ARGV.shift || 10000).to_i
+FILES = 100
+DATA = 'x' * 4096
+
+# The least a root can do: every file exists, is writable and holds DATA.
+class SyntheticDir
+  def initialize(files)
+    @names = (0...files).map { |i| "file#{i}" }
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path != '/' end
+  def contents(path) @names end
+  def size(path) DATA.size end
+  def can_write?(path) true end
+  def read_file(path) DATA end
+  def write_to(path, str) end
+end
+
+# Raw reads and writes, with nothing behind them.
+class RawDir < SyntheticDir
+  def raw_open(path, mode) true end
+  def raw_read(path, off, size) DATA[0, size] end
+  def raw_write(path, off, size, buf) size end
+  def raw_close(path) end
+end
+
+def metadir(klass = FuseFS::MetaDir)
+  dir = klass.new
+  FILES.times { |i| dir.write_to("/file#{i}", DATA) }
+  dir
+end
+
+H = FuseFS::Harness
+
+# Harness calls return a negative errno when they fail.
+def ok(ret)
+  raise SystemCallError.new(-ret) if ret.is_a?(Integer) && ret < 0
+  ret
+end
+
+OPS = [
+  ['getattr', lambda { ok H.getattr('/file1') }],
+  ['readdir', lambda { ok H.readdir('/') }],
+  ['open+read+release', lambda {
+    fh = ok H.open('/file1')
+    ok H.read('/file1', fh, 4096, 0)
+    ok H.release('/file1', fh)
+  }],
+  ['open+write+release', lambda {
+    fh = ok H.open('/file2', File::WRONLY)
+    ok H.write('/file2', fh, DATA, 0)
+    ok H.release('/file2', fh)
+  }],
+]
+
+ROOTS = [
+  ['MetaDir', lambda { metadir }],
+  ['native', lambda { metadir(FuseFS::NativeMetaDir) }],
+  ['synthetic', lambda { SyntheticDir.new(FILES) }],
+  ['raw', lambda { RawDir.new(FILES) }],
+]
+
+puts "#{ITERATIONS} iterations each"
+printf("%-20s %-10s %12s %10s %12s\n", 'op', 'root', 'ops/s', 'us/op',
+       'calls/op')
+OPS.each do |name, op|
+  ROOTS.each do |rootname, root|
+    FuseFS.set_root(root.call)
+    op.call
+    FuseFS.reset_stats
+    secs = Benchmark.realtime { ITERATIONS.times { op.call } }
+    calls = 0
+    FuseFS.stats[:callbacks].each_value { |t| calls += t[:calls] }
+    printf("%-20s %-10s %12.0f %10.2f %12.1f\n", name, rootname,
+           ITERATIONS / secs, secs * 1_000_000 / ITERATIONS,
+           calls.to_f / ITERATIONS)
+  end
+end
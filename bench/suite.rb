@@ -0,0 +1,330 @@
+#!/usr/bin/env ruby
+#
+# suite.rb
+#
+# Mounts sample roots and runs standard workloads against them through the
+# kernel, then prints each workload's ops/s and latency percentiles as JSON,
+# so runs of different FuseFS versions can be compared. Needs FUSE and
+# fusermount. bench/dispatch.rb measures FuseFS alone, without mounting.
+#
+# Usage: ruby bench/suite.rb [workload ...]
+#
+# Workloads: stat ls seq_write seq_read rand_write rand_read create_delete
+#   (all by default)
+#
+# Environment:
+#   BENCH_ENTRIES  directory sizes to ls -l (default 10000,100000)
+#   BENCH_SIZES    file sizes in MB to read and write (default 1,64;
+#                  up to 4096 is supported, given the disk space)
+#   BENCH_FILES    files to stat, create and delete (default 1000)
+#   BENCH_OUT      write the JSON here instead of to stdout
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'tmpdir'
+require 'fileutils'
+require File.expand_path('../../sample/mirrorfs', __FILE__)
+
+def env_list(name, default)
+  (ENV[name] || default).split(',').map { |n| n.to_i }
+end
+
+ENTRIES   = env_list('BENCH_ENTRIES', '10000,100000')
+SIZES     = env_list('BENCH_SIZES', '1,64')
+FILES     = (ENV['BENCH_FILES'] || 1000).to_i
+BLOCK     = 128 * 1024
+SMALL     = 4096
+RANDOM    = 1000
+MB        = 1024 * 1024
+METADIR_MAX_MB = 256
+WORKLOADS = %w|stat ls seq_write seq_read rand_write rand_read create_delete|
+
+# Generated content, with nothing stored: /ls<n> holds n small files, and
+# /big/<mb> is a read-only file of that many megabytes, read raw.
+class GeneratedDir < FuseFS::FuseDir
+  SMALL_DATA = 'x' * SMALL
+
+  def initialize
+    @listings = {}
+    ENTRIES.each do |n|
+      @listings["ls#{n}"] = (0...n).map { |i| "f#{i}" }
+    end
+    @zeros = "\0" * BLOCK
+  end
+
+  def directory?(path)
+    path == '/' || path == '/big' || @listings.has_key?(path[1..-1])
+  end
+
+  def contents(path)
+    case path
+    when '/'    then @listings.keys + ['big']
+    when '/big' then SIZES.map { |mb| mb.to_s }
+    else             @listings[path[1..-1]] || []
+    end
+  end
+
+  def file?(path)
+    return true if big(path)
+    path =~ %r{^/(ls(\d+))/f(\d+)$} && @listings[$1] && $3.to_i < $2.to_i
+  end
+
+  def size(path)
+    mb = big(path)
+    mb ? mb * MB : SMALL
+  end
+
+  def read_file(path)
+    SMALL_DATA
+  end
+
+  def raw_open(path, mode)
+    !big(path).nil? && mode == 'r'
+  end
+
+  def raw_read(path, off, sz)
+    return '' if off >= size(path)
+    sz = size(path) - off if off + sz > size(path)
+    sz <= BLOCK ? @zeros[0, sz] : "\0" * sz
+  end
+
+  def raw_close(path)
+  end
+
+  def big(path)
+    path =~ %r{^/big/(\d+)$} && SIZES.include?($1.to_i) ? $1.to_i : nil
+  end
+end
+
+# Fills an empty MetaDir or NativeMetaDir with the /ls<n> directories.
+def filled(root)
+  ENTRIES.each do |n|
+    root.mkdir("/ls#{n}")
+    n.times { |i| root.write_to("/ls#{n}/f#{i}", GeneratedDir::SMALL_DATA) }
+  end
+  root
+end
+
+# Each root: how to build it in the mounting process, what is set up
+# before mounting, and what it can do.
+ROOTS = [
+  { :name => 'metadir', :writable => true, :max_mb => METADIR_MAX_MB,
+    :root => lambda { |dir| filled(FuseFS::MetaDir.new) } },
+  { :name => 'native', :writable => true, :max_mb => METADIR_MAX_MB,
+    :root => lambda { |dir| filled(FuseFS::NativeMetaDir.new) } },
+  { :name => 'generated', :writable => false, :max_mb => nil,
+    :root => lambda { |dir| GeneratedDir.new } },
+  { :name => 'mirror', :writable => true, :max_mb => nil,
+    :setup => lambda { |dir|
+      ENTRIES.each do |n|
+        Dir.mkdir(File.join(dir, "ls#{n}"))
+        n.times do |i|
+          File.open(File.join(dir, "ls#{n}", "f#{i}"), 'w') do |f|
+            f.write(GeneratedDir::SMALL_DATA)
+          end
+        end
+      end
+    },
+    :root => lambda { |dir| MirrorDir.new(dir) } },
+]
+
+# Runs the block with <root> mounted in a child process.
+def with_mount(root)
+  mnt = Dir.mktmpdir('fusefs-bench-mnt')
+  dir = Dir.mktmpdir('fusefs-bench-dir')
+  root[:setup].call(dir) if root[:setup]
+  pid = fork do
+    FuseFS.set_root(root[:root].call(dir))
+    FuseFS.mount_under(mnt)
+    FuseFS.run
+    exit!(0)
+  end
+  parent = File.stat(File.dirname(mnt)).dev
+  deadline = Time.now + 60
+  while File.stat(mnt).dev == parent
+    raise "#{root[:name]} did not mount" if Time.now > deadline
+    sleep 0.1
+  end
+  yield mnt
+ensure
+  system('fusermount', '-u', mnt) if mnt
+  Process.wait(pid) if pid
+  FileUtils.rm_rf(dir) if dir
+  Dir.rmdir(mnt) if mnt && File.directory?(mnt)
+end
+
+def timed(latencies)
+  start = Time.now.to_f
+  ret = yield
+  latencies << Time.now.to_f - start
+  ret
+end
+
+def percentile(sorted, pct)
+  return nil if sorted.empty?
+  sorted[[(sorted.size * pct / 100.0).ceil - 1, 0].max]
+end
+
+def result(root, workload, latencies, extra = {})
+  sorted = latencies.sort
+  total = sorted.inject(0.0) { |sum, t| sum + t }
+  us = lambda { |t| t && t * 1_000_000 }
+  res = {
+    'root' => root, 'workload' => workload, 'ops' => sorted.size,
+    'seconds' => total,
+    'ops_per_sec' => total > 0 ? sorted.size / total : nil,
+    'latency_us' => {
+      'p50' => us.call(percentile(sorted, 50)),
+      'p90' => us.call(percentile(sorted, 90)),
+      'p99' => us.call(percentile(sorted, 99)),
+      'max' => us.call(sorted.last),
+    },
+  }
+  res.update(extra)
+end
+
+def mb_per_sec(bytes, latencies)
+  total = latencies.inject(0.0) { |sum, t| sum + t }
+  total > 0 ? bytes / total / MB : nil
+end
+
+# The workloads. Each returns a list of results.
+
+def bench_stat(root, mnt)
+  n = ENTRIES.min
+  lat = []
+  FILES.times { timed(lat) { File.stat("#{mnt}/ls#{n}/f#{rand(n)}") } }
+  [result(root[:name], 'stat', lat)]
+end
+
+def bench_ls(root, mnt)
+  ENTRIES.map do |n|
+    lat = []
+    names = timed(lat) { Dir.entries("#{mnt}/ls#{n}") } - ['.', '..']
+    names.each { |name| timed(lat) { File.lstat("#{mnt}/ls#{n}/#{name}") } }
+    result(root[:name], "ls_l_#{n}", lat, 'entries' => names.size)
+  end
+end
+
+def sizes_for(root)
+  SIZES.select { |mb| root[:max_mb].nil? || mb <= root[:max_mb] }
+end
+
+def bench_seq_write(root, mnt)
+  return [] unless root[:writable]
+  data = 'x' * BLOCK
+  sizes_for(root).map do |mb|
+    lat = []
+    f = File.open("#{mnt}/seq#{mb}", 'w')
+    (mb * MB / BLOCK).times { timed(lat) { f.syswrite(data) } }
+    timed(lat) { f.close }
+    result(root[:name], "seq_write_#{mb}mb", lat,
+           'mb_per_sec' => mb_per_sec(mb * MB, lat))
+  end
+end
+
+def seq_path(root, mnt, mb)
+  root[:writable] ? "#{mnt}/seq#{mb}" : "#{mnt}/big/#{mb}"
+end
+
+def bench_seq_read(root, mnt)
+  sizes_for(root).map do |mb|
+    lat = []
+    bytes = 0
+    File.open(seq_path(root, mnt, mb)) do |f|
+      loop do
+        buf = timed(lat) { f.sysread(BLOCK) rescue nil }
+        break unless buf
+        bytes += buf.size
+      end
+    end
+    result(root[:name], "seq_read_#{mb}mb", lat,
+           'mb_per_sec' => mb_per_sec(bytes, lat))
+  end
+end
+
+def bench_rand_write(root, mnt)
+  return [] unless root[:writable]
+  data = 'y' * SMALL
+  sizes_for(root).map do |mb|
+    lat = []
+    f = File.open(seq_path(root, mnt, mb), 'r+')
+    RANDOM.times do
+      f.sysseek(rand(mb * MB / SMALL) * SMALL)
+      timed(lat) { f.syswrite(data) }
+    end
+    timed(lat) { f.close }
+    result(root[:name], "rand_write_#{mb}mb", lat)
+  end
+end
+
+def bench_rand_read(root, mnt)
+  sizes_for(root).map do |mb|
+    lat = []
+    File.open(seq_path(root, mnt, mb)) do |f|
+      RANDOM.times do
+        f.sysseek(rand(mb * MB / SMALL) * SMALL)
+        timed(lat) { f.sysread(SMALL) }
+      end
+    end
+    result(root[:name], "rand_read_#{mb}mb", lat)
+  end
+end
+
+def bench_create_delete(root, mnt)
+  return [] unless root[:writable]
+  create, delete = [], []
+  Dir.mkdir("#{mnt}/small")
+  FILES.times do |i|
+    timed(create) { File.open("#{mnt}/small/f#{i}", 'w') { |f| f.write('x') } }
+  end
+  FILES.times { |i| timed(delete) { File.unlink("#{mnt}/small/f#{i}") } }
+  Dir.rmdir("#{mnt}/small")
+  [result(root[:name], 'create', create), result(root[:name], 'delete', delete)]
+end
+
+# JSON, without needing the json library.
+def to_json(obj)
+  case obj
+  when Hash
+    '{' + obj.map { |k, v| "#{to_json(k.to_s)}:#{to_json(v)}" }.join(',') + '}'
+  when Array
+    '[' + obj.map { |v| to_json(v) }.join(',') + ']'
+  when String
+    '"' + obj.gsub(/["\\]/) { |c| "\\#{c}" } + '"'
+  when Float
+    obj.nan? || obj.infinite? ? 'null' : obj.to_s
+  when nil
+    'null'
+  else
+    obj.to_s
+  end
+end
+
+if $0 == __FILE__
+  workloads = ARGV.empty? ? WORKLOADS : ARGV
+  (workloads - WORKLOADS).each { |w| abort "Unknown workload: #{w}" }
+
+  srand(42)
+  results = []
+  ROOTS.each do |root|
+    with_mount(root) do |mnt|
+      # Reads and random writes need the files seq_write makes.
+      if !workloads.include?('seq_write') && workloads.grep(/^rand|read/).any?
+        bench_seq_write(root, mnt)
+      end
+      WORKLOADS.select { |w| workloads.include?(w) }.each do |w|
+        results.concat(send("bench_#{w}", root, mnt))
+      end
+    end
+  end
+
+  json = to_json('fusefs' => FuseFS::VERSION, 'ruby' => RUBY_VERSION,
+                 'time' => Time.now.to_i, 'results' => results)
+  if ENV['BENCH_OUT']
+    File.open(ENV['BENCH_OUT'], 'w') { |f| f.puts json }
+  else
+    puts json
+  end
+end
@@ -17,5 +17,18 @@ end
 have_header('sys/statvfs.h')
 have_header('sys/statfs.h')
 
+# Newer rubies hide RString, and give us this to set its length.
+have_func('rb_str_set_len')
+
+# They also make $! read-only, so it is cleared with this.
+have_func('rb_set_errinfo')
+
+# Linux can spill file buffers to memory-backed files.
+have_func('memfd_create', 'sys/mman.h')
+
+# A monotonic clock for FuseFS.stats timings. Older glibc keeps it in librt.
+have_library('rt', 'clock_gettime')
+have_func('clock_gettime', 'time.h')
+
 # Ensure we have the fuse lib.
 create_makefile('fusefs_lib')
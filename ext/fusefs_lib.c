@@ -8,15 +8,24 @@
 
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include <fuse.h>
 #include <fuse/fuse_lowlevel.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/types.h>
 // #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <ruby.h>
 
 #ifdef DEBUG
@@ -25,11 +34,68 @@
 
 #include "fusefs_fuse.h"
 
+#ifndef HAVE_RB_STR_SET_LEN
+#define rb_str_set_len(str,n) (RSTRING(str)->len = (n))
+#endif
+
 /* init_time
  *
  * All files will have a modified time equal to this. */
 time_t init_time;
 
+/* rf_now
+ *
+ * The current time, in seconds, with sub-second precision. */
+static double
+rf_now() {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* rf_nsec
+ *
+ * A monotonic clock in nanoseconds, for timing operations. */
+static unsigned long long
+rf_nsec() {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/* rf_timing
+ *
+ * Calls, errors and a latency histogram for one operation or callback.
+ * Bucket i of the histogram counts calls that took 2^i to 2^(i+1) ns.
+ */
+#define RF_HIST_BUCKETS  40
+
+typedef struct {
+  unsigned long calls;
+  unsigned long errors;
+  unsigned long long total_ns;
+  unsigned long hist[RF_HIST_BUCKETS];
+} rf_timing;
+
+static void
+rf_timing_add(rf_timing *t, unsigned long long ns, int failed) {
+  int bucket = 0;
+  unsigned long long n = ns;
+  while ((n >>= 1) && (bucket < RF_HIST_BUCKETS - 1))
+    bucket++;
+  t->calls++;
+  t->total_ns += ns;
+  t->hist[bucket]++;
+  if (failed)
+    t->errors++;
+}
+
 /* opened_file
  *
  * FuseFS uses the opened_file list to keep files that are written to in
@@ -37,14 +103,39 @@ time_t init_time;
  * and file contents returned by FuseRoot.read_file until FUSE informs
  * us it is safe to close.
  */
+/* Paths shorter than this are kept in the opened_file itself. */
+#define RF_INLINE_PATH  64
+
+struct __rf_cache_entry_;
+
 typedef struct __opened_file_ {
   char   *path;
+  char   path_buf[RF_INLINE_PATH];
+  struct __rf_cache_entry_ *cache;
   char   *value;
+  size_t capa;
+  int    spill_fd;
+  int    sparse;
   int    modified;
-  long   writesize;
-  long   size;
-  long   zero_offset;
+  off_t  writesize;
+  off_t  size;
+  off_t  zero_offset;
+  int    append;
   int    raw;
+  VALUE  handle;
+  int    fd;
+  char   *ra_buf;
+  size_t ra_size;
+  off_t  ra_off;
+  size_t ra_len;
+  off_t  ra_next;
+  size_t ra_window;
+  char   *wb_buf;
+  size_t wb_size;
+  off_t  wb_off;
+  size_t wb_len;
+  double wb_time;
+  int    wb_error;
   struct __opened_file_ *next;
 } opened_file;
 
@@ -61,16 +152,718 @@ file_openedP(const char *path) {
   return 0;
 }
 
+/* A path may be opened more than once only while every open of it is
+ * served by its own raw handle object. */
+static int
+file_busyP(const char *path) {
+  opened_file *ptr;
+  for (ptr = opened_head;ptr; ptr = ptr->next)
+    if (!strcmp(path,ptr->path) && (ptr->handle == Qnil)) return 1;
+  return 0;
+}
+
+/* rf_add_opened
+ *
+ * Links a new opened_file into opened_head and stores it as the FUSE
+ * file handle, so read, write and release find it without searching.
+ */
+static int
+rf_add_opened(opened_file *newfile, struct fuse_file_info *fi) {
+  newfile->next = opened_head;
+  opened_head = newfile;
+  if (fi)
+    fi->fh = (uintptr_t) newfile;
+  return 0;
+}
+
+/* rf_find_opened
+ *
+ * Returns the opened_file for a FUSE file handle. Files opened without
+ * one fall back to a search by path.
+ */
+static opened_file *
+rf_find_opened(const char *path, struct fuse_file_info *fi) {
+  opened_file *ptr;
+  if (fi && fi->fh)
+    return (opened_file *) (uintptr_t) fi->fh;
+  for (ptr = opened_head;ptr;ptr = ptr->next)
+    if (strcmp(ptr->path,path) == 0) break;
+  return ptr;
+}
+
+/* rf_stats
+ *
+ * Counters returned by FuseFS.stats.
+ */
+static struct {
+  unsigned long raw_reads;       /* raw reads made to Ruby or pread */
+  unsigned long readahead_hits;  /* raw reads served from read-ahead */
+  unsigned long readahead_bytes; /* bytes fetched ahead of the reader */
+  unsigned long raw_writes;      /* raw writes made to Ruby or pwrite */
+  unsigned long writebehind_hits;  /* raw writes merged into another */
+  unsigned long writebehind_errors; /* failed writes reported late */
+  unsigned long buffer_bytes;    /* bytes of file buffers held in memory */
+  unsigned long spill_bytes;     /* bytes of file buffers spilled to disk */
+  unsigned long spills;          /* buffers moved out of memory */
+  unsigned long spill_failures;  /* buffers refused for lack of spill space */
+  unsigned long pool_hits;       /* buffers reused from rf_pool */
+  unsigned long cache_hits;      /* read-only opens served from rf_cache */
+  unsigned long cache_misses;    /* read-only opens that called read_file */
+  unsigned long cache_bytes;     /* bytes of file contents in rf_cache */
+  unsigned long attr_hits;       /* getattrs served from rf_attrs */
+  unsigned long attr_misses;     /* getattrs that asked FuseRoot */
+  unsigned long stale_hits;      /* stale attributes or contents served */
+  unsigned long refreshes;       /* stale entries refreshed in the background */
+  unsigned long timeouts;        /* callbacks that ran out of time */
+  unsigned long exceptions;      /* callbacks that raised */
+  unsigned long slow_callbacks;  /* callbacks over slow_threshold */
+} rf_stats;
+
+/* Largest read-ahead window for raw files, in bytes. 0 turns it off. */
+static size_t readahead_max = 0;
+
+/* Raw writes are held back and merged until this many bytes are waiting,
+ * or the oldest has waited writebehind_delay seconds. 0 turns it off. */
+static size_t writebehind_max = 0;
+static double writebehind_delay = 1.0;
+
+/* File buffers beyond this many bytes in memory are spilled to an
+ * unlinked temporary file. 0 means no limit. */
+static size_t buffer_budget = 0;
+
+/* rf_pool
+ *
+ * Buffers of up to 64k are allocated in power-of-two size classes, and
+ * up to RF_POOL_DEPTH freed buffers of each class are kept for the next
+ * open, chained through their first bytes.
+ */
+#define RF_POOL_MIN      1024
+#define RF_POOL_CLASSES  7
+#define RF_POOL_DEPTH    16
+
+static char *rf_pool[RF_POOL_CLASSES];
+static int   rf_pool_count[RF_POOL_CLASSES];
+
+static int
+rf_pool_class(size_t size) {
+  int class = 0;
+  size_t csize = RF_POOL_MIN;
+  while ((csize < size) && (class < RF_POOL_CLASSES)) {
+    csize <<= 1;
+    class++;
+  }
+  return class;
+}
+
+/* rf_buf_alloc, rf_buf_free and rf_buf_realloc
+ *
+ * Allocate, free and resize a buffer through rf_pool. rf_buf_alloc and
+ * rf_buf_realloc round *capa up to its size class; rf_buf_realloc keeps
+ * the first keep bytes. They use malloc, not ALLOC_N, since they are
+ * called from FUSE callbacks, where NoMemoryError has nowhere to go:
+ * they return NULL instead, and rf_buf_realloc leaves buf as it was.
+ */
+static char *
+rf_buf_alloc(size_t *capa) {
+  int class = rf_pool_class(*capa);
+  char *buf;
+  if (class >= RF_POOL_CLASSES)
+    return malloc(*capa);
+  *capa = RF_POOL_MIN << class;
+  if (rf_pool[class] == NULL)
+    return malloc(*capa);
+  buf = rf_pool[class];
+  rf_pool[class] = *(char **) buf;
+  rf_pool_count[class]--;
+  rf_stats.pool_hits++;
+  return buf;
+}
+
+static void
+rf_buf_free(char *buf, size_t capa) {
+  int class;
+  if (buf == NULL)
+    return;
+  class = rf_pool_class(capa);
+  if ((class >= RF_POOL_CLASSES) || (rf_pool_count[class] >= RF_POOL_DEPTH) ||
+      (capa != (RF_POOL_MIN << class))) {
+    free(buf);
+    return;
+  }
+  *(char **) buf = rf_pool[class];
+  rf_pool[class] = buf;
+  rf_pool_count[class]++;
+}
+
+static char *
+rf_buf_realloc(char *buf, size_t oldcapa, size_t *capa, size_t keep) {
+  char *newbuf;
+  if ((rf_pool_class(oldcapa) >= RF_POOL_CLASSES) &&
+      (rf_pool_class(*capa) >= RF_POOL_CLASSES))
+    return realloc(buf, *capa);
+  newbuf = rf_buf_alloc(capa);
+  if (newbuf == NULL)
+    return NULL;
+  if (keep)
+    memcpy(newbuf, buf, keep);
+  rf_buf_free(buf, oldcapa);
+  return newbuf;
+}
+
+/* rf_cache
+ *
+ * Contents returned by read_file, kept across opens. Entries are found by
+ * path through a hash table and evicted least recently used first once
+ * cache_max_bytes is reached. Files opened read-only from the cache share
+ * its copy, so an entry dropped while open is only freed when released.
+ */
+typedef struct __rf_cache_entry_ {
+  char   *path;
+  char   *data;
+  off_t  size;
+  char   *validator;       /* etag or mtime when read */
+  double checked;          /* when it was last known to be current */
+  int    refs;             /* opened_files sharing data */
+  int    dead;             /* dropped from the cache while shared */
+  struct __rf_cache_entry_ *hnext;
+  struct __rf_cache_entry_ *prev, *next;
+} rf_cache_entry;
+
+#define RF_CACHE_BUCKETS  1024
+
+static rf_cache_entry *rf_cache[RF_CACHE_BUCKETS];
+static rf_cache_entry *rf_cache_head = NULL; /* most recently used */
+static rf_cache_entry *rf_cache_tail = NULL;
+
+/* Cached contents are kept up to this many bytes. 0 turns it off. */
+static size_t cache_max_bytes = 0;
+
+/* A cached file is served without asking FuseRoot for this many seconds,
+ * and after that only if its etag or mtime is unchanged. */
+static double cache_ttl = 1.0;
+
+static unsigned int
+rf_hash(const char *path) {
+  unsigned int hash = 2166136261U;
+  while (*path)
+    hash = (hash ^ (unsigned char) *path++) * 16777619U;
+  return hash;
+}
+
+#define rf_cache_hash(path) (rf_hash(path) % RF_CACHE_BUCKETS)
+
+static rf_cache_entry *
+rf_cache_find(const char *path) {
+  rf_cache_entry *entry;
+  for (entry = rf_cache[rf_cache_hash(path)]; entry; entry = entry->hnext)
+    if (strcmp(entry->path,path) == 0) break;
+  return entry;
+}
+
+static void
+rf_cache_free(rf_cache_entry *entry) {
+  free(entry->path);
+  free(entry->data);
+  free(entry->validator);
+  free(entry);
+}
+
+/* rf_cache_drop
+ *
+ * Takes an entry out of the cache, freeing it unless it is still open.
+ */
+static void
+rf_cache_drop(rf_cache_entry *entry) {
+  rf_cache_entry **link = &rf_cache[rf_cache_hash(entry->path)];
+  while (*link != entry)
+    link = &(*link)->hnext;
+  *link = entry->hnext;
+
+  if (entry->prev) entry->prev->next = entry->next;
+  else rf_cache_head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else rf_cache_tail = entry->prev;
+
+  rf_stats.cache_bytes -= entry->size;
+  if (entry->refs > 0)
+    entry->dead = 1;
+  else
+    rf_cache_free(entry);
+}
+
+/* rf_cache_touch
+ *
+ * Moves an entry to the front of the LRU list.
+ */
+static void
+rf_cache_touch(rf_cache_entry *entry) {
+  if (entry == rf_cache_head)
+    return;
+  entry->prev->next = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else rf_cache_tail = entry->prev;
+  entry->prev = NULL;
+  entry->next = rf_cache_head;
+  rf_cache_head->prev = entry;
+  rf_cache_head = entry;
+}
+
+/* rf_cache_trim
+ *
+ * Evicts the least recently used entries until room more bytes fit.
+ */
+static void
+rf_cache_trim(size_t room) {
+  while (rf_cache_tail && (rf_stats.cache_bytes + room > cache_max_bytes))
+    rf_cache_drop(rf_cache_tail);
+}
+
+/* rf_cache_insert
+ *
+ * Caches a copy of a file's contents, replacing what was cached for the
+ * path, and returns the new entry. Files bigger than the whole cache
+ * aren't kept, and NULL is returned.
+ */
+static rf_cache_entry *
+rf_cache_insert(const char *path, const char *data, off_t size,
+                char *validator) {
+  rf_cache_entry *entry;
+  unsigned int hash;
+
+  if ((entry = rf_cache_find(path)) != NULL)
+    rf_cache_drop(entry);
+  if ((size_t) size > cache_max_bytes)
+    return NULL;
+  rf_cache_trim(size);
+
+  entry = ALLOC(rf_cache_entry);
+  memset(entry,0,sizeof(rf_cache_entry));
+  entry->path = strdup(path);
+  entry->data = ALLOC_N(char, size + 1);
+  memcpy(entry->data, data, size);
+  entry->data[size] = '\0';
+  entry->size = size;
+  entry->validator = validator ? strdup(validator) : NULL;
+  entry->checked = rf_now();
+
+  hash = rf_cache_hash(path);
+  entry->hnext = rf_cache[hash];
+  rf_cache[hash] = entry;
+  entry->next = rf_cache_head;
+  if (rf_cache_head) rf_cache_head->prev = entry;
+  else rf_cache_tail = entry;
+  rf_cache_head = entry;
+  rf_stats.cache_bytes += size;
+  return entry;
+}
+
+/* rf_attrs
+ *
+ * What getattr found for recently asked paths, including that they don't
+ * exist, kept for attr_ttl seconds. Each path has one slot it can be
+ * kept in, so a path asked for displaces whatever shares its slot.
+ */
+typedef struct {
+  char   *path;
+  struct stat st;
+  int    ret;              /* 0 or -ENOENT */
+  double checked;
+} rf_attr_slot;
+
+#define RF_ATTR_SLOTS  4096
+
+static rf_attr_slot rf_attrs[RF_ATTR_SLOTS];
+
+/* Attributes are cached for this many seconds. 0 turns it off. */
+static double attr_ttl = 0.0;
+
+/* Cached attributes and contents this many seconds past their TTL are
+ * still served, while they are refreshed after the reply. 0 turns it
+ * off. */
+static double stale_ttl = 0.0;
+
+static rf_attr_slot *
+rf_attr_find(const char *path) {
+  rf_attr_slot *slot = &rf_attrs[rf_hash(path) % RF_ATTR_SLOTS];
+  if (slot->path && (strcmp(slot->path,path) == 0))
+    return slot;
+  return NULL;
+}
+
+static void
+rf_attr_store(const char *path, struct stat *st, int ret) {
+  rf_attr_slot *slot = &rf_attrs[rf_hash(path) % RF_ATTR_SLOTS];
+  if (!slot->path || strcmp(slot->path,path)) {
+    free(slot->path);
+    slot->path = strdup(path);
+  }
+  slot->st = *st;
+  slot->ret = ret;
+  slot->checked = rf_now();
+}
+
+static void
+rf_attr_drop(rf_attr_slot *slot) {
+  free(slot->path);
+  slot->path = NULL;
+}
+
+/* rf_cache_invalidate and rf_cache_invalidate_under
+ *
+ * Drop the contents and attributes cached for a path, or for a path and
+ * everything below it. A NULL path drops everything.
+ */
+static void
+rf_cache_invalidate(const char *path) {
+  rf_cache_entry *entry;
+  rf_attr_slot *slot;
+  if (rf_cache_head && ((entry = rf_cache_find(path)) != NULL))
+    rf_cache_drop(entry);
+  if ((attr_ttl > 0) && ((slot = rf_attr_find(path)) != NULL))
+    rf_attr_drop(slot);
+}
+
+static int
+rf_path_underP(const char *path, const char *dir, size_t len) {
+  return (dir == NULL) ||
+         ((strncmp(path,dir,len) == 0) &&
+          ((path[len] == '\0') || (path[len] == '/') || (len == 1)));
+}
+
+static void
+rf_cache_invalidate_under(const char *path) {
+  rf_cache_entry *entry, *next;
+  size_t len = path ? strlen(path) : 0;
+  int i;
+  for (entry = rf_cache_head; entry; entry = next) {
+    next = entry->next;
+    if (rf_path_underP(entry->path,path,len))
+      rf_cache_drop(entry);
+  }
+  for (i = 0; i < RF_ATTR_SLOTS; i++)
+    if (rf_attrs[i].path && rf_path_underP(rf_attrs[i].path,path,len))
+      rf_attr_drop(&rf_attrs[i]);
+}
+
+/* rf_cache_share and rf_cache_put
+ *
+ * Give an open file a share of a cache entry's contents, and release it.
+ */
+static void
+rf_cache_share(opened_file *ptr, rf_cache_entry *entry) {
+  ptr->cache = entry;
+  ptr->value = entry->data;
+  ptr->size = entry->size;
+  entry->refs++;
+}
+
+static void
+rf_cache_put(rf_cache_entry *entry) {
+  if ((--entry->refs == 0) && entry->dead)
+    rf_cache_free(entry);
+}
+
+/* rf_new_file and rf_free_file
+ *
+ * Allocate a cleared opened_file (or editor_file), and free one along
+ * with everything it holds. opened_files are allocated RF_SLAB_FILES at a
+ * time, and freed ones are kept on rf_free_files for reuse.
+ */
+#define RF_SLAB_FILES  32
+
+static opened_file *rf_free_files = NULL;
+
+static opened_file *
+rf_new_file() {
+  opened_file *ptr;
+  int i;
+
+  if (rf_free_files == NULL) {
+    ptr = ALLOC_N(opened_file, RF_SLAB_FILES);
+    for (i = 0; i < RF_SLAB_FILES; i++) {
+      ptr[i].next = rf_free_files;
+      rf_free_files = &ptr[i];
+    }
+  }
+  ptr = rf_free_files;
+  rf_free_files = ptr->next;
+
+  memset(ptr,0,sizeof(opened_file));
+  ptr->handle = Qnil;
+  ptr->fd = -1;
+  ptr->spill_fd = -1;
+  return ptr;
+}
+
+/* rf_set_path
+ *
+ * Gives a file its path, in path_buf if it fits.
+ */
+static void
+rf_set_path(opened_file *ptr, const char *path) {
+  size_t len = strlen(path);
+  char *old = ptr->path;
+
+  if (len < RF_INLINE_PATH) {
+    memmove(ptr->path_buf, path, len + 1);
+    ptr->path = ptr->path_buf;
+  } else {
+    ptr->path = ALLOC_N(char, len + 1);
+    memcpy(ptr->path, path, len + 1);
+  }
+  if (old && (old != ptr->path_buf))
+    free(old);
+}
+
+static void
+rf_free_file(opened_file *ptr) {
+  if (ptr->cache) {
+    rf_cache_put(ptr->cache);
+  } else if (ptr->spill_fd >= 0) {
+    munmap(ptr->value, ptr->capa);
+    close(ptr->spill_fd);
+    rf_stats.spill_bytes -= ptr->capa;
+  } else if (ptr->value) {
+    rf_buf_free(ptr->value, ptr->capa);
+    rf_stats.buffer_bytes -= ptr->capa;
+  }
+  rf_buf_free(ptr->ra_buf, ptr->ra_size);
+  rf_buf_free(ptr->wb_buf, ptr->wb_size);
+  rf_stats.buffer_bytes -= ptr->ra_size + ptr->wb_size;
+  if (ptr->path != ptr->path_buf)
+    free(ptr->path);
+  ptr->next = rf_free_files;
+  rf_free_files = ptr;
+}
+
+/* rf_over_budget
+ *
+ * True if holding grow more bytes in memory would go past buffer_budget.
+ */
+static int
+rf_over_budget(size_t grow) {
+  return buffer_budget && (rf_stats.buffer_bytes + grow > buffer_budget);
+}
+
+/* rf_spill_open
+ *
+ * Returns a descriptor for an anonymous file to spill a buffer into:
+ * a memfd where the system has one, else an unlinked temporary file.
+ */
+static int
+rf_spill_open() {
+  char tmpl[] = P_tmpdir "/fusefsXXXXXX";
+  int fd;
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create("fusefs", MFD_CLOEXEC);
+  if (fd >= 0)
+    return fd;
+#endif
+  fd = mkstemp(tmpl);
+  if (fd >= 0)
+    unlink(tmpl);
+  return fd;
+}
+
+/* rf_spill_map
+ *
+ * Sizes a spill file to capa bytes and maps it in place of ptr->value,
+ * which must already be unmapped or on the heap. A sparse file is only
+ * extended, leaving holes that take no space; anything else has its
+ * space reserved up front. Returns the mapping, or NULL if the space
+ * isn't there.
+ */
+static char *
+rf_spill_map(int fd, size_t capa, int sparse) {
+  char *map;
+  if (sparse ? (ftruncate(fd, capa) != 0) : (posix_fallocate(fd, 0, capa) != 0))
+    return NULL;
+  map = mmap(NULL, capa, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+/* rf_file_realloc
+ *
+ * Gives a file's value room for capa bytes. Buffers stay on the heap
+ * while buffer_budget allows; past that they move to a spill file, and
+ * once spilled they grow there. Returns 0, or -ENOMEM or -ENOSPC with
+ * the value untouched when the heap or even spill space has run out.
+ */
+static int
+rf_file_realloc(opened_file *ptr, size_t capa) {
+  char *map;
+  int fd;
+
+  if (ptr->spill_fd >= 0) {
+    munmap(ptr->value, ptr->capa);
+    map = rf_spill_map(ptr->spill_fd, capa, ptr->sparse);
+    if (map == NULL) {
+      /* The old contents are still in the file; map them back. */
+      ptr->value = mmap(NULL, ptr->capa, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, ptr->spill_fd, 0);
+      rf_stats.spill_failures++;
+      return -ENOSPC;
+    }
+    rf_stats.spill_bytes += capa - ptr->capa;
+    ptr->value = map;
+    ptr->capa = capa;
+    return 0;
+  }
+
+  if (!ptr->sparse && !rf_over_budget(capa - ptr->capa)) {
+    map = rf_buf_realloc(ptr->value, ptr->capa, &capa,
+                         ptr->value ? ptr->size + 1 : 0);
+    if (map == NULL)
+      return -ENOMEM;
+    ptr->value = map;
+    rf_stats.buffer_bytes += capa - ptr->capa;
+    ptr->capa = capa;
+    return 0;
+  }
+
+  fd = rf_spill_open();
+  map = (fd < 0) ? NULL : rf_spill_map(fd, capa, ptr->sparse);
+  if (map == NULL) {
+    if (fd >= 0)
+      close(fd);
+    rf_stats.spill_failures++;
+    return -ENOSPC;
+  }
+  if (ptr->value) {
+    memcpy(map, ptr->value, ptr->size + 1);
+    rf_buf_free(ptr->value, ptr->capa);
+    rf_stats.buffer_bytes -= ptr->capa;
+  }
+  ptr->value = map;
+  ptr->spill_fd = fd;
+  ptr->capa = capa;
+  rf_stats.spill_bytes += capa;
+  rf_stats.spills++;
+  return 0;
+}
+
 /* When a file is being written to, its value starts with this much
- * allocated and grows by this much when necessary. */
+ * allocated, and grows by at least this much when necessary. */
 #define FILE_GROW_SIZE  1024
 
+/* rf_file_alloc and rf_file_load
+ *
+ * rf_file_alloc gives an empty file a value of capa bytes. rf_file_load
+ * fills one with a String body, leaving extra bytes of room past it.
+ * Both return 0 or -ENOSPC.
+ */
+static int
+rf_file_alloc(opened_file *ptr, size_t capa) {
+  int err = rf_file_realloc(ptr, capa);
+  if (err)
+    return err;
+  ptr->size = 0;
+  ptr->value[0] = '\0';
+  return 0;
+}
+
+static int
+rf_file_load(opened_file *ptr, VALUE body, long extra) {
+  char *value;
+  long len;
+  int err;
+
+  value = rb_str2cstr(body,&len);
+  err = rf_file_alloc(ptr, len + 1 + extra);
+  if (err)
+    return err;
+  memcpy(ptr->value, value, len);
+  ptr->size = len;
+  ptr->value[len] = '\0';
+  return 0;
+}
+
+/* A write or truncate that would leave a hole this big makes the file
+ * sparse. */
+#define SPARSE_HOLE_SIZE  (1024 * 1024)
+
+/* Files are off_t sized, but a buffer can't outgrow the address space. */
+#define RF_BUFFER_FITS(n)  ((off_t) (size_t) (n) == (n))
+
+/* rf_file_sparse
+ *
+ * Extends a file to size bytes without allocating the hole: its value
+ * moves to a sparse spill file, where unwritten pages take no memory or
+ * disk and read back as zeroes. Returns 0, -EFBIG or -ENOSPC.
+ */
+static int
+rf_file_sparse(opened_file *ptr, off_t size) {
+  size_t capa;
+  int err;
+
+  if (!RF_BUFFER_FITS(size + 1 + FILE_GROW_SIZE))
+    return -EFBIG;
+
+  /* Cut anything stale past the end, so the hole reads as zeroes. */
+  if ((ptr->spill_fd >= 0) &&
+      ((ftruncate(ptr->spill_fd, ptr->size) != 0) ||
+       (ftruncate(ptr->spill_fd, ptr->capa) != 0)))
+    return -ENOSPC;
+
+  ptr->sparse = 1;
+  capa = size + 1 + FILE_GROW_SIZE;
+  capa -= capa % FILE_GROW_SIZE;
+  if ((capa > ptr->capa) || (ptr->spill_fd < 0)) {
+    err = rf_file_realloc(ptr, (capa > ptr->capa) ? capa : ptr->capa);
+    if (err) {
+      ptr->sparse = (ptr->spill_fd >= 0);
+      return err;
+    }
+  }
+  ptr->size = size;
+  ptr->value[size] = '\0';
+  return 0;
+}
+
+/* rf_file_grow and rf_file_resize
+ *
+ * rf_file_grow makes sure a file's value has room for size bytes and a
+ * trailing null, growing it by half again so that long runs of writes
+ * reallocate (or remap a spilled buffer) only a few times.
+ * rf_file_resize sets its size, zeroing anything between the old and
+ * new end. Both return 0, -EFBIG or -ENOSPC.
+ */
+static int
+rf_file_grow(opened_file *ptr, off_t size) {
+  size_t newsize;
+  if ((size + 1) <= ptr->capa)
+    return 0;
+  if (!RF_BUFFER_FITS(size + 1 + FILE_GROW_SIZE))
+    return -EFBIG;
+  newsize = size + 1 + FILE_GROW_SIZE;
+  if (newsize < ptr->capa + ptr->capa / 2)
+    newsize = ptr->capa + ptr->capa / 2;
+  newsize -= newsize % FILE_GROW_SIZE;
+  return rf_file_realloc(ptr, newsize);
+}
+
+static int
+rf_file_resize(opened_file *ptr, off_t size) {
+  int err;
+  if (size - ptr->size >= SPARSE_HOLE_SIZE)
+    return rf_file_sparse(ptr,size);
+  err = rf_file_grow(ptr,size);
+  if (err)
+    return err;
+  if (size > ptr->size)
+    memset(ptr->value + ptr->size, 0, size - ptr->size);
+  ptr->size = size;
+  ptr->value[ptr->size] = '\0';
+  return 0;
+}
+
 /* When a file is created, the OS will first mknod it, then attempt to
  *   fstat it immediately. We get around this by using a static path name
  *   for the most recently mknodd'd path. */
 static char   *created_file = NULL;
 static time_t  created_time = 0;
 
+
 /* Ruby Constants constants */
 VALUE cFuseFS      = Qnil; /* FuseFS class */
 VALUE cFSException = Qnil; /* Our Exception. */
@@ -85,6 +878,8 @@ VALUE FuseRoot     = Qnil; /* The root object we call */
 RMETHOD(id_dir_contents,"contents");
 RMETHOD(id_read_file,"read_file");
 RMETHOD(id_write_to,"write_to");
+RMETHOD(id_append_to,"append_to");
+RMETHOD(id_write_extents,"write_extents");
 RMETHOD(id_delete,"delete");
 RMETHOD(id_mkdir,"mkdir");
 RMETHOD(id_rmdir,"rmdir");
@@ -109,8 +904,23 @@ RMETHOD(id_raw_close,"raw_close");
 RMETHOD(id_raw_read,"raw_read");
 RMETHOD(id_raw_write,"raw_write");
 RMETHOD(id_raw_rename,"raw_rename");
+RMETHOD(id_rename,"rename");
+RMETHOD(id_raw_read_into,"raw_read_into");
+RMETHOD(id_raw_truncate,"raw_truncate");
+RMETHOD(id_truncate,"truncate");
+
+RMETHOD(id_open_file,"open_file");
+RMETHOD(id_etag,"etag");
+RMETHOD(id_call_with_deadline,"call_with_deadline");
+RMETHOD(id_watch_slow,"watch_slow");
+RMETHOD(id_backtrace,"backtrace");
+
+RMETHOD(id_read,"read");
+RMETHOD(id_read_into,"read_into");
+RMETHOD(id_write,"write");
+RMETHOD(id_close,"close");
+RMETHOD(id_fileno,"fileno");
 
-RMETHOD(id_dup,"dup");
 RMETHOD(id_to_i,"to_i");
 
 typedef unsigned long int (*rbfunc)();
@@ -131,6 +941,61 @@ debug(char *msg,...) {
 #define debug // debug
 #endif
 
+/* Raw handle objects returned by raw_open or open_file. They live in
+ * opened_file structs, so we keep them here for the GC to see. */
+static VALUE rf_handles = Qnil;
+
+/* rf_set_handle
+ *
+ * raw_open may return true, in which case the file is served by the
+ * path-based raw_read, raw_write and raw_close. Any other object is kept
+ * as the file's handle and receives read, write and close instead.
+ *
+ * If the handle is an IO, reads and writes go straight to its file
+ * descriptor with pread and pwrite, and Ruby only sees the close.
+ */
+static VALUE
+rf_fileno_protected(VALUE io) {
+  return rb_funcall(io,id_fileno,0);
+}
+
+static void
+rf_set_handle(opened_file *ptr, VALUE handle) {
+  VALUE fileno;
+  int error;
+
+  ptr->fd = -1;
+  if (handle == Qtrue) {
+    ptr->handle = Qnil;
+    return;
+  }
+  ptr->handle = handle;
+  rb_ary_push(rf_handles,handle);
+
+  /* An IO is read and written through its descriptor, without Ruby. */
+  if (rb_obj_is_kind_of(handle,rb_cIO)) {
+    fileno = rb_protect(rf_fileno_protected, handle, &error);
+    if (!error && FIXNUM_P(fileno)) {
+      ptr->fd = FIX2INT(fileno);
+      debug("  passing through to fd %d.\n", ptr->fd);
+    }
+  }
+}
+
+static void
+rf_free_handle(opened_file *ptr) {
+  long i;
+  if (ptr->handle == Qnil)
+    return;
+  for (i = RARRAY(rf_handles)->len - 1; i >= 0; i--) {
+    if (rb_ary_entry(rf_handles,i) == ptr->handle) {
+      rb_ary_delete_at(rf_handles,i);
+      break;
+    }
+  }
+  ptr->handle = Qnil;
+}
+
 /* catch_editor_files
  *
  * If this is a true value, then FuseFS will attempt to capture
@@ -210,6 +1075,50 @@ editor_fileP(const char *path) {
   return 0;
 }
 
+/* callback_timeout
+ *
+ * When set, FuseRoot and handle methods are called through
+ *   FuseFS.call_with_deadline, which returns rf_timed_out_obj
+ *   (FuseFS::TIMED_OUT) if one takes longer than this many seconds.
+ *   Once a callback has timed out, the rest of the operation's callbacks
+ *   are skipped, and it is failed (or served stale) with ETIMEDOUT.
+ */
+static double callback_timeout = 0.0;
+static VALUE  rf_timed_out_obj = Qnil;
+
+/* What rename returns to have FuseFS rename the file without it. */
+static VALUE  rf_fallback_obj = Qnil;
+static int    rf_op_timed_out = 0;
+
+/* rf_apply
+ *
+ * Calls a method on FuseRoot or a handle, within callback_timeout.
+ */
+static VALUE
+rf_apply(VALUE recv, ID to_call, VALUE args) {
+  if (callback_timeout > 0) {
+    rb_ary_unshift(args,ID2SYM(to_call));
+    rb_ary_unshift(args,recv);
+    return rb_apply(cFuseFS,id_call_with_deadline,args);
+  }
+  return rb_apply(recv,to_call,args);
+}
+
+/* rf_timed_outP
+ *
+ * True if a callback returned rf_timed_out_obj, and marks the operation
+ *   as having run out of time.
+ */
+static int
+rf_timed_outP(VALUE result) {
+  if ((result != rf_timed_out_obj) || (result == Qnil))
+    return 0;
+  debug("    ... timed out.\n");
+  rf_op_timed_out = 1;
+  rf_stats.timeouts++;
+  return 1;
+}
+
 /* rf_protected and rf_call
  *
  * Used for: protection.
@@ -225,29 +1134,234 @@ editor_fileP(const char *path) {
 static VALUE
 rf_protected(VALUE args) {
   ID to_call = SYM2ID(rb_ary_shift(args));
-  return rb_apply(FuseRoot,to_call,args);
+  return rf_apply(FuseRoot,to_call,args);
 }
 
 static VALUE
 rf_int_protected(VALUE args) {
   static VALUE empty_ary = Qnil;
-  if (empty_ary == Qnil) empty_ary = rb_ary_new();
+  if (empty_ary == Qnil) {
+    empty_ary = rb_ary_new();
+    rb_global_variable(&empty_ary);
+  }
   return rb_apply(args,id_to_i,empty_ary);
 }
 
-#define rf_call(p,m,a) \
-  rf_mcall(p,m, c_ ## m, a)
+/* rf_offt_protected
+ *
+ * Converts an object to an off_t, which may not fit in a VALUE, so it is
+ * left in rf_offt_value.
+ */
+static off_t rf_offt_value;
+
+static VALUE
+rf_offt_protected(VALUE arg) {
+  rf_offt_value = NUM2OFFT(rf_int_protected(arg));
+  return Qnil;
+}
+
+#define rf_call(p,m,a) \
+  rf_mcall(p,m, c_ ## m, a)
+
+/* Set when the last rf_call or rf_hcall raised an exception. */
+static int rf_call_failed = 0;
+
+/* rf_status
+ *
+ * Turns what a FuseRoot method that does something (truncate, rename)
+ *   returned into a FUSE result: -ETIMEDOUT if it ran out of time, -EIO if
+ *   it raised, -EACCES for false, the errno for a non-zero Integer, or 0.
+ */
+static int
+rf_status(VALUE ret) {
+  if (rf_call_failed)
+    return rf_op_timed_out ? -ETIMEDOUT : -EIO;
+  if (ret == Qfalse)
+    return -EACCES;
+  if (FIXNUM_P(ret) && FIX2LONG(ret)) {
+    long err = FIX2LONG(ret);
+    if ((err > 4095) || (err < -4095))
+      return -EIO;
+    return (err < 0) ? err : -err;
+  }
+  return 0;
+}
+
+/* rf_trace
+ *
+ * A ring of the last RF_TRACE_EVENTS operations and the FuseRoot and
+ *   handle methods they called, always kept for FuseFS.dump_trace.
+ *   Operations are dispatched one at a time, so recording an event is a
+ *   few stores with no locking, and nothing is formatted until a dump.
+ *   Paths are kept only as rf_hash values; methods called outside an
+ *   operation, such as background refreshes, have a path hash of 0.
+ */
+#define RF_TRACE_EVENTS   8192
+#define RF_TRACE_OP       0
+#define RF_TRACE_CALLBACK 1
+#define RF_TRACE_HANDLE   2
+
+typedef struct {
+  unsigned long long start;
+  unsigned long long end;
+  const char *name;           /* operation or method name */
+  unsigned int path_hash;
+  unsigned short kind;
+  unsigned short calls;       /* methods an operation called */
+  int result;                 /* operation result, or 1 if a method failed */
+} rf_trace_event;
+
+static rf_trace_event rf_trace[RF_TRACE_EVENTS];
+static unsigned long  rf_trace_next = 0;
+static unsigned int   rf_trace_path = 0;
+static unsigned short rf_trace_calls = 0;
+
+/* The operation being dispatched, for the slow log. */
+static const char *rf_current_op = NULL;
+static const char *rf_current_path = NULL;
+
+static void
+rf_trace_add(int kind, const char *name, unsigned long long start,
+             unsigned long long end, int result) {
+  rf_trace_event *ev = &rf_trace[rf_trace_next++ % RF_TRACE_EVENTS];
+  ev->start = start;
+  ev->end = end;
+  ev->name = name;
+  ev->path_hash = rf_trace_path;
+  ev->kind = kind;
+  ev->calls = (kind == RF_TRACE_OP) ? rf_trace_calls : 0;
+  ev->result = result;
+}
+
+/* rf_slow_log
+ *
+ * Used by: FuseFS.slow_log
+ *
+ * FuseRoot and handle methods that raised, or took more than
+ *   slow_threshold seconds, most recent last. A method raising is always
+ *   logged with its exception and backtrace. For slow methods, the
+ *   FuseFS.watch_slow thread samples where the method is while it runs
+ *   past the threshold, at most once every RF_SLOW_SAMPLE_GAP seconds.
+ */
+#define RF_SLOW_LOG        256
+#define RF_SLOW_SAMPLE_GAP 1.0
+
+static double slow_threshold = 0.0;
+static VALUE  rf_slow_log = Qnil;
+static VALUE  rf_slow_backtrace = Qnil;
+static double rf_slow_sampled_at = 0.0;
+static unsigned long long rf_callback_start = 0;
+
+/* rf_take_exception
+ *
+ * What a callback raised inside rb_protect, which is then cleared.
+ */
+static VALUE
+rf_take_exception() {
+#ifdef HAVE_RB_SET_ERRINFO
+  VALUE exc = rb_errinfo();
+  rb_set_errinfo(Qnil);
+#else
+  VALUE exc = rb_gv_get("$!");
+  rb_gv_set("$!",Qnil);
+#endif
+  rf_stats.exceptions++;
+  return exc;
+}
+
+static void
+rf_slow_record(const char *methname, int handle, const char *path,
+               unsigned long long ns, VALUE exc) {
+  VALUE entry = rb_hash_new();
+  char name[64];
+
+  if (!path)
+    path = rf_current_path;
+  snprintf(name,sizeof(name),"%s%s", handle ? "handle." : "", methname);
+  rb_hash_aset(entry,ID2SYM(rb_intern("op")),
+               rf_current_op ? rb_str_new2(rf_current_op) : Qnil);
+  rb_hash_aset(entry,ID2SYM(rb_intern("path")),
+               path ? rb_str_new2(path) : Qnil);
+  rb_hash_aset(entry,ID2SYM(rb_intern("callback")),rb_str_new2(name));
+  rb_hash_aset(entry,ID2SYM(rb_intern("seconds")),rb_float_new(ns / 1e9));
+  rb_hash_aset(entry,ID2SYM(rb_intern("exception")),exc);
+  if ((exc != Qnil) && rb_respond_to(exc,id_backtrace))
+    rb_hash_aset(entry,ID2SYM(rb_intern("backtrace")),
+                 rb_funcall(exc,id_backtrace,0));
+  else
+    rb_hash_aset(entry,ID2SYM(rb_intern("backtrace")),rf_slow_backtrace);
+
+  if (RARRAY(rf_slow_log)->len >= RF_SLOW_LOG)
+    rb_ary_shift(rf_slow_log);
+  rb_ary_push(rf_slow_log,entry);
+}
+
+/* rf_callbacks
+ *
+ * Timings for each FuseRoot and handle method, found by its ID. Root and
+ *   handle methods of the same name are kept apart.
+ */
+#define RF_CALLBACK_SLOTS 128
+
+static struct {
+  ID id;
+  int handle;
+  const char *name;
+  rf_timing timing;
+} rf_callbacks[RF_CALLBACK_SLOTS];
+
+static void
+rf_callback_done(ID method, const char *methname, int handle,
+                 const char *path, unsigned long long start, int failed,
+                 VALUE exc) {
+  unsigned long long end = rf_nsec();
+  unsigned int i = (method + handle) % RF_CALLBACK_SLOTS;
+  int n;
+
+  rf_trace_add(handle ? RF_TRACE_HANDLE : RF_TRACE_CALLBACK, methname,
+               start, end, failed);
+  rf_trace_calls++;
+
+  rf_callback_start = 0;
+  if ((exc != Qnil) ||
+      ((slow_threshold > 0) && ((end - start) / 1e9 >= slow_threshold))) {
+    if (exc == Qnil)
+      rf_stats.slow_callbacks++;
+    rf_slow_record(methname,handle,path,end - start,exc);
+  }
+  rf_slow_backtrace = Qnil;
+
+  for (n = 0; n < RF_CALLBACK_SLOTS; n++, i = (i + 1) % RF_CALLBACK_SLOTS) {
+    if (rf_callbacks[i].id == 0) {
+      rf_callbacks[i].id = method;
+      rf_callbacks[i].handle = handle;
+      rf_callbacks[i].name = methname;
+    } else if ((rf_callbacks[i].id != method) ||
+               (rf_callbacks[i].handle != handle)) {
+      continue;
+    }
+    rf_timing_add(&rf_callbacks[i].timing, end - start, failed);
+    return;
+  }
+}
 
 static VALUE
 rf_mcall(const char *path, ID method, char *methname, VALUE arg) {
   int error;
-  VALUE result;
+  unsigned long long start;
+  VALUE result, exc;
   VALUE methargs;
 
   if (!rb_respond_to(FuseRoot,method)) {
     return Qnil;
   }
 
+  /* Out of time already? Don't wait on the backend again. */
+  if (rf_op_timed_out) {
+    rf_call_failed = 1;
+    return Qnil;
+  }
+
   if (arg == Qnil) {
     debug("    root.%s(%s)\n", methname, path );
   } else {
@@ -267,7 +1381,13 @@ rf_mcall(const char *path, ID method, char *methname, VALUE arg) {
   rb_ary_unshift(methargs,ID2SYM(method));
 
   /* Set up the call and make it. */
+  start = rf_callback_start = rf_nsec();
   result = rb_protect(rf_protected, methargs, &error);
+  exc = error ? rf_take_exception() : Qnil;
+  if (!error && rf_timed_outP(result))
+    error = 1;
+  rf_call_failed = error;
+  rf_callback_done(method,methname,0,path,start,error,exc);
  
   /* Did it error? */
   if (error) return Qnil;
@@ -275,6 +1395,62 @@ rf_mcall(const char *path, ID method, char *methname, VALUE arg) {
   return result;
 }
 
+/* rf_hcall
+ *
+ * Used for: calling read, write and close on a raw handle object.
+ *
+ * Works as rf_call does, but on the handle instead of FuseRoot, and
+ *   without passing the path.
+ */
+static VALUE
+rf_hprotected(VALUE args) {
+  VALUE handle = rb_ary_shift(args);
+  ID to_call = SYM2ID(rb_ary_shift(args));
+  return rf_apply(handle,to_call,args);
+}
+
+#define rf_hcall(h,m,a) \
+  rf_mhcall(h,m, c_ ## m, a)
+
+static VALUE
+rf_mhcall(VALUE handle, ID method, char *methname, VALUE arg) {
+  int error;
+  unsigned long long start;
+  VALUE result, exc;
+  VALUE methargs;
+
+  debug("    handle.%s(...)\n", methname);
+
+  if (rf_op_timed_out) {
+    rf_call_failed = 1;
+    return Qnil;
+  }
+
+  if (TYPE(arg) == T_ARRAY) {
+    methargs = arg;
+  } else if (arg != Qnil) {
+    methargs = rb_ary_new();
+    rb_ary_push(methargs,arg);
+  } else {
+    methargs = rb_ary_new();
+  }
+
+  rb_ary_unshift(methargs,ID2SYM(method));
+  rb_ary_unshift(methargs,handle);
+
+  start = rf_callback_start = rf_nsec();
+  result = rb_protect(rf_hprotected, methargs, &error);
+  exc = error ? rf_take_exception() : Qnil;
+  if (!error && rf_timed_outP(result))
+    error = 1;
+  rf_call_failed = error;
+  rf_callback_done(method,methname,1,NULL,start,error,exc);
+
+  if (error) return Qnil;
+
+  return result;
+}
+
 /* 
  * rf_getint:
  *
@@ -283,29 +1459,334 @@ rf_mcall(const char *path, ID method, char *methname, VALUE arg) {
 #define rf_intval(p,m,a) \
   rf_mintval(p,m, c_ ## m, a)
 
-static int
-rf_mintval(const char *path,ID method,char *methname,int def) {
+static off_t
+rf_mintval(const char *path,ID method,char *methname,off_t def) {
   VALUE arg = rf_mcall(path,method,methname,Qnil);
-  VALUE retval;
   int   error;
   if (FIXNUM_P(arg)) {
-    return rb_fix2int(arg);
+    return FIX2LONG(arg);
   } else if (RTEST(arg)) {
     if (!rb_respond_to(arg,id_to_i)) {
       return def;
     }
 
-    retval = rb_protect(rf_int_protected, arg, &error);
+    /* A Bignum size may still be out of range. */
+    rb_protect(rf_offt_protected, arg, &error);
    
     /* Did it error? */
     if (error) return def;
 
-    return rb_num2long(retval);
+    return rf_offt_value;
   } else {
     return def;
   }
 }
 
+/* rf_refresh_list
+ *
+ * Paths whose stale attributes or contents were served, to be refreshed
+ * once the reply has been sent.
+ */
+#define RF_REFRESH_MAX  256
+
+static char *rf_refresh_list[RF_REFRESH_MAX];
+static int   rf_refresh_count = 0;
+
+static void
+rf_refresh_later(const char *path) {
+  int i;
+  for (i = 0; i < rf_refresh_count; i++)
+    if (strcmp(rf_refresh_list[i],path) == 0)
+      return;
+  if (rf_refresh_count < RF_REFRESH_MAX)
+    rf_refresh_list[rf_refresh_count++] = strdup(path);
+}
+
+/* rf_native
+ *
+ * Used by: FuseFS::NativeMetaDir
+ *
+ * An in-memory tree of directories and files kept in C. When FuseRoot is
+ *   a NativeMetaDir, getattr, readdir and opening a file whose contents
+ *   are a String for reading are answered from the tree, without calling
+ *   a Ruby method. Everything else goes through its methods, which are
+ *   written in C against the same tree and behave as MetaDir's do. A
+ *   directory made with mkdir(path,obj) is served by obj, which is called
+ *   with the rest of the path, as MetaDir does.
+ */
+#define RF_NATIVE_PASS 1 /* Not answered from the tree: ask FuseRoot. */
+
+typedef struct rf_node {
+  char *name;
+  int dir;
+  VALUE value;            /* A file's contents, or the object serving a
+                           * directory made with mkdir(path,obj). */
+  time_t atime, mtime, ctime;
+  struct rf_node *parent;
+  struct rf_node **kids;  /* A directory's entries, sorted by name. */
+  long nkids, capa;
+} rf_node;
+
+#define RF_NATIVE_MOUNTED(node) ((node)->dir && ((node)->value != Qnil))
+
+VALUE cNativeMetaDir = Qnil; /* FuseFS::NativeMetaDir */
+
+static rf_node *
+rf_node_new(const char *name, size_t len, int dir, VALUE value) {
+  rf_node *node = ALLOC(rf_node);
+  memset(node,0,sizeof(rf_node));
+  node->name = ALLOC_N(char,len + 1);
+  memcpy(node->name,name,len);
+  node->name[len] = '\0';
+  node->dir = dir;
+  node->value = value;
+  node->atime = node->mtime = node->ctime = time(NULL);
+  return node;
+}
+
+static void
+rf_node_free(rf_node *node) {
+  long i;
+  for (i = 0; i < node->nkids; i++)
+    rf_node_free(node->kids[i]);
+  xfree(node->kids);
+  xfree(node->name);
+  xfree(node);
+}
+
+static void
+rf_node_mark(rf_node *node) {
+  long i;
+  rb_gc_mark(node->value);
+  for (i = 0; i < node->nkids; i++)
+    rf_node_mark(node->kids[i]);
+}
+
+/* Where <name> is, or would go, in <dir>'s entries. */
+static long
+rf_node_index(rf_node *dir, const char *name, size_t len, int *found) {
+  long lo = 0, hi = dir->nkids, mid;
+  int cmp;
+
+  *found = 0;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    cmp = strncmp(dir->kids[mid]->name,name,len);
+    if ((cmp == 0) && dir->kids[mid]->name[len])
+      cmp = 1;
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void
+rf_node_insert(rf_node *dir, rf_node *node) {
+  int found;
+  long i = rf_node_index(dir,node->name,strlen(node->name),&found);
+
+  if (dir->nkids == dir->capa) {
+    dir->capa = dir->capa ? dir->capa * 2 : 8;
+    REALLOC_N(dir->kids,rf_node *,dir->capa);
+  }
+  memmove(dir->kids + i + 1,dir->kids + i,
+          (dir->nkids - i) * sizeof(rf_node *));
+  dir->kids[i] = node;
+  dir->nkids++;
+  node->parent = dir;
+  dir->mtime = time(NULL);
+}
+
+/* Takes <node> out of its directory, without freeing it. */
+static void
+rf_node_detach(rf_node *node) {
+  rf_node *dir = node->parent;
+  int found;
+  long i = rf_node_index(dir,node->name,strlen(node->name),&found);
+
+  memmove(dir->kids + i,dir->kids + i + 1,
+          (dir->nkids - i - 1) * sizeof(rf_node *));
+  dir->nkids--;
+  node->parent = NULL;
+  dir->mtime = time(NULL);
+}
+
+/* rf_native_walk
+ *
+ * Follows <path> down from <node> as far as the tree goes. If all of it
+ *   is found, returns that node with *rest NULL. Otherwise returns the
+ *   last node reached, a file, a directory served by an object, or a
+ *   directory without the next name, with *rest at that name.
+ */
+static rf_node *
+rf_native_walk(rf_node *node, const char *path, const char **rest) {
+  const char *end;
+  long i;
+  int found;
+
+  while (*path == '/')
+    path++;
+  while (*path && node->dir && (node->value == Qnil)) {
+    for (end = path; *end && (*end != '/'); end++);
+    i = rf_node_index(node,path,end - path,&found);
+    if (!found)
+      break;
+    node = node->kids[i];
+    for (path = end; *path == '/'; path++);
+  }
+  *rest = *path ? path : NULL;
+  return node;
+}
+
+/* The length of <rest> if it is a single name, or 0. */
+static size_t
+rf_native_name(const char *rest) {
+  size_t len = strcspn(rest,"/");
+  const char *ptr;
+  for (ptr = rest + len; *ptr == '/'; ptr++);
+  return *ptr ? 0 : len;
+}
+
+static rf_node *
+rf_native_root(VALUE self) {
+  rf_node *root;
+  Data_Get_Struct(self,rf_node,root);
+  return root;
+}
+
+static int
+rf_nativeP() {
+  return (FuseRoot != Qnil) && (CLASS_OF(FuseRoot) == cNativeMetaDir);
+}
+
+/* MetaDir's test for can_write? and the like: the reader is this process's
+ * user. */
+static int
+rf_native_ownerP() {
+  int uid = fusefs_uid();
+  if ((uid < 0) && (fusefs_fd() < 0))
+    return 1;
+  return uid == (int) getuid();
+}
+
+static int
+rf_native_getattr(const char *path, struct stat *stbuf) {
+  const char *rest;
+  rf_node *node = rf_native_walk(rf_native_root(FuseRoot),path,&rest);
+
+  if (RF_NATIVE_MOUNTED(node))
+    return RF_NATIVE_PASS;
+  if (rest)
+    return -ENOENT;
+  memset(stbuf, 0, sizeof(struct stat));
+  if (node->dir) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = 4096;
+  } else if (TYPE(node->value) == T_STRING) {
+    stbuf->st_mode = S_IFREG | (rf_native_ownerP() ? 0666 : 0444);
+    stbuf->st_nlink = 1 + file_openedP(path);
+    stbuf->st_size = RSTRING(node->value)->len;
+  } else {
+    return RF_NATIVE_PASS;
+  }
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_mtime = node->mtime;
+  stbuf->st_atime = node->atime;
+  stbuf->st_ctime = node->ctime;
+  return 0;
+}
+
+static int
+rf_native_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  const char *rest;
+  rf_node *node = rf_native_walk(rf_native_root(FuseRoot),path,&rest);
+  long i;
+
+  if (RF_NATIVE_MOUNTED(node))
+    return RF_NATIVE_PASS;
+  if (rest || !node->dir)
+    return -ENOENT;
+  node->atime = time(NULL);
+  filler(buf,".", NULL, 0);
+  filler(buf,"..", NULL, 0);
+  for (i = 0; i < node->nkids; i++)
+    filler(buf,node->kids[i]->name,NULL,0);
+  return 0;
+}
+
+/* The String a file holds, or nil if the tree can't say. */
+static VALUE
+rf_native_body(const char *path) {
+  const char *rest;
+  rf_node *node = rf_native_walk(rf_native_root(FuseRoot),path,&rest);
+
+  if (rest || node->dir || (TYPE(node->value) != T_STRING))
+    return Qnil;
+  node->atime = time(NULL);
+  return node->value;
+}
+
+static int rf_getattr_root(const char *path, struct stat *stbuf);
+
+/* rf_getattr_cached
+ *
+ * Used by: rf_getattr
+ *
+ * Serves attributes from rf_attrs while they are fresh, and while they
+ *   are within stale_ttl of it, refreshing them after the reply. If
+ *   FuseRoot runs out of time, stale attributes are served, or failing
+ *   that ETIMEDOUT.
+ */
+static int
+rf_getattr_cached(const char *path, struct stat *stbuf) {
+  rf_attr_slot *slot;
+  double age;
+  int ret;
+
+  if (attr_ttl <= 0) {
+    ret = rf_getattr_root(path,stbuf);
+    return rf_op_timed_out ? -ETIMEDOUT : ret;
+  }
+
+  slot = rf_attr_find(path);
+  if (slot) {
+    age = rf_now() - slot->checked;
+    if (age < attr_ttl) {
+      rf_stats.attr_hits++;
+      goto cached;
+    }
+    if (age < attr_ttl + stale_ttl) {
+      rf_stats.stale_hits++;
+      rf_refresh_later(path);
+      goto cached;
+    }
+  }
+
+  rf_stats.attr_misses++;
+  ret = rf_getattr_root(path,stbuf);
+  if (!rf_op_timed_out) {
+    rf_attr_store(path,stbuf,ret);
+    return ret;
+  }
+  if (slot == NULL)
+    return -ETIMEDOUT;
+  rf_stats.stale_hits++;
+
+cached:
+  *stbuf = slot->st;
+  if (S_ISREG(stbuf->st_mode))
+    stbuf->st_nlink = 1 + file_openedP(path);
+  return slot->ret;
+}
+
 /* rf_getattr
  *
  * Used when: 'ls', and before opening a file.
@@ -329,6 +1810,8 @@ rf_getattr(const char *path, struct stat *stbuf) {
 
   /* "/" is automatically a dir. */
   if (strcmp(path,"/") == 0) {
+    if (rf_nativeP())
+      return rf_native_getattr(path,stbuf);
     stbuf->st_mode = S_IFDIR | 0555;
     stbuf->st_size = 4096;
     stbuf->st_nlink = 1;
@@ -393,6 +1876,25 @@ rf_getattr(const char *path, struct stat *stbuf) {
     debug("No.\n");
   }
 
+  return rf_getattr_cached(path,stbuf);
+}
+
+/* rf_getattr_root
+ *
+ * Used by: rf_getattr, and to refresh stale attributes.
+ *
+ * Asks FuseRoot what the path is.
+ */
+static int
+rf_getattr_root(const char *path, struct stat *stbuf) {
+  int ret;
+
+  if (rf_nativeP() &&
+      ((ret = rf_native_getattr(path,stbuf)) != RF_NATIVE_PASS))
+    return ret;
+
+  memset(stbuf, 0, sizeof(struct stat));
+
   /* If FuseRoot says the path is a directory, we set it 0555.
    * If FuseRoot says the path is a file, it's 0444.
    *
@@ -448,6 +1950,8 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   VALUE contents;
   VALUE cur_entry;
   VALUE retval;
+  long i;
+  int ret;
 
   debug("rf_readdir(%s)\n", path );
 
@@ -465,6 +1969,10 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     return -ENOENT;
   }
 
+  if (rf_nativeP() &&
+      ((ret = rf_native_readdir(path,buf,filler)) != RF_NATIVE_PASS))
+    return ret;
+
   if (strcmp(path,"/") != 0) {
     debug("  Checking is_directory? ...");
     retval = rf_call(path, is_directory,Qnil);
@@ -488,11 +1996,10 @@ rf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     return 0;
   }
 
-  /* Duplicate the array, just in case. */
-  /* TODO: Do this better! */
-  retval = rb_funcall(retval,id_dup,0);
-
-  while ((cur_entry = rb_ary_shift(retval)) != Qnil) {
+  /* The array is read in place, as it may be shared and frozen (MetaDir
+   * hands out its own listing). filler doesn't call back into Ruby. */
+  for (i = 0; i < RARRAY(retval)->len; i++) {
+    cur_entry = rb_ary_entry(retval,i);
 
     if (TYPE(cur_entry) != T_STRING)
       continue;
@@ -515,6 +2022,7 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
   opened_file *ptr;
 
   debug("rf_mknod(%s)\n", path);
+  rf_cache_invalidate(path);
   /* Make sure it's not already open. */
   
   debug("  Checking if it's opened ...");
@@ -540,15 +2048,19 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
   case 1:
     debug(" yes, and it doesn't exist.\n");
     editor_file *eptr;
-    eptr = ALLOC(editor_file);
+    eptr = rf_new_file();
     eptr->writesize = FILE_GROW_SIZE;
-    eptr->value = ALLOC_N(char,eptr->writesize);
-    eptr->path  = strdup(path);
+    if (rf_file_alloc(eptr,eptr->writesize)) {
+      rf_free_file(eptr);
+      return -ENOMEM;
+    }
+    rf_set_path(eptr,path);
     eptr->size  = 0;
     eptr->raw = 0;
+    eptr->handle = Qnil;
+    eptr->fd = -1;
     eptr->zero_offset = 0;
     eptr->modified = 0;
-    *(eptr->value) = '\0';
     eptr->next = editor_head;
     editor_head = eptr;
     return 0;
@@ -574,15 +2086,19 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
       if (ptr && (*ptr == '\0')) {
         debug(" yes.\n");
         editor_file *eptr;
-        eptr = ALLOC(editor_file);
+        eptr = rf_new_file();
         eptr->writesize = FILE_GROW_SIZE;
-        eptr->value = ALLOC_N(char,eptr->writesize);
-        eptr->path  = strdup(path);
+        if (rf_file_alloc(eptr,eptr->writesize)) {
+          rf_free_file(eptr);
+          return -ENOMEM;
+        }
+        rf_set_path(eptr,path);
         eptr->raw = 0;
+        eptr->handle = Qnil;
+        eptr->fd = -1;
         eptr->size  = 0;
         eptr->zero_offset = 0;
         eptr->modified = 0;
-        *(eptr->value) = '\0';
         eptr->next = editor_head;
         editor_head = eptr;
         return 0;
@@ -602,122 +2118,464 @@ rf_mknod(const char *path, mode_t umode, dev_t rdev) {
   return 0;
 }
 
-/* rf_open
+static int rf_truncate(const char *path, off_t offset);
+static int rf_ftruncate(const char *path, off_t offset,
+                        struct fuse_file_info *fi);
+static int rf_release(const char *path, struct fuse_file_info *fi);
+
+/* rf_open_trunc
  *
- * Used when: A file is opened for read or write.
+ * Used by: rf_open_root and rf_open_file, once a raw file is open.
  *
- * If called to open a file for reading, then FuseFS will call "read_file" on
- *   FuseRoot, and store the results into the linked list of "opened_file"
- *   structures, so as to provide the same file for mmap, all excutes of
- *   read(), and preventing more than one call to FuseRoot.
+ * Mounted with atomic_o_trunc, FUSE passes O_TRUNC to open instead of
+ *   truncating the file first, so a raw file opened for write with it is
+ *   truncated here, as rf_ftruncate would. If that fails, the file is
+ *   released again and the error returned. (Buffered files opened with it
+ *   start out empty and modified, so release writes them back even if
+ *   nothing was written.)
+ */
+static int
+rf_open_trunc(const char *path, struct fuse_file_info *fi) {
+  int ret;
+  if (!(fi->flags & O_TRUNC) || ((fi->flags & 3) == O_RDONLY))
+    return 0;
+  ret = rf_ftruncate(path,0,fi);
+  if (ret)
+    rf_release(path,fi);
+  return ret;
+}
+
+/* rf_open_file
  *
- * If called on a file opened for writing, FuseFS will first double check
- *   if the file is writable to by calling "writable?" on FuseRoot, passing
- *   the path. If the return value is a truth value, it will create an entry
- *   into the opened_file list, flagged as for writing.
+ * Used by: rf_open, when FuseRoot responds to open_file.
  *
- * If called with any other set of flags, this will return -ENOPERM, since
- *   FuseFS does not (currently) need to support anything other than direct
- *   read and write.
+ * open_file(path,mode) replaces the file?, can_write?, read_file and
+ *   raw_open probes with a single call. Its return value decides the open:
+ *
+ *   String     - The body of the file. For reads, it is served as-is. For
+ *                "rw" or "a" opens, it is the initial contents of the write
+ *                buffer. For "w" opens, it is ignored.
+ *   Integer    - An errno to fail the open with. 0, or anything out of
+ *                errno range, fails it with EIO.
+ *   nil, false - The file does not exist (read) or can't be written (write).
+ *   Other      - The file is opened raw, as if raw_open returned true.
  */
 static int
-rf_open(const char *path, struct fuse_file_info *fi) {
+rf_open_file(const char *path, struct fuse_file_info *fi, char *open_opts) {
   VALUE body;
-  char *value;
-  size_t len;
-  char open_opts[4], *optr;
   opened_file *newfile;
 
-  debug("rf_open(%s)\n", path);
+  body = rf_call(path,id_open_file,rb_str_new2(open_opts));
 
-  /* Make sure it's not already open. */
-  debug("  Checking if it's already open ...");
-  if (file_openedP(path)) {
-    debug(" yes.\n");
-    return -EACCES;
-  }
-  debug(" no.\n");
- 
-  debug("Checking if an editor file is requested...");
-  switch (editor_fileP(path)) {
-  case 2:
-    debug(" yes, and it was created.\n");
-    return 0;
-  case 1:
-    debug(" yes, but it was not created.\n");
-    return -ENOENT;
-  default:
-    debug(" no.\n");
+  if (!RTEST(body)) {
+    debug("  open_file refused.\n");
+    return ((fi->flags & 3) == O_RDONLY) ? -ENOENT : -EACCES;
   }
 
-  optr = open_opts;
-  switch (fi->flags & 3) {
-  case 0:
-    *(optr++) = 'r';
-    break;
-  case 1:
-    *(optr++) = 'w';
-    break;
-  case 2:
-    *(optr++) = 'w';
-    *(optr++) = 'r';
-    break;
-  default:
-    debug("Opening a file with something other than rd, wr, or rdwr?");
+  if (FIXNUM_P(body)) {
+    long err = FIX2LONG(body);
+    debug("  open_file returned errno %ld.\n", err);
+    /* 0 is no errno, and it opened nothing: refuse it. */
+    if ((err == 0) || (err > 4095) || (err < -4095))
+      return -EIO;
+    return (err < 0) ? err : -err;
   }
-  if (fi->flags & O_APPEND)
-    *(optr++) = 'a';
-  *(optr) = '\0';
 
-  debug("  Checking for a raw_opened file... ");
-  if (RTEST(rf_call(path,id_raw_open,rb_str_new2(open_opts)))) {
-    debug(" yes.\n");
-    newfile = ALLOC(opened_file);
-    newfile->size = 0;
+  newfile = rf_new_file();
+  rf_set_path(newfile,path);
+  newfile->size  = 0;
+  newfile->zero_offset = 0;
+  newfile->modified = 0;
+  newfile->raw = 0;
+  newfile->handle = Qnil;
+  newfile->fd = -1;
+
+  if (TYPE(body) != T_STRING) {
+    debug("  open_file returned a raw handle.\n");
     newfile->value = NULL;
     newfile->writesize = 0;
-    newfile->zero_offset = 0;
-    newfile->modified = 0;
-    newfile->path  = strdup(path);
     newfile->raw = 1;
-
-    newfile->next = opened_head;
-    opened_head = newfile;
-    return 0;
+    rf_set_handle(newfile,body);
+  } else if ((fi->flags & 3) == O_RDONLY) {
+    debug("  open_file returned a body for read.\n");
+    if (rf_file_load(newfile,body,0)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
+    newfile->writesize = 0;
+  } else if ((((fi->flags & 3) == O_RDWR) || (fi->flags & O_APPEND)) &&
+             !(fi->flags & O_TRUNC)) {
+    debug("  open_file returned a body for write.\n");
+    if (rf_file_load(newfile,body,FILE_GROW_SIZE)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
+    newfile->writesize = newfile->capa;
+    if (fi->flags & O_APPEND)
+      newfile->zero_offset = newfile->size;
+  } else {
+    debug("  open_file allowed a write.\n");
+    newfile->writesize = FILE_GROW_SIZE;
+    if (rf_file_alloc(newfile,newfile->writesize)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
+    newfile->modified = (fi->flags & O_TRUNC) ? 1 : 0;
+  }
+
+  rf_add_opened(newfile,fi);
+  return newfile->raw ? rf_open_trunc(path,fi) : 0;
+}
+
+/* rf_cache_validator
+ *
+ * Returns (to be freed) what tells whether a file has changed: its etag
+ *   if FuseRoot has etag(path), else its mtime. NULL if it has neither.
+ */
+static char *
+rf_cache_validator(const char *path) {
+  char buf[32];
+  VALUE tag;
+
+  if (rb_respond_to(FuseRoot,id_etag)) {
+    tag = rf_call(path,id_etag,Qnil);
+    if (TYPE(tag) == T_STRING)
+      return strdup(STR2CSTR(tag));
+    if (FIXNUM_P(tag)) {
+      snprintf(buf,sizeof(buf),"%ld",FIX2LONG(tag));
+      return strdup(buf);
+    }
+    return NULL;
+  }
+  if (rb_respond_to(FuseRoot,id_mtime)) {
+    snprintf(buf,sizeof(buf),"%lld",(long long) rf_intval(path,id_mtime,0));
+    return strdup(buf);
+  }
+  return NULL;
+}
+
+/* rf_cache_open
+ *
+ * Used by: rf_open, for files opened read-only.
+ *
+ * Opens a file from rf_cache, sharing its copy of the contents. Within
+ *   cache_ttl of being read or checked, FuseRoot isn't asked at all;
+ *   after that, the entry is used only if its validator is unchanged.
+ *   Within stale_ttl more, it is used anyway, and checked after the
+ *   reply; and it is used if checking it runs out of time.
+ *   Returns 0 if it was opened, or 1 if the caller needs to read it.
+ */
+static int
+rf_cache_open(const char *path, struct fuse_file_info *fi) {
+  rf_cache_entry *entry = rf_cache_find(path);
+  opened_file *newfile;
+  char *validator;
+  double now;
+
+  if (entry == NULL)
+    return 1;
+
+  now = rf_now();
+  if (now - entry->checked < cache_ttl) {
+    rf_stats.cache_hits++;
+  } else if (now - entry->checked < cache_ttl + stale_ttl) {
+    debug("  Serving stale cached copy.\n");
+    rf_stats.stale_hits++;
+    rf_refresh_later(path);
+  } else {
+    debug("  Revalidating cached copy ...");
+    validator = rf_cache_validator(path);
+    if (rf_op_timed_out) {
+      debug(" timed out.\n");
+      rf_stats.stale_hits++;
+      rf_refresh_later(path);
+    } else if (!validator || !entry->validator ||
+        strcmp(validator,entry->validator)) {
+      debug(" changed.\n");
+      free(validator);
+      rf_cache_drop(entry);
+      return 1;
+    } else {
+      debug(" unchanged.\n");
+      entry->checked = now;
+      rf_stats.cache_hits++;
+    }
+    free(validator);
+  }
+
+  rf_cache_touch(entry);
+  newfile = rf_new_file();
+  rf_set_path(newfile,path);
+  rf_cache_share(newfile,entry);
+  rf_add_opened(newfile,fi);
+  return 0;
+}
+
+/* rf_refresh_stale
+ *
+ * Used by: FuseFS.process and FuseFS.flush_stale
+ *
+ * Refreshes up to max of the entries in rf_refresh_list: stale
+ *   attributes are asked for again, and stale contents are dropped if
+ *   their validator changed. Returns how many are still waiting.
+ */
+static int
+rf_refresh_stale(int max) {
+  rf_attr_slot *slot;
+  rf_cache_entry *entry;
+  struct stat st;
+  char *path, *validator;
+  int ret;
+
+  while ((max-- > 0) && (rf_refresh_count > 0)) {
+    path = rf_refresh_list[0];
+    memmove(rf_refresh_list, rf_refresh_list + 1,
+            --rf_refresh_count * sizeof(char *));
+    rf_op_timed_out = 0;
+    debug("  Refreshing %s\n", path);
+
+    if ((attr_ttl > 0) && rf_attr_find(path)) {
+      ret = rf_getattr_root(path,&st);
+      /* Ruby may have dropped it meanwhile. */
+      if (!rf_op_timed_out && ((slot = rf_attr_find(path)) != NULL))
+        rf_attr_store(path,&st,ret);
+    }
+
+    if (rf_cache_find(path)) {
+      validator = rf_cache_validator(path);
+      entry = rf_cache_find(path);
+      if (!rf_op_timed_out && entry) {
+        if (!validator || !entry->validator ||
+            strcmp(validator,entry->validator))
+          rf_cache_drop(entry);
+        else
+          entry->checked = rf_now();
+      }
+      free(validator);
+    }
+
+    rf_stats.refreshes++;
+    free(path);
+  }
+  rf_op_timed_out = 0;
+  return rf_refresh_count;
+}
+
+static int rf_open_root(const char *path, struct fuse_file_info *fi);
+
+/* rf_open
+ *
+ * Used when: A file is opened for read or write.
+ *
+ * See rf_open_root. If FuseRoot ran out of time, a file opened read-only
+ *   is served from rf_cache if it's there, however old; otherwise the open
+ *   fails with ETIMEDOUT.
+ */
+static int
+rf_open(const char *path, struct fuse_file_info *fi) {
+  rf_cache_entry *entry;
+  opened_file *newfile;
+  int ret = rf_open_root(path,fi);
+
+  if (!rf_op_timed_out || (ret == 0))
+    return ret;
+
+  if (((fi->flags & 3) == O_RDONLY) &&
+      ((entry = rf_cache_find(path)) != NULL)) {
+    rf_stats.stale_hits++;
+    rf_refresh_later(path);
+    newfile = rf_new_file();
+    rf_set_path(newfile,path);
+    rf_cache_share(newfile,entry);
+    rf_add_opened(newfile,fi);
+    return 0;
+  }
+  return -ETIMEDOUT;
+}
+
+/* rf_open_root
+ *
+ * Used by: rf_open
+ *
+ * If called to open a file for reading, then FuseFS will call "read_file" on
+ *   FuseRoot, and store the results into the linked list of "opened_file"
+ *   structures, so as to provide the same file for mmap, all excutes of
+ *   read(), and preventing more than one call to FuseRoot.
+ *
+ * If called on a file opened for writing, FuseFS will first double check
+ *   if the file is writable to by calling "writable?" on FuseRoot, passing
+ *   the path. If the return value is a truth value, it will create an entry
+ *   into the opened_file list, flagged as for writing.
+ *
+ * If called with any other set of flags, this will return -ENOPERM, since
+ *   FuseFS does not (currently) need to support anything other than direct
+ *   read and write.
+ *
+ * If FuseRoot responds to open_file, all of the above is decided by that
+ *   one call instead. (See rf_open_file)
+ *
+ * Files opened write-only for append, when FuseRoot responds to append_to
+ *   and raw_open doesn't take them, only check can_write?. The old
+ *   contents are never read.
+ */
+static int
+rf_open_root(const char *path, struct fuse_file_info *fi) {
+  VALUE body;
+  char open_opts[4], *optr;
+  opened_file *newfile;
+  rf_cache_entry *entry = NULL;
+  char *validator = NULL;
+  int native;
+
+  debug("rf_open(%s)\n", path);
+
+  /* Make sure it's not already open. */
+  debug("  Checking if it's already open ...");
+  if (file_busyP(path)) {
+    debug(" yes.\n");
+    return -EACCES;
+  }
+  debug(" no.\n");
+ 
+  debug("Checking if an editor file is requested...");
+  switch (editor_fileP(path)) {
+  case 2:
+    debug(" yes, and it was created.\n");
+    return (fi->flags & O_TRUNC) ? rf_truncate(path,0) : 0;
+  case 1:
+    debug(" yes, but it was not created.\n");
+    return -ENOENT;
+  default:
+    debug(" no.\n");
+  }
+
+  /* Read-only, and we have it cached? */
+  if (((fi->flags & 3) == O_RDONLY) && (cache_max_bytes > 0) &&
+      (rf_cache_open(path,fi) == 0)) {
+    debug("  Served from the cache.\n");
+    return 0;
+  }
+
+  optr = open_opts;
+  switch (fi->flags & 3) {
+  case 0:
+    *(optr++) = 'r';
+    break;
+  case 1:
+    *(optr++) = 'w';
+    break;
+  case 2:
+    *(optr++) = 'w';
+    *(optr++) = 'r';
+    break;
+  default:
+    debug("Opening a file with something other than rd, wr, or rdwr?");
+  }
+  if (fi->flags & O_APPEND)
+    *(optr++) = 'a';
+  *(optr) = '\0';
+
+  /* A file we just created with mknod needs no further checks. */
+  debug("  Checking for open_file ...");
+  if (!(created_file && (strcmp(created_file,path) == 0)) &&
+      rb_respond_to(FuseRoot,id_open_file)) {
+    debug(" yes.\n");
+    return rf_open_file(path,fi,open_opts);
+  }
+  debug(" no.\n");
+
+  debug("  Checking for a raw_opened file... ");
+  body = rf_call(path,id_raw_open,rb_str_new2(open_opts));
+  if (RTEST(body)) {
+    debug(" yes.\n");
+    newfile = rf_new_file();
+    newfile->size = 0;
+    newfile->value = NULL;
+    newfile->writesize = 0;
+    newfile->zero_offset = 0;
+    newfile->modified = 0;
+    rf_set_path(newfile,path);
+    newfile->raw = 1;
+    rf_set_handle(newfile,body);
+
+    rf_add_opened(newfile,fi);
+    return rf_open_trunc(path,fi);
+  }
+  debug(" no.\n");
+
+  /* Appending to a file FuseRoot can append_to? Then we only need to
+   * hold on to what is appended. */
+  debug("  Checking for append_to ...");
+  if (((fi->flags & 3) == O_WRONLY) && (fi->flags & O_APPEND) &&
+      !(fi->flags & O_TRUNC) &&
+      !(created_file && (strcmp(created_file,path) == 0)) &&
+      rb_respond_to(FuseRoot,id_append_to)) {
+    debug(" yes.\n");
+    if (!RTEST(rf_call(path,can_write,Qnil)))
+      return -EACCES;
+    newfile = rf_new_file();
+    newfile->writesize = FILE_GROW_SIZE;
+    if (rf_file_alloc(newfile,newfile->writesize)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
+    rf_set_path(newfile,path);
+    newfile->append = 1;
+    rf_add_opened(newfile,fi);
+    return 0;
   }
   debug(" no.\n");
 
   debug("  Checking open type ...");
   if ((fi->flags & 3) == O_RDONLY) {
     debug(" RDONLY.\n");
-    /* Open for read. */
+    /* Open for read. A NativeMetaDir file is copied straight from the
+     * tree, and not cached, since it is kept in memory already. */
+    body = rf_nativeP() ? rf_native_body(path) : Qnil;
+    native = (body != Qnil);
+
     /* Make sure it exists. */
-    if (!RTEST(rf_call(path,is_file,Qnil))) {
+    if (!native && !RTEST(rf_call(path,is_file,Qnil))) {
       return -ENOENT;
     }
 
-    body = rf_call(path, id_read_file,Qnil);
+    /* Checked before reading, so a change while it's read isn't missed. */
+    if (!native && (cache_max_bytes > 0))
+      validator = rf_cache_validator(path);
+
+    if (!native)
+      body = rf_call(path, id_read_file,Qnil);
 
     /* I don't wanna deal with non-strings :D. */
     if (TYPE(body) != T_STRING) {
+      free(validator);
       return -ENOENT;
     }
 
     /* We have the body, now save it the entire contents to our
-     * opened_file lists. */
-    newfile = ALLOC(opened_file);
-    value = rb_str2cstr(body,&newfile->size);
-    newfile->value = ALLOC_N(char,(newfile->size)+1);
-    memcpy(newfile->value,value,newfile->size);
-    newfile->value[newfile->size] = '\0';
+     * opened_file lists, sharing the cache's copy if it's kept. */
+    newfile = rf_new_file();
+    if (!native && (cache_max_bytes > 0)) {
+      rf_stats.cache_misses++;
+      entry = rf_cache_insert(path,RSTRING(body)->ptr,RSTRING(body)->len,
+                              validator);
+      free(validator);
+    }
+    if (entry) {
+      rf_cache_share(newfile,entry);
+    } else if (rf_file_load(newfile,body,0)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
     newfile->writesize = 0;
     newfile->zero_offset = 0;
     newfile->modified = 0;
-    newfile->path  = strdup(path);
+    rf_set_path(newfile,path);
     newfile->raw = 0;
+    newfile->handle = Qnil;
+    newfile->fd = -1;
 
-    newfile->next = opened_head;
-    opened_head = newfile;
+    rf_add_opened(newfile,fi);
     return 0;
 
   } else if (((fi->flags & 3) == O_RDWR) ||
@@ -727,17 +2585,20 @@ rf_open(const char *path, struct fuse_file_info *fi) {
     debug("  Checking if created file ...");
     if (created_file && (strcmp(created_file,path) == 0)) {
       debug(" yes.\n");
-      newfile = ALLOC(opened_file);
+      newfile = rf_new_file();
       newfile->writesize = FILE_GROW_SIZE;
-      newfile->value = ALLOC_N(char,newfile->writesize);
-      newfile->path  = strdup(path);
+      if (rf_file_alloc(newfile,newfile->writesize)) {
+        rf_free_file(newfile);
+        return -ENOMEM;
+      }
+      rf_set_path(newfile,path);
       newfile->size  = 0;
       newfile->raw = 0;
+      newfile->handle = Qnil;
+      newfile->fd = -1;
       newfile->zero_offset = 0;
-      *(newfile->value) = '\0';
       newfile->modified = 0;
-      newfile->next = opened_head;
-      opened_head = newfile;
+      rf_add_opened(newfile,fi);
       return 0;
     }
     debug(" no\n");
@@ -749,8 +2610,8 @@ rf_open(const char *path, struct fuse_file_info *fi) {
     }
     debug(" no\n");
 
-    /* Make sure it exists. */
-    if (RTEST(rf_call(path,is_file,Qnil))) {
+    /* Make sure it exists. Opened with O_TRUNC, we don't need what's in it. */
+    if (!(fi->flags & O_TRUNC) && RTEST(rf_call(path,is_file,Qnil))) {
       body = rf_call(path, id_read_file,Qnil);
 
       /* I don't wanna deal with non-strings :D. */
@@ -760,32 +2621,42 @@ rf_open(const char *path, struct fuse_file_info *fi) {
 
       /* We have the body, now save it the entire contents to our
        * opened_file lists. */
-      newfile = ALLOC(opened_file);
-      value = rb_str2cstr(body,&newfile->size);
-      newfile->value = ALLOC_N(char,(newfile->size)+1);
-      memcpy(newfile->value,value,newfile->size);
-      newfile->writesize = newfile->size+1;
-      newfile->path  = strdup(path);
+      newfile = rf_new_file();
+      if (rf_file_load(newfile,body,0)) {
+        rf_free_file(newfile);
+        return -ENOMEM;
+      }
+      newfile->writesize = newfile->capa;
+      rf_set_path(newfile,path);
       newfile->raw = 0;
+      newfile->handle = Qnil;
+      newfile->fd = -1;
       newfile->zero_offset = 0;
+    } else if (rf_op_timed_out) {
+      /* Not knowing if it exists, don't risk writing over it. */
+      return -ETIMEDOUT;
     } else {
-      newfile = ALLOC(opened_file);
+      newfile = rf_new_file();
       newfile->writesize = FILE_GROW_SIZE;
-      newfile->value = ALLOC_N(char,newfile->writesize);
-      newfile->path  = strdup(path);
+      if (rf_file_alloc(newfile,newfile->writesize)) {
+        rf_free_file(newfile);
+        return -ENOMEM;
+      }
+      rf_set_path(newfile,path);
       newfile->size  = 0;
       newfile->raw = 0;
+      newfile->handle = Qnil;
+      newfile->fd = -1;
       newfile->zero_offset = 0;
-      *(newfile->value) = '\0';
     }
-    newfile->modified = 0;
+    /* Truncated by the open, it has to be written back even if empty. */
+    newfile->modified = (fi->flags & O_TRUNC) ? 1 : 0;
 
     if (fi->flags & O_APPEND) {
       newfile->zero_offset = newfile->size;
     }
 
-    newfile->next = opened_head;
-    opened_head = newfile;
+    rf_add_opened(newfile,fi);
     return 0;
   } else if ((fi->flags & 3) == O_WRONLY) {
     debug(" WRONLY.\n");
@@ -820,18 +2691,21 @@ rf_open(const char *path, struct fuse_file_info *fi) {
 
     /* We can write to it. Create an opened_write_file entry and initialize
      * it to a small size. */
-    newfile = ALLOC(opened_file);
+    newfile = rf_new_file();
     newfile->writesize = FILE_GROW_SIZE;
-    newfile->value = ALLOC_N(char,newfile->writesize);
-    newfile->path  = strdup(path);
+    if (rf_file_alloc(newfile,newfile->writesize)) {
+      rf_free_file(newfile);
+      return -ENOMEM;
+    }
+    rf_set_path(newfile,path);
     newfile->size  = 0;
     newfile->zero_offset = 0;
-    newfile->modified = 0;
+    newfile->modified = (fi->flags & O_TRUNC) ? 1 : 0;
     newfile->raw = 0;
-    *(newfile->value) = '\0';
+    newfile->handle = Qnil;
+    newfile->fd = -1;
 
-    newfile->next = opened_head;
-    opened_head = newfile;
+    rf_add_opened(newfile,fi);
 
     if (created_file && (strcasecmp(created_file,path) == 0)) {
       free(created_file);
@@ -845,6 +2719,215 @@ rf_open(const char *path, struct fuse_file_info *fi) {
   }
 }
 
+/* rf_raw_write
+ *
+ * Used by: rf_write and rf_flush_writes, for files opened with raw_open.
+ *
+ * Calls write on the file's handle object, or raw_write on FuseRoot.
+ *   Returns -EIO if it raised an exception or returned false, else 0.
+ */
+static int
+rf_raw_write(opened_file *ptr, const char *path, const char *buf,
+             size_t size, off_t offset) {
+  VALUE ret;
+  VALUE args = rb_ary_new();
+
+  rf_stats.raw_writes++;
+  if ((ptr->handle != Qnil) && rb_respond_to(ptr->handle,id_write)) {
+    rb_ary_push(args,OFFT2NUM(offset));
+    rb_ary_push(args,rb_str_new(buf,size));
+    ret = rf_hcall(ptr->handle,id_write,args);
+  } else {
+    rb_ary_push(args,OFFT2NUM(offset));
+    rb_ary_push(args,ULONG2NUM(size));
+    rb_ary_push(args,rb_str_new(buf,size));
+    ret = rf_call(path,id_raw_write,args);
+  }
+  if (rf_call_failed || (ret == Qfalse))
+    return rf_op_timed_out ? -EAGAIN : -EIO;
+  return 0;
+}
+
+/* rf_flush_writes
+ *
+ * Used by: rf_writebehind, rf_flush, rf_fsync, rf_release and rf_read.
+ *
+ * Passes a raw file's held-back writes on to rf_raw_write. Returns the
+ *   error from this, or from an earlier flush nobody has been told about
+ *   yet, and clears it.
+ */
+static int
+rf_flush_writes(opened_file *ptr) {
+  int err;
+  if (ptr->wb_len > 0) {
+    err = rf_raw_write(ptr, ptr->path, ptr->wb_buf, ptr->wb_len, ptr->wb_off);
+    ptr->wb_len = 0;
+    if (err && !ptr->wb_error) {
+      rf_stats.writebehind_errors++;
+      ptr->wb_error = err;
+    }
+  }
+  err = ptr->wb_error;
+  ptr->wb_error = 0;
+  return err;
+}
+
+/* rf_flush_stale
+ *
+ * Used by: rf_process, after every command.
+ *
+ * Flushes held-back writes that have waited longer than writebehind_delay.
+ *   Any error is kept for the file's next write, flush, or fsync.
+ */
+static void
+rf_flush_stale() {
+  opened_file *ptr;
+  double now;
+  int err;
+
+  if (writebehind_max == 0)
+    return;
+  now = rf_now();
+  for (ptr = opened_head;ptr;ptr = ptr->next) {
+    if ((ptr->wb_len > 0) && (now - ptr->wb_time >= writebehind_delay)) {
+      err = rf_flush_writes(ptr);
+      if (err)
+        ptr->wb_error = err;
+    }
+  }
+}
+
+/* rf_writebehind
+ *
+ * Used by: rf_write, for raw files when FuseFS.write_behind is set.
+ *
+ * Writes that carry on where the held-back ones end are added to them.
+ *   Anything else flushes what is held first. A write this makes fail late
+ *   is reported by the next write, flush (that is, close) or fsync. With
+ *   no memory to hold a write in, it is written through instead.
+ */
+static int
+rf_writebehind(opened_file *ptr, const char *path, const char *buf,
+               size_t size, off_t offset) {
+  int err;
+
+  if ((ptr->wb_len > 0) && (offset == ptr->wb_off + (off_t) ptr->wb_len) &&
+      (ptr->wb_len + size <= writebehind_max)) {
+    rf_stats.writebehind_hits++;
+  } else {
+    err = rf_flush_writes(ptr);
+    if (err)
+      return err;
+    /* Too big to hold back, or no memory left to hold it in. */
+    if ((size >= writebehind_max) ||
+        ((ptr->wb_size < writebehind_max) &&
+         rf_over_budget(writebehind_max - ptr->wb_size))) {
+      err = rf_raw_write(ptr, path, buf, size, offset);
+      return err ? err : size;
+    }
+    ptr->wb_off = offset;
+    ptr->wb_time = rf_now();
+  }
+
+  if (ptr->wb_size < ptr->wb_len + size) {
+    size_t capa = writebehind_max;
+    char *wb_buf = rf_buf_realloc(ptr->wb_buf, ptr->wb_size, &capa,
+                                  ptr->wb_len);
+    if (wb_buf == NULL) {
+      /* Nothing to hold it in: write it, and what is held, through. */
+      err = rf_flush_writes(ptr);
+      if (err)
+        return err;
+      err = rf_raw_write(ptr, path, buf, size, offset);
+      return err ? err : size;
+    }
+    ptr->wb_buf = wb_buf;
+    rf_stats.buffer_bytes += capa - ptr->wb_size;
+    ptr->wb_size = capa;
+  }
+  memcpy(ptr->wb_buf + ptr->wb_len, buf, size);
+  ptr->wb_len += size;
+
+  if ((ptr->wb_len >= writebehind_max) ||
+      (rf_now() - ptr->wb_time >= writebehind_delay)) {
+    err = rf_flush_writes(ptr);
+    if (err)
+      return err;
+  }
+  return size;
+}
+
+/* rf_file_extents
+ *
+ * Returns the data in a file's buffer as an Array of [offset, String]
+ * pairs, skipping the holes of a sparse one.
+ */
+static VALUE
+rf_file_extents(opened_file *ptr) {
+  VALUE list = rb_ary_new();
+  off_t data = 0, hole;
+
+#ifdef SEEK_DATA
+  while (ptr->sparse && (data < ptr->size)) {
+    data = lseek(ptr->spill_fd, data, SEEK_DATA);
+    if ((data < 0) && (errno == ENXIO))
+      return list;
+    if (data < 0)
+      break;
+    if (data >= ptr->size)
+      return list;
+    hole = lseek(ptr->spill_fd, data, SEEK_HOLE);
+    if ((hole < 0) || (hole > ptr->size))
+      hole = ptr->size;
+    rb_ary_push(list, rb_assoc_new(OFFT2NUM(data),
+                                   rb_str_new(ptr->value + data, hole - data)));
+    data = hole;
+  }
+  if (data >= ptr->size)
+    return list;
+#endif
+
+  /* No way to find the holes, so send it all. */
+  rb_ary_clear(list);
+  if (ptr->size > 0)
+    rb_ary_push(list, rb_assoc_new(INT2FIX(0),
+                                   rb_str_new(ptr->value, ptr->size)));
+  return list;
+}
+
+/* rf_write_back
+ *
+ * Passes a buffered file's contents to FuseRoot: as extents to
+ * write_extents if it's sparse and FuseRoot has that, else as one String
+ * to write_to.
+ */
+static void
+rf_write_back(opened_file *ptr, const char *path) {
+  if (ptr->sparse && rb_respond_to(FuseRoot,id_write_extents)) {
+    rf_call(path,id_write_extents,
+            rb_assoc_new(OFFT2NUM(ptr->size),rf_file_extents(ptr)));
+  } else {
+    rf_call(path,id_write_to,rb_str_new(ptr->value,ptr->size));
+  }
+}
+
+/* rf_sparse_fits
+ *
+ * A sparse file is written back whole with write_to when FuseRoot has no
+ * write_extents, holes and all. So that can't run out of memory, such a
+ * file isn't let grow past buffer_budget, if there is one: returns
+ * -EFBIG if leaving a hole up to hole bytes and then writing up to end
+ * bytes would do that, else 0.
+ */
+static int
+rf_sparse_fits(opened_file *ptr, off_t hole, off_t end) {
+  if (!buffer_budget || (end <= (off_t) buffer_budget))
+    return 0;
+  if (!ptr->sparse && (hole - ptr->size < SPARSE_HOLE_SIZE))
+    return 0;
+  return rb_respond_to(FuseRoot,id_write_extents) ? 0 : -EFBIG;
+}
+
 /* rf_release
  *
  * Used when: A file is no longer being read or written to.
@@ -854,21 +2937,30 @@ rf_open(const char *path, struct fuse_file_info *fi) {
  *   clear the file information from the in-memory file storage that
  *   FuseFS uses to prevent FuseRoot from receiving incomplete files.
  *
+ * If the file was opened for append, and FuseRoot responds to append_to,
+ *   FuseFS calls append_to with only what was written instead, and
+ *   returns EIO if that fails, since nothing else holds what was written.
+ *
  * If called on a file opened for reading, FuseFS will just clear the
  *   in-memory copy of the return value from rf_open.
+ *
+ * For raw files, held-back writes are flushed first, and an error from
+ *   them (or one nobody has been told about yet) is returned.
  */
 static int
 rf_release(const char *path, struct fuse_file_info *fi) {
 
-  opened_file *ptr,*prev;
+  opened_file *ptr,*prev,*target;
   int is_editor = 0;
+  int ret = 0;
 
   debug("rf_release(%s)\n", path);
 
   debug("  Checking for opened file ...");
   /* Find the opened file. */
+  target = (fi && fi->fh) ? (opened_file *) (uintptr_t) fi->fh : NULL;
   for (ptr = opened_head, prev=NULL;ptr;prev = ptr,ptr = ptr->next)
-    if (strcmp(ptr->path,path) == 0) break;
+    if (target ? (ptr == target) : (strcmp(ptr->path,path) == 0)) break;
 
   /* If we don't have this open, it doesn't exist. */
   if (ptr == NULL) {
@@ -886,12 +2978,21 @@ rf_release(const char *path, struct fuse_file_info *fi) {
   }
   debug(" yes.\n");
 
+  /* It may have been renamed since it was opened. */
+  path = ptr->path;
+
   /* If it's opened for raw read/write, call raw_close */
   debug("  Checking if it's opened for raw write...");
   if (ptr->raw) {
     /* raw read */
     debug(" yes.\n");
-    rf_call(path,id_raw_close,Qnil);
+    ret = rf_flush_writes(ptr);
+    if ((ptr->handle != Qnil) && rb_respond_to(ptr->handle,id_close)) {
+      rf_hcall(ptr->handle,id_close,Qnil);
+    } else {
+      rf_call(path,id_raw_close,Qnil);
+    }
+    rf_free_handle(ptr);
   } else {
     debug(" no.\n");
 
@@ -901,19 +3002,30 @@ rf_release(const char *path, struct fuse_file_info *fi) {
     debug("  Checking if it's for write ...\n");
     if ((!ptr->raw) && (ptr->writesize != 0) && !editor_fileP(path)) {
       debug(" yes ...");
-      if (ptr->modified) {
+      if (ptr->modified && ptr->append) {
+        debug(" and appended to.\n");
+        rf_call(path,id_append_to,rb_str_new(ptr->value,ptr->size));
+        if (rf_call_failed)
+          ret = -EIO;
+      } else if (ptr->modified) {
         debug(" and modified.\n");
-        rf_call(path,id_write_to,rb_str_new(ptr->value,ptr->size));
+        rf_write_back(ptr,path);
+      } else if (ptr->append) {
+        debug(" and not appended to.\n");
       } else {
         debug(" and not modified.\n");
         if (!handle_editor) {
           debug("  ... But calling write anyawy.");
-          rf_call(path,id_write_to,rb_str_new(ptr->value,ptr->size));
+          rf_write_back(ptr,path);
         }
       }
     }
   }
 
+  /* Whatever was written, a cached copy is out of date. */
+  if (ptr->raw || (ptr->writesize != 0))
+    rf_cache_invalidate(path);
+
   /* Free the file contents. */
   if (!is_editor) {
     if (prev == NULL) {
@@ -921,13 +3033,42 @@ rf_release(const char *path, struct fuse_file_info *fi) {
     } else {
       prev->next = ptr->next;
     }
-    if (ptr->value)
-      free(ptr->value);
-    free(ptr->path);
-    free(ptr);
+    rf_free_file(ptr);
   }
 
-  return 0;
+  return ret;
+}
+
+/* rf_flush and rf_fsync
+ *
+ * Used when: A file is closed (flush), or fsync'd.
+ *
+ * For raw files, FuseFS passes any held-back writes on to FuseRoot, and
+ *   returns any error they gave. Buffered files are only written out on
+ *   release, as always.
+ */
+static int
+rf_flush(const char *path, struct fuse_file_info *fi) {
+  opened_file *ptr;
+
+  debug("rf_flush(%s)\n", path);
+  ptr = rf_find_opened(path,fi);
+  if ((ptr == NULL) || !ptr->raw)
+    return 0;
+  return rf_flush_writes(ptr);
+}
+
+static int
+rf_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  opened_file *ptr;
+
+  debug("rf_fsync(%s)\n", path);
+  ptr = rf_find_opened(path,fi);
+  if ((ptr == NULL) || !ptr->raw)
+    return 0;
+  if (ptr->fd >= 0)
+    return (datasync ? fdatasync(ptr->fd) : fsync(ptr->fd)) ? -errno : 0;
+  return rf_flush_writes(ptr);
 }
 
 /* rf_chmod
@@ -959,24 +3100,77 @@ rf_touch(const char *path, struct utimbuf *ignore) {
   return 0;
 }
 
-/* rf_rename
+/* rf_rename_opened
  *
- * Used when: a file is renamed.
+ * Used by: rf_rename
  *
- * When FuseFS receives a rename command, it really just removes the old file
- *   and creates the new file with the same contents.
+ * Files that are open under a path that was renamed (or under a directory
+ *   that was) are written back to their new path on release.
  */
-static int
-rf_rename(const char *path, const char *dest) {
-  /* Does it exist to be edited? */
-  int iseditor = 0;
-  if (editor_fileP(path) == 2) {
+static void
+rf_rename_opened(const char *path, const char *dest) {
+  opened_file *ptr;
+  size_t len = strlen(path);
+  char *newpath;
+
+  for (ptr = opened_head;ptr;ptr = ptr->next) {
+    if (strncmp(ptr->path,path,len) ||
+        ((ptr->path[len] != '\0') && (ptr->path[len] != '/')))
+      continue;
+    newpath = ALLOC_N(char,strlen(dest) + strlen(ptr->path + len) + 1);
+    strcpy(newpath,dest);
+    strcat(newpath,ptr->path + len);
+    rf_set_path(ptr,newpath);
+    free(newpath);
+  }
+  if (created_file && (strcmp(created_file,path) == 0)) {
+    free(created_file);
+    created_file = strdup(dest);
+  }
+}
+
+/* rf_rename
+ *
+ * Used when: a file or directory is renamed.
+ *
+ * If FuseRoot responds to rename, FuseFS calls rename(path,dest) and
+ *   nothing else: it is up to FuseRoot to check permissions, and to replace
+ *   dest if it exists. It may return false to refuse, or an Integer errno
+ *   (Errno::EXDEV::Errno makes 'mv' copy the file instead).
+ *
+ * Otherwise, or if rename returns FuseFS::FALLBACK, FuseFS checks that
+ *   path is a file that can be deleted and that dest can be written to, and
+ *   calls raw_rename if FuseRoot has it. Without raw_rename, it really just
+ *   removes the old file and creates the new file with the same contents.
+ *   Directories can't be renamed that way.
+ */
+static int
+rf_rename(const char *path, const char *dest) {
+  int ret;
+  VALUE renamed;
+  /* Does it exist to be edited? */
+  int iseditor = 0;
+
+  rf_cache_invalidate_under(path);
+  rf_cache_invalidate_under(dest);
+  if (editor_fileP(path) == 2) {
     iseditor = 1;
+  } else if (rb_respond_to(FuseRoot,id_rename) &&
+             ((renamed = rf_call(path,id_rename,rb_str_new2(dest))) !=
+              rf_fallback_obj)) {
+    debug("rf_rename(%s,%s)\n", path,dest);
+    ret = rf_status(renamed);
+    if (ret == 0)
+      rf_rename_opened(path,dest);
+    return ret;
   } else {
     debug("rf_rename(%s,%s)\n", path,dest);
     debug("  Checking if %s is file ...", path);
     if (!RTEST(rf_call(path,is_file,Qnil))) {
       debug(" no.\n");
+      /* Let 'mv' copy directories over itself. */
+      if (RTEST(rf_call(path,is_directory,Qnil)))
+        return -EXDEV;
       return -ENOENT;
     }
     debug(" yes.\n");
@@ -1011,26 +3205,23 @@ rf_rename(const char *path, const char *dest) {
         }
         VALUE body = rb_str_new(eptr->value,eptr->size);
         rf_call(dest,id_write_to,body);
-        free(eptr->value);
-        free(eptr->path);
-        free(eptr);
+        rf_free_file(eptr);
         break;
       }
     }
+  } else if (rb_respond_to(FuseRoot,id_raw_rename)) {
+    rf_call(path,id_raw_rename,rb_str_new2(dest));
+    rf_rename_opened(path,dest);
   } else {
     VALUE body = rf_call(path,id_read_file,Qnil);
-    if (rb_respond_to(FuseRoot,id_raw_rename)) {
-        rf_call(path,id_raw_rename,rb_str_new2(dest));
+    if (TYPE(body) != T_STRING) {
+      /* We just write a null file, then. Ah well. */
+      VALUE newstr = rb_str_new2("");
+      rf_call(path,id_delete,Qnil);
+      rf_call(dest,id_write_to,newstr);
     } else {
-      if (TYPE(body) != T_STRING) {
-        /* We just write a null file, then. Ah well. */
-        VALUE newstr = rb_str_new2("");
-        rf_call(path,id_delete,Qnil);
-        rf_call(dest,id_write_to,newstr);
-      } else {
-        rf_call(path,id_delete,Qnil);
-        rf_call(dest,id_write_to,body);
-      }
+      rf_call(path,id_delete,Qnil);
+      rf_call(dest,id_write_to,body);
     }
   }
   return 0;
@@ -1047,6 +3238,8 @@ rf_unlink(const char *path) {
   editor_file *eptr,*prev;
   debug("rf_unlink(%s)\n",path);
 
+  rf_cache_invalidate(path);
+
   debug("  Checking if it's an editor file ...");
   switch (editor_fileP(path)) {
   case 2:
@@ -1058,9 +3251,7 @@ rf_unlink(const char *path) {
         } else {
           prev->next = eptr->next;
         }
-        free(eptr->value);
-        free(eptr->path);
-        free(eptr);
+        rf_free_file(eptr);
         return 0;
       }
     }
@@ -1093,30 +3284,84 @@ rf_unlink(const char *path) {
   return 0;
 }
 
+/* rf_truncate_call
+ *
+ * Used by: rf_truncate and rf_ftruncate
+ *
+ * If FuseRoot responds to truncate (or raw_truncate), FuseFS calls it with
+ *   the path and new size, and doesn't need to read the file at all. It may
+ *   return false to refuse, or an Integer errno. Returns 1 if there was no
+ *   such method to call.
+ */
+static int
+rf_truncate_call(const char *path, off_t offset) {
+  VALUE ret;
+  if (rb_respond_to(FuseRoot,id_truncate)) {
+    ret = rf_call(path,id_truncate,OFFT2NUM(offset));
+  } else if (rb_respond_to(FuseRoot,id_raw_truncate)) {
+    ret = rf_call(path,id_raw_truncate,OFFT2NUM(offset));
+  } else {
+    return 1;
+  }
+  return rf_status(ret);
+}
+
 /* rf_truncate
  *
  * Used when: a file is truncated.
  *
- * If this is an existing file?, that is writable? to, then FuseFS will
+ * If the file is open for write, FuseFS resizes what it holds in memory,
+ *   and FuseRoot sees the result on release.
+ *
+ * Otherwise, if FuseRoot has a truncate method, FuseFS calls it. If not,
+ *   and this is an existing file?, that is writable? to, then FuseFS will
  *   read the file, truncate it, and call write_to with the new value.
+ *   Truncating to 0 doesn't read the file first.
  */
 static int
 rf_truncate(const char *path, off_t offset) {
-  debug( "rf_truncate(%s,%d)\n", path, offset );
+  opened_file *ptr;
+  VALUE body;
+  int found = 0;
+  int ret;
+
+  debug( "rf_truncate(%s,%lld)\n", path, (long long) offset );
+  rf_cache_invalidate(path);
 
   debug("Checking if it's an editor file ... ");
   if (editor_fileP(path)) {
     debug(" Yes.\n");
-    opened_file *ptr;
-    for (ptr = opened_head;ptr;ptr = ptr->next) {
+    for (ptr = editor_head;ptr;ptr = ptr->next) {
       if (!strcmp(ptr->path,path)) {
-        ptr->size = offset;
-        return 0;
+        ret = rf_sparse_fits(ptr,offset,offset);
+        return ret ? ret : rf_file_resize(ptr,offset);
       }
     }
     return 0;
   }
 
+  /* Is it open for write? Then truncate what we have. */
+  for (ptr = opened_head;ptr;ptr = ptr->next) {
+    if (!strcmp(ptr->path,path) && !ptr->raw && !ptr->append &&
+        (ptr->writesize != 0)) {
+      if (((ret = rf_sparse_fits(ptr,offset,offset)) != 0) ||
+          ((ret = rf_file_resize(ptr,offset)) != 0))
+        return ret;
+      ptr->modified = 1;
+      found = 1;
+    }
+  }
+  if (found)
+    return 0;
+
+  /* Just created, so there's nothing to truncate. */
+  if (created_file && (strcmp(created_file,path) == 0))
+    return 0;
+
+  ret = rf_truncate_call(path,offset);
+  if (ret <= 0)
+    return ret;
+
   /* Does it exist to be truncated? */
   if (!RTEST(rf_call(path,is_file,Qnil))) {
     return -ENOENT;
@@ -1128,27 +3373,91 @@ rf_truncate(const char *path, off_t offset) {
   }
  
   /* If offset is 0, then we just overwrite it with an empty file. */
-  if (offset > 0) {
-    VALUE newstr = rb_str_new2("");
-    rf_call(path,id_write_to,newstr);
+  if (offset == 0) {
+    rf_call(path,id_write_to,rb_str_new2(""));
+    return 0;
+  }
+
+  body = rf_call(path,id_read_file,Qnil);
+  if (TYPE(body) != T_STRING) {
+    /* We just write a null file, then. Ah well. */
+    body = rb_str_new2("");
+  }
+
+  /* Nothing to do if it's already that size. */
+  if (offset == RSTRING(body)->len)
+    return 0;
+
+  if (offset < RSTRING(body)->len) {
+    body = rb_str_new(RSTRING(body)->ptr,offset);
+  } else if ((offset - RSTRING(body)->len >= SPARSE_HOLE_SIZE) &&
+             rb_respond_to(FuseRoot,id_write_extents)) {
+    /* Extended by a hole: pass on only what is there. */
+    VALUE extents = rb_ary_new();
+    if (RSTRING(body)->len > 0)
+      rb_ary_push(extents, rb_assoc_new(INT2FIX(0), body));
+    rf_call(path,id_write_extents,rb_assoc_new(OFFT2NUM(offset),extents));
+    return 0;
+  } else if (buffer_budget && (offset > (off_t) buffer_budget)) {
+    /* Too big to make a String of. */
+    return -EFBIG;
   } else {
-    VALUE body = rf_call(path,id_read_file,Qnil);
-    if (TYPE(body) != T_STRING) {
-      /* We just write a null file, then. Ah well. */
-      VALUE newstr = rb_str_new2("");
-      rf_call(path,id_write_to,newstr);
-    } else {
-      long size;
-      char *str = rb_str2cstr(body,&size);
+    VALUE newstr = rb_str_new(NULL,offset);
+    memcpy(RSTRING(newstr)->ptr,RSTRING(body)->ptr,RSTRING(body)->len);
+    memset(RSTRING(newstr)->ptr + RSTRING(body)->len, 0,
+           offset - RSTRING(body)->len);
+    body = newstr;
+  }
+  rf_call(path,id_write_to,body);
+  return 0;
+}
+
+/* rf_ftruncate
+ *
+ * Used when: an open file is truncated.
+ *
+ * Buffered files are resized in memory, as in rf_truncate. Raw files are
+ *   truncated with ftruncate if they are served from an IO, truncate(size)
+ *   if the handle object responds to it, or FuseRoot's truncate.
+ */
+static int
+rf_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+  opened_file *ptr;
+  int ret;
+
+  debug( "rf_ftruncate(%s,%lld)\n", path, (long long) offset );
+  rf_cache_invalidate(path);
 
-      /* Just in case offset is bigger than the file. */
-      if (offset >= size) return 0;
+  ptr = rf_find_opened(path,fi);
+  if (ptr == NULL)
+    return rf_truncate(path,offset);
 
-      str[offset] = '\0';
-      rf_call(path,id_write_to,rb_str_new2(str));
+  if (ptr->raw) {
+    ret = rf_flush_writes(ptr);
+    if (ret)
+      return ret;
+    ptr->ra_len = 0;
+    if (ptr->fd >= 0)
+      return ftruncate(ptr->fd,offset) ? -errno : 0;
+    if ((ptr->handle != Qnil) && rb_respond_to(ptr->handle,id_truncate)) {
+      rf_hcall(ptr->handle,id_truncate,OFFT2NUM(offset));
+      return rf_call_failed ? -EIO : 0;
     }
+    ret = rf_truncate_call(path,offset);
+    if (ret <= 0)
+      return ret;
+    return rf_truncate(path,offset);
   }
-  return 0;
+
+  if ((ptr->writesize == 0) || ptr->append)
+    return rf_truncate(path,offset);
+
+  ret = rf_sparse_fits(ptr,offset,offset);
+  if (ret == 0)
+    ret = rf_file_resize(ptr,offset);
+  if (ret == 0)
+    ptr->modified = 1;
+  return ret;
 }
 
 /* rf_mkdir
@@ -1160,6 +3469,7 @@ rf_truncate(const char *path, off_t offset) {
 static int
 rf_mkdir(const char *path, mode_t mode) {
   debug("rf_mkdir(%s)",path);
+  rf_cache_invalidate(path);
   /* Does it exist? */
   if (RTEST(rf_call(path,is_directory,Qnil)))
     return -EEXIST;
@@ -1185,6 +3495,7 @@ rf_mkdir(const char *path, mode_t mode) {
 static int
 rf_rmdir(const char *path) {
   debug("rf_rmdir(%s)",path);
+  rf_cache_invalidate_under(path);
   /* Does it exist? */
   if (!RTEST(rf_call(path,is_directory,Qnil))) {
     if (RTEST(rf_call(path,is_file,Qnil))) {
@@ -1216,13 +3527,13 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
   debug("rf_write(%s)",path);
 
   opened_file *ptr;
+  int err;
 
-  debug( "  Offset is %d\n", offset );
+  debug( "  Offset is %lld\n", (long long) offset );
 
   debug("  Checking if file is open... ");
   /* Find the opened file. */
-  for (ptr = opened_head;ptr;ptr = ptr->next)
-    if (strcmp(ptr->path,path) == 0) break;
+  ptr = rf_find_opened(path,fi);
 
   /* If we don't have this open, we can't write to it. */
   if (ptr == NULL) {
@@ -1241,13 +3552,18 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
   debug("  Checking if it's opened for raw write...");
   if (ptr->raw) {
     /* raw read */
-    VALUE args = rb_ary_new();
     debug(" yes.\n");
-    rb_ary_push(args,INT2NUM(offset));
-    rb_ary_push(args,INT2NUM(size));
-    rb_ary_push(args,rb_str_new(buf,size));
-    rf_call(path,id_raw_write,args);
-    return size;
+    rf_cache_invalidate(path);
+    if (ptr->fd >= 0) {
+      ssize_t ret = pwrite(ptr->fd, buf, size, offset);
+      return (ret < 0) ? -errno : ret;
+    }
+    /* What we read ahead may be stale now. */
+    ptr->ra_len = 0;
+    if (writebehind_max > 0)
+      return rf_writebehind(ptr, path, buf, size, offset);
+    err = rf_raw_write(ptr, path, buf, size, offset);
+    return err ? err : size;
   }
   debug(" no.\n");
   debug("  Checking if it's open for write ...");
@@ -1260,17 +3576,26 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
   /* Mark it modified. */
   ptr->modified = 1;
 
-  /* We have it, so now we need to write to it. */
+  /* We have it, so now we need to write to it. If we only hold what is
+   * being appended, every write goes on the end. */
+  if (ptr->append)
+    offset = ptr->size;
   offset += ptr->zero_offset;
 
-  /* Grow memory if necessary. */
-  if ((offset + size + 1) > ptr->writesize) {
-    size_t newsize;
-    newsize = offset + size + 1 + FILE_GROW_SIZE;
-    newsize -= newsize % FILE_GROW_SIZE;
-    ptr->writesize = newsize;
-    ptr->value = REALLOC_N(ptr->value, char, newsize);
-  }
+  /* Writing past the end leaves a hole of zeroes. */
+  if ((err = rf_sparse_fits(ptr,offset,offset + size)))
+    return err;
+  if ((offset > ptr->size) && (err = rf_file_resize(ptr,offset)))
+    return err;
+
+  /* Grow memory if necessary. Past the budget and out of spill space,
+   * the writer is told the disk is full. */
+  if ((err = rf_file_grow(ptr,offset + size)))
+    return err;
+
+  /* A sparse file gets its space as it's written. */
+  if (ptr->sparse && (posix_fallocate(ptr->spill_fd, offset, size) != 0))
+    return -ENOSPC;
 
   memcpy(ptr->value + offset, buf, size);
 
@@ -1284,6 +3609,177 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
   return size;
 }
 
+/* rf_raw_read
+ *
+ * Used by: rf_read, for files opened with raw_open.
+ *
+ * If the handle object responds to read_into, or FuseRoot to raw_read_into,
+ *   it is passed a String buffer that FuseFS keeps between reads, and is
+ *   expected to fill it in place (IO#read(size,buffer) does just that). It
+ *   may return the number of bytes filled. Otherwise, read or raw_read is
+ *   called, and is expected to return a String.
+ *
+ * Either way, no more than size bytes are copied into buf.
+ *
+ * Files whose handle is an IO are read with pread, and never enter Ruby.
+ */
+static VALUE rf_readargs = Qnil;
+static VALUE rf_readbuf  = Qnil;
+static long  rf_readbuf_capa = 0;
+
+static int
+rf_raw_read(opened_file *ptr, const char *path, char *buf, size_t size,
+            off_t offset) {
+  VALUE ret;
+  VALUE args = rf_readargs;
+  VALUE into = Qnil;
+  long len;
+
+  rf_stats.raw_reads++;
+
+  if (ptr->fd >= 0) {
+    ssize_t ret = pread(ptr->fd, buf, size, offset);
+    return (ret < 0) ? -errno : ret;
+  }
+
+  rb_ary_clear(args);
+  rb_ary_push(args,OFFT2NUM(offset));
+  rb_ary_push(args,ULONG2NUM(size));
+
+  if ((ptr->handle != Qnil) && rb_respond_to(ptr->handle,id_read_into)) {
+    into = ptr->handle;
+  } else if ((ptr->handle == Qnil) || !rb_respond_to(ptr->handle,id_read)) {
+    if (rb_respond_to(FuseRoot,id_raw_read_into))
+      into = FuseRoot;
+  }
+
+  if (into != Qnil) {
+    if ((rf_readbuf == Qnil) || (rf_readbuf_capa < (long) size)) {
+      rf_readbuf = rb_str_buf_new(size);
+      rf_readbuf_capa = size;
+    }
+    rb_str_set_len(rf_readbuf,0);
+    rb_ary_push(args,rf_readbuf);
+    if (into == FuseRoot) {
+      ret = rf_call(path,id_raw_read_into,args);
+    } else {
+      ret = rf_hcall(into,id_read_into,args);
+    }
+    if (rf_op_timed_out)
+      return -EAGAIN;
+    if (!RTEST(ret))
+      return 0;
+    if (TYPE(ret) == T_STRING) {
+      len = RSTRING(ret)->len;
+    } else {
+      len = RSTRING(rf_readbuf)->len;
+      if (FIXNUM_P(ret) && (FIX2LONG(ret) < len))
+        len = FIX2LONG(ret);
+      ret = rf_readbuf;
+    }
+  } else {
+    if ((ptr->handle != Qnil) && rb_respond_to(ptr->handle,id_read)) {
+      ret = rf_hcall(ptr->handle,id_read,args);
+    } else {
+      ret = rf_call(path,id_raw_read,args);
+    }
+    if (rf_op_timed_out)
+      return -EAGAIN;
+    if (!RTEST(ret))
+      return 0;
+    if (TYPE(ret) != T_STRING)
+      return 0;
+    len = RSTRING(ret)->len;
+  }
+
+  if (len > (long) size)
+    len = size;
+  if (len <= 0)
+    return 0;
+  memcpy(buf, RSTRING(ret)->ptr, len);
+  return len;
+}
+
+/* rf_readahead
+ *
+ * Used by: rf_read, for raw files when FuseFS.readahead is set.
+ *
+ * Each raw file keeps a read-ahead buffer. A read that starts where the
+ *   last one ended is sequential, and fetches a window past it, doubling the
+ *   window each time up to readahead_max. Reads that land inside the buffer
+ *   are served from it without calling raw_read. A read anywhere else drops
+ *   the window, and is passed on as-is, as are reads the budget or the heap
+ *   has no room to read ahead for.
+ */
+static int
+rf_readahead(opened_file *ptr, const char *path, char *buf, size_t size,
+             off_t offset) {
+  size_t want;
+  int got;
+
+  /* Served from what we already have? A short fetch means we hit EOF, so
+   * anything past ra_len isn't there either. */
+  if ((ptr->ra_len > 0) && (offset >= ptr->ra_off) &&
+      (offset < ptr->ra_off + (off_t) ptr->ra_len) &&
+      ((offset + (off_t) size <= ptr->ra_off + (off_t) ptr->ra_len) ||
+       (ptr->ra_len < ptr->ra_window))) {
+    size_t avail = ptr->ra_off + ptr->ra_len - offset;
+    if (size > avail)
+      size = avail;
+    memcpy(buf, ptr->ra_buf + (offset - ptr->ra_off), size);
+    ptr->ra_next = offset + size;
+    rf_stats.readahead_hits++;
+    return size;
+  }
+
+  /* Sequential? Grow the window. If not, start over. */
+  if (offset == ptr->ra_next) {
+    if (ptr->ra_window < size * 2)
+      ptr->ra_window = size * 2;
+    else
+      ptr->ra_window *= 2;
+    if (ptr->ra_window > readahead_max)
+      ptr->ra_window = readahead_max;
+  } else {
+    ptr->ra_window = 0;
+  }
+  ptr->ra_len = 0;
+
+  want = ptr->ra_window;
+  if ((ptr->ra_size < want) && (want > size) &&
+      !rf_over_budget(want - ptr->ra_size)) {
+    size_t capa = want;
+    char *ra_buf = rf_buf_realloc(ptr->ra_buf, ptr->ra_size, &capa, 0);
+    if (ra_buf != NULL) {
+      ptr->ra_buf = ra_buf;
+      rf_stats.buffer_bytes += capa - ptr->ra_size;
+      ptr->ra_size = capa;
+    }
+  }
+  /* Not worth it, or no memory to read ahead into: just read. */
+  if ((want <= size) || (ptr->ra_size < want)) {
+    got = rf_raw_read(ptr, path, buf, size, offset);
+    if (got > 0)
+      ptr->ra_next = offset + got;
+    return got;
+  }
+
+  got = rf_raw_read(ptr, path, ptr->ra_buf, want, offset);
+  if (got <= 0)
+    return got;
+
+  ptr->ra_off = offset;
+  ptr->ra_len = got;
+  if ((size_t) got > size) {
+    rf_stats.readahead_bytes += got - size;
+  } else {
+    size = got;
+  }
+  memcpy(buf, ptr->ra_buf, size);
+  ptr->ra_next = offset + size;
+  return size;
+}
+
 /* rf_read
  *
  * Used when: A file opened by rf_open is read.
@@ -1291,7 +3787,8 @@ rf_write(const char *path, const char *buf, size_t size, off_t offset,
  * In most cases, this does not access FuseRoot at all. It merely reads from
  * the already-read 'file' that is saved in the opened_file list.
  *
- * For files opened with raw_open, it calls raw_read
+ * For files opened with raw_open, it calls raw_read, or read on the handle
+ * object raw_open returned.
  */
 static int
 rf_read(const char *path, char *buf, size_t size, off_t offset,
@@ -1300,8 +3797,7 @@ rf_read(const char *path, char *buf, size_t size, off_t offset,
 
   debug( "rf_read(%s)\n", path );
   /* Find the opened file. */
-  for (ptr = opened_head;ptr;ptr = ptr->next)
-    if (strcmp(ptr->path,path) == 0) break;
+  ptr = rf_find_opened(path,fi);
 
   /* If we don't have this open, it doesn't exist. */
   if (ptr == NULL)
@@ -1310,16 +3806,14 @@ rf_read(const char *path, char *buf, size_t size, off_t offset,
   /* If it's opened for raw read/write, call raw_read */
   if (ptr->raw) {
     /* raw read */
-    VALUE args = rb_ary_new();
-    rb_ary_push(args,INT2NUM(offset));
-    rb_ary_push(args,INT2NUM(size));
-    VALUE ret = rf_call(path,id_raw_read,args);
-    if (!RTEST(ret))
-      return 0;
-    if (TYPE(ret) != T_STRING)
-      return 0;
-    memcpy(buf, RSTRING(ret)->ptr, RSTRING(ret)->len);
-    return RSTRING(ret)->len;
+    if (ptr->wb_len > 0) {
+      int err = rf_flush_writes(ptr);
+      if (err)
+        return err;
+    }
+    if ((readahead_max > 0) && (ptr->fd < 0))
+      return rf_readahead(ptr, path, buf, size, offset);
+    return rf_raw_read(ptr, path, buf, size, offset);
   }
 
   /* Is there anything left to read? */
@@ -1333,29 +3827,144 @@ rf_read(const char *path, char *buf, size_t size, off_t offset,
   return 0;
 }
 
-/* rf_oper
- *
- * Used for: FUSE utilizes this to call operations at the appropriate time.
+/* rf_ops
  *
- * This is utilized by rf_mount
+ * Calls, errors and latency for each FUSE operation. Every entry in rf_oper
+ *   goes through one of the rf_timed_ wrappers, which counts a negative
+ *   result as an error.
  */
-static struct fuse_operations rf_oper = {
-    .getattr   = rf_getattr,
-    .readdir   = rf_readdir,
-    .mknod     = rf_mknod,
-    .unlink    = rf_unlink,
-    .mkdir     = rf_mkdir,
-    .rmdir     = rf_rmdir,
-    .truncate  = rf_truncate,
-    .rename    = rf_rename,
-    .chmod     = rf_chmod,
-    .open      = rf_open,
-    .release   = rf_release,
-    .utime     = rf_touch,
-    .read      = rf_read,
-    .write     = rf_write,
+enum {
+  RF_OP_GETATTR,
+  RF_OP_READDIR,
+  RF_OP_MKNOD,
+  RF_OP_UNLINK,
+  RF_OP_MKDIR,
+  RF_OP_RMDIR,
+  RF_OP_TRUNCATE,
+  RF_OP_FTRUNCATE,
+  RF_OP_RENAME,
+  RF_OP_CHMOD,
+  RF_OP_OPEN,
+  RF_OP_RELEASE,
+  RF_OP_FLUSH,
+  RF_OP_FSYNC,
+  RF_OP_UTIME,
+  RF_OP_READ,
+  RF_OP_WRITE,
+  RF_OPS
+};
+
+static const char *rf_op_names[RF_OPS] = {
+  "getattr",
+  "readdir",
+  "mknod",
+  "unlink",
+  "mkdir",
+  "rmdir",
+  "truncate",
+  "ftruncate",
+  "rename",
+  "chmod",
+  "open",
+  "release",
+  "flush",
+  "fsync",
+  "utime",
+  "read",
+  "write",
 };
 
+static rf_timing rf_ops[RF_OPS];
+
+/* rf_record
+ *
+ * Used by: FuseFS.record_to(file) and FuseFS.replay(file)
+ *
+ * When recording, every operation FUSE sends is appended to a file as a
+ *   compact binary record, for FuseFS.replay to drive a root with later.
+ *   The file starts with RF_RECORD_MAGIC. Each record is the op number
+ *   as a byte, then as BER-compressed integers (Ruby's pack 'w'): the ns
+ *   since the previous record started, the ns it took, its result
+ *   (zigzag encoded), its flags or mode, offset, size and file handle,
+ *   and the lengths of its path and second path, each followed by the
+ *   path itself. Write data is not kept, only its size.
+ */
+#define RF_RECORD_MAGIC "FuseFSr1"
+
+static FILE *rf_record = NULL;
+static unsigned long long rf_record_last = 0;
+static unsigned long long rf_record_flushed = 0;
+
+static void
+rf_record_num(unsigned long long n) {
+  unsigned char buf[10];
+  int i = sizeof(buf);
+  buf[--i] = n & 0x7f;
+  while (n >>= 7)
+    buf[--i] = 0x80 | (n & 0x7f);
+  fwrite(buf + i, 1, sizeof(buf) - i, rf_record);
+}
+
+static void
+rf_record_str(const char *str) {
+  size_t len = str ? strlen(str) : 0;
+  rf_record_num(len);
+  if (len)
+    fwrite(str, 1, len, rf_record);
+}
+
+static unsigned long long
+rf_fh_of(struct fuse_file_info *fi) {
+  return fi ? fi->fh : 0;
+}
+
+static void
+rf_record_op(int op, const char *path, const char *dest, unsigned int mode,
+             off_t offset, size_t size, unsigned long long fh,
+             unsigned long long start, int ret) {
+  putc(op, rf_record);
+  rf_record_num(rf_record_last ? start - rf_record_last : 0);
+  rf_record_num(rf_nsec() - start);
+  rf_record_num(((long long) ret << 1) ^ ((long long) ret >> 63));
+  rf_record_num(mode);
+  rf_record_num(offset);
+  rf_record_num(size);
+  rf_record_num(fh);
+  rf_record_str(path);
+  rf_record_str(dest);
+  rf_record_last = start;
+  if (start - rf_record_flushed > 1000000000ULL) {
+    fflush(rf_record);
+    rf_record_flushed = start;
+  }
+}
+
+static void
+rf_op_done(int op, unsigned long long start, int ret) {
+  unsigned long long end = rf_nsec();
+  rf_timing_add(&rf_ops[op], end - start, ret < 0);
+  rf_trace_add(RF_TRACE_OP, rf_op_names[op], start, end, ret);
+  rf_trace_path = 0;
+  rf_current_op = rf_current_path = NULL;
+}
+
+#define RF_TIMED(op,call,dest,mode,offset,size,fi) do { \
+  unsigned long long start = rf_nsec(); \
+  unsigned long long fh = rf_fh_of(fi); \
+  int ret; \
+  rf_op_timed_out = 0; \
+  rf_trace_path = rf_hash(path); \
+  rf_trace_calls = 0; \
+  rf_current_op = rf_op_names[op]; \
+  rf_current_path = path; \
+  ret = call; \
+  rf_op_done(op, start, ret); \
+  if (rf_record) \
+    rf_record_op(op, path, dest, mode, offset, size, \
+                 rf_fh_of(fi) ? rf_fh_of(fi) : fh, start, ret); \
+  return ret; \
+} while (0)
+
 /* rf_set_root
  *
  * Used by: FuseFS.set_root
@@ -1395,87 +4004,1145 @@ rf_handle_editor(VALUE self, VALUE troo) {
   return Qtrue;
 }
 
-char *valid_options[] = {
-  "default_permissions",
-  "allow_other",
-  "allow_root",
-  "direct_io",
-  "max_read=",
-  "fsname=",
-  NULL
-};
-
-int
-rf_valid_option(char *option) {
-  char opt[32];
-  char *ptr;
-  int i;
-
-  strncpy(opt,option,31);
-
-  if (ptr = strchr(opt,'*')) {
-    ptr++;
-    *ptr = '\0';
-  }
-
-  for (i=0;valid_options[i];i++) {
-    if (!strcasecmp(valid_options[i],opt)) {
-      return 1;
-    }
+/* rf_set_readahead and rf_readahead_get
+ *
+ * Used by: FuseFS.readahead = <bytes> and FuseFS.readahead
+ *
+ * Sets the largest window FuseFS will read ahead of sequential readers of
+ * raw files, turning read-ahead on. 0 (the default) turns it off.
+ */
+VALUE
+rf_set_readahead(VALUE self, VALUE bytes) {
+  long val = NUM2LONG(bytes);
+  if (val < 0) {
+    rb_raise(rb_eArgError,"readahead must not be negative");
+    return Qnil;
   }
+  readahead_max = val;
+  return bytes;
+}
 
-  return 0;
+VALUE
+rf_readahead_get(VALUE self) {
+  return ULONG2NUM(readahead_max);
 }
 
-/* rf_mount_to
+/* rf_set_writebehind and rf_set_writebehind_delay
  *
- * Used by: FuseFS.mount_to(dir)
+ * Used by: FuseFS.write_behind = <bytes> and
+ *          FuseFS.write_behind_delay = <seconds>
  *
- * FuseFS.mount_to(dir) calls FUSE to mount FuseFS under the given directory.
+ * Holds back and merges adjacent writes to raw files until <bytes> are
+ * waiting, or the oldest has waited <seconds> (1 by default), or the file
+ * is flushed, fsync'd or closed. 0 bytes (the default) turns it off.
  */
 VALUE
-rf_mount_to(int argc, VALUE *argv, VALUE self) {
-  int i;
-  char opts[1024];
-  char opts2[1024];
-  char *cur;
-  VALUE mountpoint;
-
-  snprintf(opts,1024,"direct_io");
-
-  if (self != cFuseFS) {
-    rb_raise(cFSException,"Error: 'mount_to' called outside of FuseFS?!");
+rf_set_writebehind(VALUE self, VALUE bytes) {
+  long val = NUM2LONG(bytes);
+  if (val < 0) {
+    rb_raise(rb_eArgError,"write_behind must not be negative");
     return Qnil;
   }
+  writebehind_max = val;
+  return bytes;
+}
 
-  if (argc == 0) {
-    rb_raise(rb_eArgError,"mount_to requires at least 1 argument!");
-    return Qnil;
-  }
+VALUE
+rf_writebehind_get(VALUE self) {
+  return ULONG2NUM(writebehind_max);
+}
 
-  mountpoint = argv[0];
+VALUE
+rf_set_writebehind_delay(VALUE self, VALUE secs) {
+  writebehind_delay = NUM2DBL(secs);
+  return secs;
+}
 
-  Check_Type(mountpoint, T_STRING); 
+VALUE
+rf_writebehind_delay_get(VALUE self) {
+  return rb_float_new(writebehind_delay);
+}
 
-  for (i = 1;i < argc; i++) {
-    Check_Type(argv[i], T_STRING);
-    cur = STR2CSTR(argv[i]);
-    if (!rf_valid_option(cur)) {
-      rb_raise(rb_eArgError,"mount_under: \"%s\" - invalid argument.", cur);
-      return Qnil;
-    }
-    snprintf(opts2,1024,"%s,%s",opts,STR2CSTR(argv[i]));
-    strcpy(opts,opts2);
+/* rf_set_buffer_budget
+ *
+ * Used by: FuseFS.buffer_budget = <bytes>
+ *
+ * Caps the memory held by open files' buffers. Past it, whole-file
+ * buffers are spilled to an unlinked temporary file, and read-ahead and
+ * write-behind are skipped. When spill space runs out too, writes fail
+ * with ENOSPC and opens with ENOMEM. 0 (the default) means no limit.
+ */
+VALUE
+rf_set_buffer_budget(VALUE self, VALUE bytes) {
+  long val = NUM2LONG(bytes);
+  if (val < 0) {
+    rb_raise(rb_eArgError,"buffer_budget must not be negative");
+    return Qnil;
   }
+  buffer_budget = val;
+  return bytes;
+}
 
-  rb_iv_set(cFuseFS,"@mountpoint",mountpoint);
-  fusefs_setup(STR2CSTR(mountpoint), &rf_oper, opts);
-  return Qtrue;
+VALUE
+rf_buffer_budget_get(VALUE self) {
+  return ULONG2NUM(buffer_budget);
 }
 
-/* rf_fd
+/* rf_set_attr_ttl, rf_set_stale_ttl and rf_set_callback_timeout
  *
- * Used by: FuseFS.fuse_fd(dir)
+ * Used by: FuseFS.attr_ttl = <seconds>, FuseFS.stale_ttl = <seconds> and
+ *          FuseFS.callback_timeout = <seconds>
+ *
+ * attr_ttl keeps what getattr finds for <seconds>. stale_ttl lets cached
+ * attributes and contents be served for <seconds> more, refreshing them
+ * once FuseFS is idle. callback_timeout gives up on a FuseRoot or handle
+ * method after <seconds>: stale attributes or contents are served if
+ * there are any, or else the call fails with ETIMEDOUT (EAGAIN for
+ * reads and writes). All are 0, off, by default.
+ */
+VALUE
+rf_set_attr_ttl(VALUE self, VALUE secs) {
+  int i;
+  attr_ttl = NUM2DBL(secs);
+  if (attr_ttl <= 0)
+    for (i = 0; i < RF_ATTR_SLOTS; i++)
+      if (rf_attrs[i].path)
+        rf_attr_drop(&rf_attrs[i]);
+  return secs;
+}
+
+VALUE
+rf_attr_ttl_get(VALUE self) {
+  return rb_float_new(attr_ttl);
+}
+
+VALUE
+rf_set_stale_ttl(VALUE self, VALUE secs) {
+  stale_ttl = NUM2DBL(secs);
+  return secs;
+}
+
+VALUE
+rf_stale_ttl_get(VALUE self) {
+  return rb_float_new(stale_ttl);
+}
+
+VALUE
+rf_set_callback_timeout(VALUE self, VALUE secs) {
+  callback_timeout = NUM2DBL(secs);
+  return secs;
+}
+
+VALUE
+rf_callback_timeout_get(VALUE self) {
+  return rb_float_new(callback_timeout);
+}
+
+/* rf_set_slow_threshold and rf_slow_log_get
+ *
+ * Used by: FuseFS.slow_threshold = <seconds> and FuseFS.slow_log
+ *
+ * Logs FuseRoot and handle methods that take over <seconds>, along with
+ * where they spent the time, sampled by the FuseFS.watch_slow thread.
+ * Methods that raise are logged whatever the threshold. 0 (the default)
+ * logs only those.
+ */
+VALUE
+rf_set_slow_threshold(VALUE self, VALUE secs) {
+  slow_threshold = NUM2DBL(secs);
+  if (slow_threshold > 0)
+    rb_funcall(cFuseFS,id_watch_slow,1,rb_thread_current());
+  return secs;
+}
+
+VALUE
+rf_slow_threshold_get(VALUE self) {
+  return rb_float_new(slow_threshold);
+}
+
+VALUE
+rf_slow_log_get(VALUE self) {
+  return rb_ary_dup(rf_slow_log);
+}
+
+/* rf_callback_running and rf_slow_sample
+ *
+ * Used by: FuseFS.watch_slow
+ *
+ * How long the method FuseFS is waiting on has run, in seconds, or nil,
+ *   and a backtrace of it to go with its entry in the slow log. Only one
+ *   is kept per call, and one every RF_SLOW_SAMPLE_GAP seconds.
+ */
+VALUE
+rf_callback_running(VALUE self) {
+  if (!rf_callback_start)
+    return Qnil;
+  return rb_float_new((rf_nsec() - rf_callback_start) / 1e9);
+}
+
+VALUE
+rf_slow_sample(VALUE self, VALUE backtrace) {
+  double now = rf_now();
+  if (!rf_callback_start || (rf_slow_backtrace != Qnil) ||
+      (now - rf_slow_sampled_at < RF_SLOW_SAMPLE_GAP))
+    return Qfalse;
+  rf_slow_backtrace = backtrace;
+  rf_slow_sampled_at = now;
+  return Qtrue;
+}
+
+/* rf_set_cache_max_bytes and rf_set_cache_ttl
+ *
+ * Used by: FuseFS.cache_max_bytes = <bytes> and
+ *          FuseFS.cache_ttl = <seconds>
+ *
+ * Keeps up to <bytes> of what read_file returns, so that opening an
+ * unchanged file again for read doesn't call it. A cached file is used
+ * without asking FuseRoot anything for <seconds> (1 by default) after it
+ * was read; after that, if etag(path) (or else mtime) hasn't changed.
+ * 0 bytes (the default) turns it off.
+ */
+VALUE
+rf_set_cache_max_bytes(VALUE self, VALUE bytes) {
+  long val = NUM2LONG(bytes);
+  if (val < 0) {
+    rb_raise(rb_eArgError,"cache_max_bytes must not be negative");
+    return Qnil;
+  }
+  cache_max_bytes = val;
+  rf_cache_trim(0);
+  return bytes;
+}
+
+VALUE
+rf_cache_max_bytes_get(VALUE self) {
+  return ULONG2NUM(cache_max_bytes);
+}
+
+VALUE
+rf_set_cache_ttl(VALUE self, VALUE secs) {
+  cache_ttl = NUM2DBL(secs);
+  return secs;
+}
+
+VALUE
+rf_cache_ttl_get(VALUE self) {
+  return rb_float_new(cache_ttl);
+}
+
+/* rf_invalidate
+ *
+ * Used by: FuseFS.invalidate(path = nil)
+ *
+ * Drops what is cached for <path> and anything below it, or everything.
+ * Call this when a file changes other than through FuseFS.
+ */
+VALUE
+rf_invalidate(int argc, VALUE *argv, VALUE self) {
+  if (argc > 1)
+    rb_raise(rb_eArgError,"wrong number of arguments (%d for 1)",argc);
+  rf_cache_invalidate_under((argc && RTEST(argv[0])) ? STR2CSTR(argv[0]) : NULL);
+  return Qnil;
+}
+
+/* rf_timing_hash
+ *
+ * A Hash of one rf_timing, with trailing empty histogram buckets left off.
+ */
+static VALUE
+rf_timing_hash(rf_timing *t) {
+  VALUE hash = rb_hash_new();
+  VALUE hist = rb_ary_new();
+  int i, last = -1;
+  for (i = 0; i < RF_HIST_BUCKETS; i++)
+    if (t->hist[i]) last = i;
+  for (i = 0; i <= last; i++)
+    rb_ary_push(hist,ULONG2NUM(t->hist[i]));
+  rb_hash_aset(hash,ID2SYM(rb_intern("calls")),ULONG2NUM(t->calls));
+  rb_hash_aset(hash,ID2SYM(rb_intern("errors")),ULONG2NUM(t->errors));
+  rb_hash_aset(hash,ID2SYM(rb_intern("total_ns")),ULL2NUM(t->total_ns));
+  rb_hash_aset(hash,ID2SYM(rb_intern("histogram")),hist);
+  return hash;
+}
+
+static VALUE
+rf_ops_hash() {
+  VALUE hash = rb_hash_new();
+  int i;
+  for (i = 0; i < RF_OPS; i++) {
+    if (rf_ops[i].calls)
+      rb_hash_aset(hash,rb_str_new2(rf_op_names[i]),rf_timing_hash(&rf_ops[i]));
+  }
+  return hash;
+}
+
+static VALUE
+rf_callbacks_hash() {
+  VALUE hash = rb_hash_new();
+  char name[64];
+  int i;
+  for (i = 0; i < RF_CALLBACK_SLOTS; i++) {
+    if (!rf_callbacks[i].id)
+      continue;
+    snprintf(name,sizeof(name),"%s%s",
+             rf_callbacks[i].handle ? "handle." : "", rf_callbacks[i].name);
+    rb_hash_aset(hash,rb_str_new2(name),rf_timing_hash(&rf_callbacks[i].timing));
+  }
+  return hash;
+}
+
+/* rf_stat_list
+ *
+ * The rf_stats counters by name. Gauges say how much is held right now,
+ *   rather than counting up.
+ */
+#define RF_COUNTER(name) { #name, &rf_stats.name, 0 }
+#define RF_GAUGE(name)   { #name, &rf_stats.name, 1 }
+
+static struct {
+  const char *name;
+  unsigned long *value;
+  int gauge;
+} rf_stat_list[] = {
+  RF_COUNTER(raw_reads),
+  RF_COUNTER(readahead_hits),
+  RF_COUNTER(readahead_bytes),
+  RF_COUNTER(raw_writes),
+  RF_COUNTER(writebehind_hits),
+  RF_COUNTER(writebehind_errors),
+  RF_GAUGE(buffer_bytes),
+  RF_GAUGE(spill_bytes),
+  RF_COUNTER(spills),
+  RF_COUNTER(spill_failures),
+  RF_COUNTER(pool_hits),
+  RF_COUNTER(cache_hits),
+  RF_COUNTER(cache_misses),
+  RF_GAUGE(cache_bytes),
+  RF_COUNTER(attr_hits),
+  RF_COUNTER(attr_misses),
+  RF_COUNTER(stale_hits),
+  RF_COUNTER(refreshes),
+  RF_COUNTER(timeouts),
+  RF_COUNTER(exceptions),
+  RF_COUNTER(slow_callbacks),
+  { NULL, NULL, 0 }
+};
+
+/* rf_get_stats
+ *
+ * Used by: FuseFS.stats
+ *
+ * Returns a Hash of FuseFS's internal counters.
+ */
+VALUE
+rf_get_stats(VALUE self) {
+  VALUE hash = rb_hash_new();
+  int i;
+  for (i = 0; rf_stat_list[i].name; i++)
+    rb_hash_aset(hash,ID2SYM(rb_intern(rf_stat_list[i].name)),
+                 ULONG2NUM(*rf_stat_list[i].value));
+  rb_hash_aset(hash,ID2SYM(rb_intern("ops")),rf_ops_hash());
+  rb_hash_aset(hash,ID2SYM(rb_intern("callbacks")),rf_callbacks_hash());
+  return hash;
+}
+
+/* rf_dump_trace
+ *
+ * Used by: FuseFS.dump_trace(file)
+ *
+ * Writes rf_trace, oldest first, as Chrome trace JSON to an IO or a file
+ * name. Each operation is a complete event, with the methods it called
+ * nested inside it by time.
+ */
+VALUE
+rf_dump_trace(VALUE self, VALUE file) {
+  VALUE json = rb_str_new2("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  char event[512];
+  unsigned long i, first;
+  rf_trace_event *ev;
+  unsigned long long dur;
+  FILE *out;
+  int pid = getpid();
+
+  first = (rf_trace_next > RF_TRACE_EVENTS) ?
+          rf_trace_next - RF_TRACE_EVENTS : 0;
+  for (i = first; i < rf_trace_next; i++) {
+    ev = &rf_trace[i % RF_TRACE_EVENTS];
+    dur = ev->end - ev->start;
+    snprintf(event,sizeof(event),
+             "%s\n{\"name\":\"%s%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+             "\"tid\":1,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+             "\"args\":{\"path_hash\":\"%08x\",",
+             (i == first) ? "" : ",",
+             (ev->kind == RF_TRACE_HANDLE) ? "handle." : "", ev->name,
+             (ev->kind == RF_TRACE_OP) ? "op" : "callback", pid,
+             ev->start / 1000, ev->start % 1000, dur / 1000, dur % 1000,
+             ev->path_hash);
+    rb_str_cat2(json,event);
+    if (ev->kind == RF_TRACE_OP)
+      snprintf(event,sizeof(event),"\"result\":%d,\"callbacks\":%u}}",
+               ev->result, ev->calls);
+    else
+      snprintf(event,sizeof(event),"\"failed\":%s}}",
+               ev->result ? "true" : "false");
+    rb_str_cat2(json,event);
+  }
+  rb_str_cat2(json,"\n]}\n");
+
+  if (rb_respond_to(file,id_write)) {
+    rb_funcall(file,id_write,1,json);
+    return Qnil;
+  }
+  out = fopen(STR2CSTR(file),"w");
+  if (!out)
+    rb_sys_fail(STR2CSTR(file));
+  fwrite(RSTRING(json)->ptr,1,RSTRING(json)->len,out);
+  if (fclose(out))
+    rb_sys_fail(STR2CSTR(file));
+  return Qnil;
+}
+
+/* rf_record_to
+ *
+ * Used by: FuseFS.record_to(filename)
+ *
+ * Starts recording every operation to the named file, or with nil, stops
+ *   and closes it. The file is flushed about once a second while busy,
+ *   and when FuseFS goes idle.
+ */
+VALUE
+rf_record_to(VALUE self, VALUE file) {
+  FILE *out = NULL;
+
+  if (!NIL_P(file)) {
+    out = fopen(STR2CSTR(file),"w");
+    if (!out)
+      rb_sys_fail(STR2CSTR(file));
+    setvbuf(out,NULL,_IOFBF,65536);
+    fwrite(RF_RECORD_MAGIC,1,strlen(RF_RECORD_MAGIC),out);
+  }
+  if (rf_record && fclose(rf_record)) {
+    rf_record = out;
+    rb_sys_fail("FuseFS.record_to");
+  }
+  rf_record = out;
+  rf_record_last = 0;
+  return Qnil;
+}
+
+/* rf_reset_stats
+ *
+ * Used by: FuseFS.reset_stats
+ *
+ * Zeroes the counters and timings. buffer_bytes, spill_bytes and
+ *   cache_bytes say how much is held right now, so they are kept.
+ */
+VALUE
+rf_reset_stats(VALUE self) {
+  int i;
+  for (i = 0; rf_stat_list[i].name; i++)
+    if (!rf_stat_list[i].gauge)
+      *rf_stat_list[i].value = 0;
+  memset(rf_ops,0,sizeof(rf_ops));
+  memset(rf_callbacks,0,sizeof(rf_callbacks));
+  rb_ary_clear(rf_slow_log);
+  return Qnil;
+}
+
+/* rf_ctl
+ *
+ * Used by: FuseFS.control_dir = <name>
+ *
+ * The control directory, /<name> in the mount, is served from here without
+ *   consulting FuseRoot. "stats" shows FuseFS.stats in the Prometheus text
+ *   format, "invalidate" takes paths to drop from the caches, one a line,
+ *   and the other files each hold a setting that can be read and written.
+ *   Written settings are applied on close.
+ */
+#define RF_CTL_DIR        -1
+#define RF_CTL_STATS      0
+#define RF_CTL_INVALIDATE 1
+#define RF_CTL_MAX        4096
+
+static char   rf_ctl_dir[256];
+static size_t rf_ctl_len = 0;
+
+static struct {
+  const char *name;
+  VALUE (*get)(VALUE);
+  VALUE (*set)(VALUE,VALUE);
+} rf_ctl_files[] = {
+  { "stats",              NULL,                      NULL },
+  { "invalidate",         NULL,                      NULL },
+  { "attr_ttl",           rf_attr_ttl_get,           rf_set_attr_ttl },
+  { "stale_ttl",          rf_stale_ttl_get,          rf_set_stale_ttl },
+  { "cache_ttl",          rf_cache_ttl_get,          rf_set_cache_ttl },
+  { "cache_max_bytes",    rf_cache_max_bytes_get,    rf_set_cache_max_bytes },
+  { "buffer_budget",      rf_buffer_budget_get,      rf_set_buffer_budget },
+  { "callback_timeout",   rf_callback_timeout_get,   rf_set_callback_timeout },
+  { "slow_threshold",     rf_slow_threshold_get,     rf_set_slow_threshold },
+  { "readahead",          rf_readahead_get,          rf_set_readahead },
+  { "write_behind",       rf_writebehind_get,        rf_set_writebehind },
+  { "write_behind_delay", rf_writebehind_delay_get,  rf_set_writebehind_delay },
+  { NULL, NULL, NULL }
+};
+
+typedef struct rf_ctl_handle {
+  int which;
+  char *buf;
+  size_t len;
+  size_t capa;
+  int dirty;
+  struct rf_ctl_handle *next;
+} rf_ctl_handle;
+
+/* Open control files. Operations on an open file go by its handle, not
+ * its path, since control_dir may have changed since it was opened. */
+static rf_ctl_handle *rf_ctl_handles = NULL;
+
+static int
+rf_ctl_handleP(struct fuse_file_info *fi) {
+  rf_ctl_handle *h;
+  if ((fi == NULL) || (fi->fh == 0))
+    return 0;
+  for (h = rf_ctl_handles; h; h = h->next)
+    if ((uintptr_t) h == fi->fh)
+      return 1;
+  return 0;
+}
+
+static int
+rf_ctl_pathP(const char *path) {
+  return rf_ctl_len && !strncmp(path,rf_ctl_dir,rf_ctl_len) &&
+         ((path[rf_ctl_len] == '\0') || (path[rf_ctl_len] == '/'));
+}
+
+/* Which control file <path> is, RF_CTL_DIR, or -ENOENT. */
+static int
+rf_ctl_lookup(const char *path) {
+  int i;
+  path += rf_ctl_len;
+  if (*path == '\0')
+    return RF_CTL_DIR;
+  for (i = 0; rf_ctl_files[i].name; i++)
+    if (!strcmp(path + 1,rf_ctl_files[i].name))
+      return i;
+  return -ENOENT;
+}
+
+static void
+rf_ctl_printf(rf_ctl_handle *h, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  for (;;) {
+    va_start(ap,fmt);
+    n = vsnprintf(h->buf ? h->buf + h->len : NULL, h->capa - h->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (h->len + n < h->capa) {
+      h->len += n;
+      return;
+    }
+    h->capa = (h->len + n + 1) * 2;
+    REALLOC_N(h->buf,char,h->capa);
+  }
+}
+
+static void
+rf_ctl_histogram(rf_ctl_handle *h, const char *metric, const char *label,
+                 const char *value, rf_timing *t) {
+  unsigned long count = 0;
+  int i, last = -1;
+  for (i = 0; i < RF_HIST_BUCKETS; i++)
+    if (t->hist[i]) last = i;
+  for (i = 0; i <= last; i++) {
+    count += t->hist[i];
+    rf_ctl_printf(h,"%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n",metric,label,value,
+                  (double) (1ULL << (i + 1)) / 1e9, count);
+  }
+  rf_ctl_printf(h,"%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n",metric,label,value,
+                t->calls);
+  rf_ctl_printf(h,"%s_sum{%s=\"%s\"} %.9f\n",metric,label,value,
+                t->total_ns / 1e9);
+  rf_ctl_printf(h,"%s_count{%s=\"%s\"} %lu\n",metric,label,value,t->calls);
+}
+
+/* rf_ctl_stats
+ *
+ * rf_stats, rf_ops and rf_callbacks in the Prometheus text format.
+ */
+static void
+rf_ctl_stats(rf_ctl_handle *h) {
+  char name[64];
+  int i;
+
+  for (i = 0; rf_stat_list[i].name; i++) {
+    if (rf_stat_list[i].gauge) {
+      rf_ctl_printf(h,"# TYPE fusefs_%s gauge\nfusefs_%s %lu\n",
+                    rf_stat_list[i].name, rf_stat_list[i].name,
+                    *rf_stat_list[i].value);
+    } else {
+      rf_ctl_printf(h,"# TYPE fusefs_%s_total counter\nfusefs_%s_total %lu\n",
+                    rf_stat_list[i].name, rf_stat_list[i].name,
+                    *rf_stat_list[i].value);
+    }
+  }
+
+  rf_ctl_printf(h,"# TYPE fusefs_op_duration_seconds histogram\n");
+  for (i = 0; i < RF_OPS; i++)
+    if (rf_ops[i].calls)
+      rf_ctl_histogram(h,"fusefs_op_duration_seconds","op",rf_op_names[i],
+                       &rf_ops[i]);
+  rf_ctl_printf(h,"# TYPE fusefs_op_errors_total counter\n");
+  for (i = 0; i < RF_OPS; i++)
+    if (rf_ops[i].calls)
+      rf_ctl_printf(h,"fusefs_op_errors_total{op=\"%s\"} %lu\n",
+                    rf_op_names[i], rf_ops[i].errors);
+
+  rf_ctl_printf(h,"# TYPE fusefs_callback_duration_seconds histogram\n");
+  for (i = 0; i < RF_CALLBACK_SLOTS; i++) {
+    if (!rf_callbacks[i].id)
+      continue;
+    snprintf(name,sizeof(name),"%s%s",
+             rf_callbacks[i].handle ? "handle." : "", rf_callbacks[i].name);
+    rf_ctl_histogram(h,"fusefs_callback_duration_seconds","callback",name,
+                     &rf_callbacks[i].timing);
+  }
+  rf_ctl_printf(h,"# TYPE fusefs_callback_errors_total counter\n");
+  for (i = 0; i < RF_CALLBACK_SLOTS; i++) {
+    if (!rf_callbacks[i].id)
+      continue;
+    snprintf(name,sizeof(name),"%s%s",
+             rf_callbacks[i].handle ? "handle." : "", rf_callbacks[i].name);
+    rf_ctl_printf(h,"fusefs_callback_errors_total{callback=\"%s\"} %lu\n",
+                  name, rf_callbacks[i].timing.errors);
+  }
+}
+
+/* rf_ctl_render
+ *
+ * Fills a handle with what its file reads as.
+ */
+static void
+rf_ctl_render(rf_ctl_handle *h) {
+  VALUE val;
+  h->len = 0;
+  if (h->which == RF_CTL_STATS) {
+    rf_ctl_stats(h);
+  } else if (rf_ctl_files[h->which].get) {
+    val = rf_ctl_files[h->which].get(cFuseFS);
+    if (TYPE(val) == T_FLOAT)
+      rf_ctl_printf(h,"%g\n",NUM2DBL(val));
+    else
+      rf_ctl_printf(h,"%lu\n",NUM2ULONG(val));
+  }
+}
+
+static VALUE
+rf_ctl_set_protected(VALUE args) {
+  int which = NUM2INT(rb_ary_entry(args,0));
+  return rf_ctl_files[which].set(cFuseFS,rb_ary_entry(args,1));
+}
+
+/* rf_ctl_apply
+ *
+ * Applies what was written to a handle: drops each path written to
+ *   invalidate (everything, if none were), or sets the setting through
+ *   its FuseFS method. Anything it won't take is -EINVAL.
+ */
+static int
+rf_ctl_apply(rf_ctl_handle *h) {
+  char *text, *end, *line;
+  VALUE val;
+  int error, any = 0;
+
+  h->dirty = 0;
+  if (h->len >= h->capa) {
+    h->capa = h->len + 1;
+    REALLOC_N(h->buf,char,h->capa);
+  }
+  h->buf[h->len] = '\0';
+
+  if (h->which == RF_CTL_INVALIDATE) {
+    for (line = h->buf; line && *line; line = end) {
+      end = strchr(line,'\n');
+      if (end)
+        *end++ = '\0';
+      if (*line) {
+        debug("  invalidating %s\n", line);
+        rf_cache_invalidate_under(line);
+        any = 1;
+      }
+    }
+    if (!any)
+      rf_cache_invalidate_under(NULL);
+    return 0;
+  }
+
+  text = h->buf;
+  while ((*text == ' ') || (*text == '\t'))
+    text++;
+  if (strpbrk(text,".eEnN"))
+    val = rb_float_new(strtod(text,&end));
+  else
+    val = LL2NUM(strtoll(text,&end,10));
+  if (end == text)
+    return -EINVAL;
+  while (*end && strchr(" \t\r\n",*end))
+    end++;
+  if (*end)
+    return -EINVAL;
+
+  rb_protect(rf_ctl_set_protected,rb_ary_new3(2,INT2NUM(h->which),val),&error);
+  return error ? -EINVAL : 0;
+}
+
+static int
+rf_ctl_getattr(const char *path, struct stat *stbuf) {
+  rf_ctl_handle h;
+  int which = rf_ctl_lookup(path);
+
+  if (which < RF_CTL_DIR)
+    return which;
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_mtime = stbuf->st_atime = stbuf->st_ctime = time(NULL);
+  if (which == RF_CTL_DIR) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    stbuf->st_size = 4096;
+    return 0;
+  }
+  stbuf->st_mode = S_IFREG | ((which == RF_CTL_STATS) ? 0444 :
+                              (which == RF_CTL_INVALIDATE) ? 0200 : 0644);
+  stbuf->st_nlink = 1;
+  memset(&h, 0, sizeof(h));
+  h.which = which;
+  rf_ctl_render(&h);
+  stbuf->st_size = h.len;
+  if (h.buf) free(h.buf);
+  return 0;
+}
+
+static int
+rf_ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  int i, which = rf_ctl_lookup(path);
+  if (which != RF_CTL_DIR)
+    return (which < 0) ? which : -ENOTDIR;
+  filler(buf,".", NULL, 0);
+  filler(buf,"..", NULL, 0);
+  for (i = 0; rf_ctl_files[i].name; i++)
+    filler(buf,rf_ctl_files[i].name, NULL, 0);
+  return 0;
+}
+
+static int
+rf_ctl_open(const char *path, struct fuse_file_info *fi) {
+  rf_ctl_handle *h;
+  int which = rf_ctl_lookup(path);
+  int mode = fi->flags & O_ACCMODE;
+
+  if (which == RF_CTL_DIR)
+    return -EISDIR;
+  if (which < 0)
+    return which;
+  if ((which == RF_CTL_STATS) && (mode != O_RDONLY))
+    return -EACCES;
+  if ((which == RF_CTL_INVALIDATE) && (mode != O_WRONLY))
+    return -EACCES;
+
+  h = ALLOC(rf_ctl_handle);
+  memset(h, 0, sizeof(rf_ctl_handle));
+  h->which = which;
+  if ((mode != O_WRONLY) && !(fi->flags & O_TRUNC))
+    rf_ctl_render(h);
+  h->next = rf_ctl_handles;
+  rf_ctl_handles = h;
+  fi->fh = (uintptr_t) h;
+  return 0;
+}
+
+static int
+rf_ctl_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  rf_ctl_handle *h = (rf_ctl_handle *) (uintptr_t) fi->fh;
+  if (offset >= (off_t) h->len)
+    return 0;
+  if (size > h->len - offset)
+    size = h->len - offset;
+  memcpy(buf, h->buf + offset, size);
+  return size;
+}
+
+static int
+rf_ctl_resize(rf_ctl_handle *h, off_t size) {
+  if (size > RF_CTL_MAX)
+    return -EFBIG;
+  if ((size_t) size >= h->capa) {
+    h->capa = size + 1;
+    REALLOC_N(h->buf,char,h->capa);
+  }
+  if ((size_t) size > h->len)
+    memset(h->buf + h->len, 0, size - h->len);
+  h->len = size;
+  h->dirty = 1;
+  return 0;
+}
+
+static int
+rf_ctl_write(const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
+  rf_ctl_handle *h = (rf_ctl_handle *) (uintptr_t) fi->fh;
+  size_t len = h->len;
+  int ret;
+
+  if ((offset + size) > len) {
+    if ((ret = rf_ctl_resize(h,offset + size)) != 0)
+      return ret;
+  }
+  memcpy(h->buf + offset, buf, size);
+  h->dirty = 1;
+  return size;
+}
+
+/* Settings are only changed by what is written and closed, so a
+ * truncate without a handle does nothing. */
+static int
+rf_ctl_truncate(const char *path, off_t offset) {
+  int which = rf_ctl_lookup(path);
+  if (which == RF_CTL_DIR)
+    return -EISDIR;
+  if (which < 0)
+    return which;
+  if (which == RF_CTL_STATS)
+    return -EACCES;
+  return 0;
+}
+
+static int
+rf_ctl_ftruncate(off_t offset, struct fuse_file_info *fi) {
+  rf_ctl_handle *h = (rf_ctl_handle *) (uintptr_t) fi->fh;
+  if (h->which == RF_CTL_STATS)
+    return -EACCES;
+  return rf_ctl_resize(h, offset);
+}
+
+static int
+rf_ctl_flush(struct fuse_file_info *fi) {
+  rf_ctl_handle *h = (rf_ctl_handle *) (uintptr_t) fi->fh;
+  if (h->dirty)
+    return rf_ctl_apply(h);
+  return 0;
+}
+
+static int
+rf_ctl_release(struct fuse_file_info *fi) {
+  rf_ctl_handle *h = (rf_ctl_handle *) (uintptr_t) fi->fh;
+  rf_ctl_handle **prev;
+  for (prev = &rf_ctl_handles; *prev != h; prev = &(*prev)->next)
+    ;
+  *prev = h->next;
+  if (h->dirty)
+    rf_ctl_apply(h);
+  if (h->buf)
+    free(h->buf);
+  free(h);
+  fi->fh = 0;
+  return 0;
+}
+
+/* rf_set_control_dir
+ *
+ * Used by: FuseFS.control_dir = <name>
+ *
+ * Serves the control directory as /<name>, or ".fusefs" for true. nil or
+ *   false (the default) turns it off.
+ */
+VALUE
+rf_set_control_dir(VALUE self, VALUE name) {
+  const char *str;
+  if (!RTEST(name)) {
+    rf_ctl_len = 0;
+    return name;
+  }
+  str = (name == Qtrue) ? ".fusefs" : STR2CSTR(name);
+  if (*str == '/')
+    str++;
+  if (!*str || strchr(str,'/') || (strlen(str) >= sizeof(rf_ctl_dir) - 1)) {
+    rb_raise(rb_eArgError,"control_dir must be a name in the mount's root");
+    return Qnil;
+  }
+  snprintf(rf_ctl_dir,sizeof(rf_ctl_dir),"/%s",str);
+  rf_ctl_len = strlen(rf_ctl_dir);
+  return name;
+}
+
+VALUE
+rf_control_dir_get(VALUE self) {
+  if (!rf_ctl_len)
+    return Qnil;
+  return rb_str_new2(rf_ctl_dir + 1);
+}
+
+/* rf_timed_
+ *
+ * The entries in rf_oper. Paths in the control directory, and handles
+ *   of control files, go to rf_ctl, and the rest are timed into rf_ops.
+ */
+static int
+rf_timed_getattr(const char *path, struct stat *stbuf) {
+  if (rf_ctl_pathP(path))
+    return rf_ctl_getattr(path,stbuf);
+  RF_TIMED(RF_OP_GETATTR,rf_getattr(path,stbuf),
+           NULL,0,0,0,NULL);
+}
+
+static int
+rf_timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi) {
+  if (rf_ctl_pathP(path))
+    return rf_ctl_readdir(path,buf,filler);
+  RF_TIMED(RF_OP_READDIR,rf_readdir(path,buf,filler,offset,fi),
+           NULL,0,offset,0,fi);
+}
+
+static int
+rf_timed_mknod(const char *path, mode_t umode, dev_t rdev) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_MKNOD,rf_mknod(path,umode,rdev),
+           NULL,umode,0,0,NULL);
+}
+
+static int
+rf_timed_unlink(const char *path) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_UNLINK,rf_unlink(path),
+           NULL,0,0,0,NULL);
+}
+
+static int
+rf_timed_mkdir(const char *path, mode_t mode) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_MKDIR,rf_mkdir(path,mode),
+           NULL,mode,0,0,NULL);
+}
+
+static int
+rf_timed_rmdir(const char *path) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_RMDIR,rf_rmdir(path),
+           NULL,0,0,0,NULL);
+}
+
+static int
+rf_timed_truncate(const char *path, off_t offset) {
+  if (rf_ctl_pathP(path))
+    return rf_ctl_truncate(path,offset);
+  RF_TIMED(RF_OP_TRUNCATE,rf_truncate(path,offset),
+           NULL,0,offset,0,NULL);
+}
+
+static int
+rf_timed_ftruncate(const char *path, off_t offset,
+                   struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_ftruncate(offset,fi);
+  RF_TIMED(RF_OP_FTRUNCATE,rf_ftruncate(path,offset,fi),
+           NULL,0,offset,0,fi);
+}
+
+static int
+rf_timed_rename(const char *path, const char *dest) {
+  if (rf_ctl_pathP(path) || rf_ctl_pathP(dest))
+    return -EACCES;
+  RF_TIMED(RF_OP_RENAME,rf_rename(path,dest),
+           dest,0,0,0,NULL);
+}
+
+static int
+rf_timed_chmod(const char *path, mode_t mode) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_CHMOD,rf_chmod(path,mode),
+           NULL,mode,0,0,NULL);
+}
+
+static int
+rf_timed_open(const char *path, struct fuse_file_info *fi) {
+  if (rf_ctl_pathP(path))
+    return rf_ctl_open(path,fi);
+  RF_TIMED(RF_OP_OPEN,rf_open(path,fi),
+           NULL,fi->flags,0,0,fi);
+}
+
+static int
+rf_timed_release(const char *path, struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_release(fi);
+  RF_TIMED(RF_OP_RELEASE,rf_release(path,fi),
+           NULL,fi->flags,0,0,fi);
+}
+
+static int
+rf_timed_flush(const char *path, struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_flush(fi);
+  RF_TIMED(RF_OP_FLUSH,rf_flush(path,fi),
+           NULL,0,0,0,fi);
+}
+
+static int
+rf_timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_flush(fi);
+  RF_TIMED(RF_OP_FSYNC,rf_fsync(path,datasync,fi),
+           NULL,datasync,0,0,fi);
+}
+
+static int
+rf_timed_utime(const char *path, struct utimbuf *times) {
+  if (rf_ctl_pathP(path))
+    return -EACCES;
+  RF_TIMED(RF_OP_UTIME,rf_touch(path,times),
+           NULL,0,0,0,NULL);
+}
+
+static int
+rf_timed_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_read(buf,size,offset,fi);
+  RF_TIMED(RF_OP_READ,rf_read(path,buf,size,offset,fi),
+           NULL,0,offset,size,fi);
+}
+
+static int
+rf_timed_write(const char *path, const char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  if (rf_ctl_handleP(fi))
+    return rf_ctl_write(buf,size,offset,fi);
+  RF_TIMED(RF_OP_WRITE,rf_write(path,buf,size,offset,fi),
+           NULL,0,offset,size,fi);
+}
+
+/* rf_oper
+ *
+ * Used for: FUSE utilizes this to call operations at the appropriate time.
+ *
+ * This is utilized by rf_mount
+ */
+static struct fuse_operations rf_oper = {
+    .getattr   = rf_timed_getattr,
+    .readdir   = rf_timed_readdir,
+    .mknod     = rf_timed_mknod,
+    .unlink    = rf_timed_unlink,
+    .mkdir     = rf_timed_mkdir,
+    .rmdir     = rf_timed_rmdir,
+    .truncate  = rf_timed_truncate,
+    .ftruncate = rf_timed_ftruncate,
+    .rename    = rf_timed_rename,
+    .chmod     = rf_timed_chmod,
+    .open      = rf_timed_open,
+    .release   = rf_timed_release,
+    .flush     = rf_timed_flush,
+    .fsync     = rf_timed_fsync,
+    .utime     = rf_timed_utime,
+    .read      = rf_timed_read,
+    .write     = rf_timed_write,
+};
+
+char *valid_options[] = {
+  "default_permissions",
+  "allow_other",
+  "allow_root",
+  "direct_io",
+  "max_read=",
+  "fsname=",
+  NULL
+};
+
+int
+rf_valid_option(char *option) {
+  char opt[32];
+  char *ptr;
+  int i;
+
+  strncpy(opt,option,31);
+
+  if (ptr = strchr(opt,'*')) {
+    ptr++;
+    *ptr = '\0';
+  }
+
+  for (i=0;valid_options[i];i++) {
+    if (!strcasecmp(valid_options[i],opt)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* rf_mount_to
+ *
+ * Used by: FuseFS.mount_to(dir)
+ *
+ * FuseFS.mount_to(dir) calls FUSE to mount FuseFS under the given directory.
+ */
+VALUE
+rf_mount_to(int argc, VALUE *argv, VALUE self) {
+  int i;
+  char opts[1024];
+  char opts2[1024];
+  char *cur;
+  VALUE mountpoint;
+
+#if FUSE_VERSION >= 27
+  /* Have O_TRUNC passed to open, rather than a truncate before it, so
+   * files opened with it aren't read in only to be thrown away. */
+  snprintf(opts,1024,"direct_io,atomic_o_trunc");
+#else
+  snprintf(opts,1024,"direct_io");
+#endif
+
+  if (self != cFuseFS) {
+    rb_raise(cFSException,"Error: 'mount_to' called outside of FuseFS?!");
+    return Qnil;
+  }
+
+  if (argc == 0) {
+    rb_raise(rb_eArgError,"mount_to requires at least 1 argument!");
+    return Qnil;
+  }
+
+  mountpoint = argv[0];
+
+  Check_Type(mountpoint, T_STRING); 
+
+  for (i = 1;i < argc; i++) {
+    Check_Type(argv[i], T_STRING);
+    cur = STR2CSTR(argv[i]);
+    if (!rf_valid_option(cur)) {
+      rb_raise(rb_eArgError,"mount_under: \"%s\" - invalid argument.", cur);
+      return Qnil;
+    }
+    snprintf(opts2,1024,"%s,%s",opts,STR2CSTR(argv[i]));
+    strcpy(opts,opts2);
+  }
+
+  rb_iv_set(cFuseFS,"@mountpoint",mountpoint);
+  fusefs_setup(STR2CSTR(mountpoint), &rf_oper, opts);
+  return Qtrue;
+}
+
+/* rf_fd
+ *
+ * Used by: FuseFS.fuse_fd(dir)
  *
  * FuseFS.fuse_fd returns the file descriptor of the open handle on the
  *   /dev/fuse object that is utilized by FUSE. This is crucial for letting
@@ -1502,13 +5169,48 @@ rf_fd(VALUE self) {
  */
 VALUE
 rf_process(VALUE self) {
-  if (fusefs_process()) {
+  int ret;
+  rf_op_timed_out = 0;
+  ret = fusefs_process();
+  rf_op_timed_out = 0;
+  rf_flush_stale();
+  if (ret) {
     return Qtrue;
   }
   return Qfalse;
 }
 
 
+/* rf_flush_idle
+ *
+ * Used for: FuseFS.flush_stale
+ *
+ * FuseFS.run calls this when no command has come in for a while, so
+ *   held-back writes don't wait for the next command to be flushed, and
+ *   stale cache entries that were served are refreshed. A recording is
+ *   flushed to its file too.
+ */
+VALUE
+rf_flush_idle(VALUE self) {
+  rf_flush_stale();
+  rf_refresh_stale(1);
+  if (rf_record)
+    fflush(rf_record);
+  return Qnil;
+}
+
+/* rf_refresh_pendingP
+ *
+ * Used for: FuseFS.refresh_pending?
+ *
+ * True if stale entries are waiting to be refreshed, so FuseFS.run should
+ *   call flush_stale as soon as it is idle.
+ */
+VALUE
+rf_refresh_pendingP(VALUE self) {
+  return rf_refresh_count ? Qtrue : Qfalse;
+}
+
 /* rf_uid and rf_gid
  *
  * Used by: FuseFS.reader_uid and FuseFS.reader_gid
@@ -1516,10 +5218,14 @@ rf_process(VALUE self) {
  * These return the UID and GID of the processes that are causing the
  *   separate Fuse methods to be called. This can be used for permissions
  *   checking, returning a different file for different users, etc.
+ *   When nothing is mounted, as under FuseFS::Harness, the reader is this
+ *   process.
  */
 VALUE
 rf_uid(VALUE self) {
   int fd = fusefs_uid();
+  if ((fd < 0) && (fusefs_fd() < 0))
+    return INT2NUM(getuid());
   if (fd < 0)
     return Qnil;
   return INT2NUM(fd);
@@ -1528,11 +5234,824 @@ rf_uid(VALUE self) {
 VALUE
 rf_gid(VALUE self) {
   int fd = fusefs_gid();
+  if ((fd < 0) && (fusefs_fd() < 0))
+    return INT2NUM(getgid());
   if (fd < 0)
     return Qnil;
   return INT2NUM(fd);
 }
 
+/* rf_native methods
+ *
+ * Used by: FuseFS::NativeMetaDir
+ *
+ * MetaDir's methods, on the rf_native tree. Under a directory made with
+ *   mkdir(path,obj), each calls the same method on obj with the rest of
+ *   the path, or returns nil if obj has no such method.
+ */
+static VALUE
+rf_native_alloc(VALUE klass) {
+  return Data_Wrap_Struct(klass,rf_node_mark,rf_node_free,
+                          rf_node_new("",0,1,Qnil));
+}
+
+static VALUE
+rf_native_pass(rf_node *node, ID method, const char *rest, int argc,
+               VALUE arg) {
+  if (!rb_respond_to(node->value,method))
+    return Qnil;
+  if (argc > 1)
+    return rb_funcall(node->value,method,2,rb_str_new2(rest),arg);
+  return rb_funcall(node->value,method,1,rb_str_new2(rest));
+}
+
+/* rf_native_lookup
+ *
+ * Walks <path> in <self>. If the path goes into a directory served by an
+ *   object, calls <method> on it and returns 1, with what it returned in
+ *   *ret. Otherwise returns 0, with the node reached and, if that isn't
+ *   the path itself, *rest set.
+ */
+static int
+rf_native_lookup(VALUE self, VALUE path, ID method, int argc, VALUE arg,
+                 rf_node **node, const char **rest, VALUE *ret) {
+  *node = rf_native_walk(rf_native_root(self),STR2CSTR(path),rest);
+  if (*rest && RF_NATIVE_MOUNTED(*node)) {
+    *ret = rf_native_pass(*node,method,*rest,argc,arg);
+    return 1;
+  }
+  return 0;
+}
+
+/* The name a path creates in the directory reached, or NULL. */
+static const char *
+rf_native_newname(rf_node *node, const char *rest, size_t *len) {
+  if (!rest || !node->dir || !(*len = rf_native_name(rest)))
+    return NULL;
+  return rest;
+}
+
+VALUE
+rf_native_contents(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+  long i;
+
+  if (rf_native_lookup(self,path,id_dir_contents,1,Qnil,&node,&rest,&ret))
+    return ret;
+  if (rest || !node->dir)
+    return Qnil;
+  if (RF_NATIVE_MOUNTED(node))
+    return rf_native_pass(node,id_dir_contents,"/",1,Qnil);
+  node->atime = time(NULL);
+  ret = rb_ary_new2(node->nkids);
+  for (i = 0; i < node->nkids; i++)
+    rb_ary_push(ret,rb_str_new2(node->kids[i]->name));
+  return ret;
+}
+
+VALUE
+rf_native_directoryP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,is_directory,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return (!rest && node->dir) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_fileP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,is_file,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return (!rest && !node->dir) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_size(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,id_size,1,Qnil,&node,&rest,&ret))
+    return ret;
+  if (rest)
+    return Qnil;
+  if (node->dir)
+    return INT2FIX(4096);
+  return LONG2NUM(RSTRING(rb_obj_as_string(node->value))->len);
+}
+
+static VALUE
+rf_native_time(VALUE self, VALUE path, ID method, int which) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+  time_t *times;
+
+  if (rf_native_lookup(self,path,method,1,Qnil,&node,&rest,&ret) &&
+      (ret != Qnil))
+    return ret;
+  if (rest && !RF_NATIVE_MOUNTED(node))
+    node = rf_native_root(self);
+  times = (which == 0) ? &node->atime :
+          (which == 1) ? &node->ctime : &node->mtime;
+  return rb_time_new(*times,0);
+}
+
+VALUE
+rf_native_atime(VALUE self, VALUE path) {
+  return rf_native_time(self,path,id_atime,0);
+}
+
+VALUE
+rf_native_ctime(VALUE self, VALUE path) {
+  return rf_native_time(self,path,id_ctime,1);
+}
+
+VALUE
+rf_native_mtime(VALUE self, VALUE path) {
+  return rf_native_time(self,path,id_mtime,2);
+}
+
+VALUE
+rf_native_read_file(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,id_read_file,1,Qnil,&node,&rest,&ret))
+    return ret;
+  if (rest || node->dir)
+    return Qnil;
+  node->atime = time(NULL);
+  return rb_obj_as_string(node->value);
+}
+
+VALUE
+rf_native_can_writeP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  size_t len;
+  VALUE ret;
+
+  if (!rf_native_ownerP())
+    return Qfalse;
+  if (rf_native_lookup(self,path,can_write,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return (!rest || rf_native_newname(node,rest,&len)) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_write_to(VALUE self, VALUE path, VALUE body) {
+  rf_node *node;
+  const char *rest, *name;
+  size_t len;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,id_write_to,2,body,&node,&rest,&ret))
+    return ret;
+  if (!rest && !node->dir) {
+    node->value = body;
+    node->mtime = node->atime = time(NULL);
+    return body;
+  }
+  if (!(name = rf_native_newname(node,rest,&len)))
+    return Qfalse;
+  rf_node_insert(node,rf_node_new(name,len,0,body));
+  return body;
+}
+
+VALUE
+rf_native_append_to(VALUE self, VALUE path, VALUE str) {
+  rf_node *node;
+  const char *rest;
+  size_t len;
+  VALUE old;
+
+  node = rf_native_walk(rf_native_root(self),STR2CSTR(path),&rest);
+  if (rest && RF_NATIVE_MOUNTED(node)) {
+    if (rb_respond_to(node->value,id_append_to))
+      return rf_native_pass(node,id_append_to,rest,2,str);
+    old = rb_obj_as_string(rf_native_pass(node,id_read_file,rest,1,Qnil));
+    return rf_native_pass(node,id_write_to,rest,2,rb_str_plus(old,str));
+  }
+  if (!rest && !node->dir)
+    old = rb_obj_as_string(node->value);
+  else if (rf_native_newname(node,rest,&len))
+    old = rb_str_new2("");
+  else
+    return Qfalse;
+  return rf_native_write_to(self,path,rb_str_plus(old,str));
+}
+
+VALUE
+rf_native_can_deleteP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (!rf_native_ownerP())
+    return Qfalse;
+  if (rf_native_lookup(self,path,can_delete,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return (!rest && !node->dir) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_delete(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,id_delete,1,Qnil,&node,&rest,&ret))
+    return ret;
+  if (rest || node->dir)
+    return Qnil;
+  rf_node_detach(node);
+  rf_node_free(node);
+  return Qtrue;
+}
+
+VALUE
+rf_native_can_mkdirP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  size_t len;
+  VALUE ret;
+
+  if (!rf_native_ownerP())
+    return Qfalse;
+  if (rf_native_lookup(self,path,can_mkdir,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return rf_native_newname(node,rest,&len) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_mkdir(int argc, VALUE *argv, VALUE self) {
+  rf_node *node, *dir;
+  const char *rest, *name;
+  size_t len;
+  VALUE ret, obj;
+
+  if ((argc < 1) || (argc > 2))
+    rb_raise(rb_eArgError,"wrong number of arguments (%d for 1)",argc);
+  obj = (argc > 1) ? argv[1] : Qnil;
+  if (rf_native_lookup(self,argv[0],id_mkdir,2,obj,&node,&rest,&ret))
+    return ret;
+  if (!rest) {
+    /* As MetaDir does, an existing directory is replaced. */
+    if (!node->dir || !node->parent)
+      return Qfalse;
+    dir = node->parent;
+    rf_node_detach(node);
+    rf_node_insert(dir,rf_node_new(node->name,strlen(node->name),1,obj));
+    rf_node_free(node);
+    return Qtrue;
+  }
+  if (!(name = rf_native_newname(node,rest,&len)))
+    return Qfalse;
+  rf_node_insert(node,rf_node_new(name,len,1,obj));
+  return Qtrue;
+}
+
+VALUE
+rf_native_can_rmdirP(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (!rf_native_ownerP())
+    return Qfalse;
+  if (rf_native_lookup(self,path,can_rmdir,1,Qnil,&node,&rest,&ret))
+    return ret;
+  return (!rest && node->dir && node->parent) ? Qtrue : Qfalse;
+}
+
+VALUE
+rf_native_rmdir(VALUE self, VALUE path) {
+  rf_node *node;
+  const char *rest;
+  VALUE ret;
+
+  if (rf_native_lookup(self,path,id_rmdir,1,Qnil,&node,&rest,&ret))
+    return ret;
+  if (rest || !node->dir || !node->parent)
+    return Qfalse;
+  rf_node_detach(node);
+  rf_node_free(node);
+  return Qtrue;
+}
+
+/* rf_native_rename
+ *
+ * As MetaDir#rename: moves a file or directory within the tree, replacing
+ *   a file or empty directory at <to>. Paths under a directory served by
+ *   an object give EXDEV.
+ */
+VALUE
+rf_native_rename(VALUE self, VALUE from, VALUE to) {
+  rf_node *root = rf_native_root(self);
+  rf_node *src, *dst, *dir, *up;
+  const char *rest, *name;
+  char *newname;
+  size_t len;
+
+  if (!rf_native_ownerP())
+    return Qfalse;
+
+  src = rf_native_walk(root,STR2CSTR(from),&rest);
+  if (rest)
+    return INT2FIX(RF_NATIVE_MOUNTED(src) ? EXDEV : ENOENT);
+  if (!src->parent)
+    return INT2FIX(EINVAL);
+  if (RF_NATIVE_MOUNTED(src->parent))
+    return INT2FIX(EXDEV);
+
+  dst = rf_native_walk(root,STR2CSTR(to),&rest);
+  if (!rest) {
+    if (dst == src)
+      return Qtrue;
+    if (!dst->parent)
+      return INT2FIX(EBUSY);
+    dir = dst->parent;
+    name = dst->name;
+    len = strlen(name);
+  } else if (RF_NATIVE_MOUNTED(dst)) {
+    return INT2FIX(EXDEV);
+  } else if ((name = rf_native_newname(dst,rest,&len))) {
+    dir = dst;
+    dst = NULL;
+  } else {
+    return INT2FIX(ENOENT);
+  }
+
+  /* A directory can't go inside itself, whatever is there. */
+  for (up = dir; up; up = up->parent)
+    if (up == src)
+      return INT2FIX(EINVAL);
+
+  if (dst) {
+    if (dst->dir && !src->dir)
+      return INT2FIX(EISDIR);
+    if (!dst->dir && src->dir)
+      return INT2FIX(ENOTDIR);
+    if (dst->dir && (dst->nkids || RF_NATIVE_MOUNTED(dst)))
+      return INT2FIX(ENOTEMPTY);
+  }
+
+  newname = ALLOC_N(char,len + 1);
+  memcpy(newname,name,len);
+  newname[len] = '\0';
+  if (dst) {
+    rf_node_detach(dst);
+    rf_node_free(dst);
+  }
+  rf_node_detach(src);
+  xfree(src->name);
+  src->name = newname;
+  src->ctime = time(NULL);
+  rf_node_insert(dir,src);
+  return Qtrue;
+}
+
+/* rf_harness
+ *
+ * Used by: FuseFS::Harness
+ *
+ * Calls the rf_oper entries straight from Ruby, without a mount, so the
+ *   dispatch layer can be exercised and benchmarked anywhere. Each call
+ *   is followed by what FuseFS.process does after a FUSE command. A
+ *   failure is returned as the negative errno FUSE would be given.
+ */
+VALUE cHarness       = Qnil; /* FuseFS::Harness */
+VALUE cHarnessHandle = Qnil; /* FuseFS::Harness::Handle, an open file */
+
+/* Once released, a Handle's file (and the fh FuseFS gave it) may be
+ * another file's, so it can't be used again. */
+typedef struct {
+  struct fuse_file_info fi;
+  int closed;
+} rf_harness_handle;
+
+static VALUE
+rf_harness_done(int ret) {
+  rf_op_timed_out = 0;
+  rf_flush_stale();
+  return INT2NUM(ret);
+}
+
+static struct fuse_file_info *
+rf_harness_fi(VALUE handle) {
+  rf_harness_handle *h;
+  if (!rb_obj_is_kind_of(handle,cHarnessHandle))
+    rb_raise(rb_eTypeError,"expected a FuseFS::Harness::Handle");
+  Data_Get_Struct(handle,rf_harness_handle,h);
+  if (h->closed)
+    rb_raise(rb_eIOError,"closed FuseFS::Harness::Handle");
+  return &h->fi;
+}
+
+VALUE
+rf_harness_getattr(VALUE self, VALUE path) {
+  struct stat st;
+  VALUE ret = rf_harness_done(rf_oper.getattr(STR2CSTR(path),&st));
+  VALUE hash;
+  if (ret != INT2FIX(0))
+    return ret;
+  hash = rb_hash_new();
+  rb_hash_aset(hash,ID2SYM(rb_intern("mode")),INT2NUM(st.st_mode));
+  rb_hash_aset(hash,ID2SYM(rb_intern("size")),OFFT2NUM(st.st_size));
+  rb_hash_aset(hash,ID2SYM(rb_intern("nlink")),INT2NUM(st.st_nlink));
+  rb_hash_aset(hash,ID2SYM(rb_intern("uid")),INT2NUM(st.st_uid));
+  rb_hash_aset(hash,ID2SYM(rb_intern("gid")),INT2NUM(st.st_gid));
+  rb_hash_aset(hash,ID2SYM(rb_intern("atime")),LONG2NUM(st.st_atime));
+  rb_hash_aset(hash,ID2SYM(rb_intern("mtime")),LONG2NUM(st.st_mtime));
+  rb_hash_aset(hash,ID2SYM(rb_intern("ctime")),LONG2NUM(st.st_ctime));
+  return hash;
+}
+
+static int
+rf_harness_filler(void *buf, const char *name, const struct stat *st,
+                  off_t off) {
+  rb_ary_push((VALUE) buf,rb_str_new2(name));
+  return 0;
+}
+
+VALUE
+rf_harness_readdir(VALUE self, VALUE path) {
+  VALUE names = rb_ary_new();
+  VALUE ret = rf_harness_done(rf_oper.readdir(STR2CSTR(path),(void *) names,
+                                              rf_harness_filler,0,NULL));
+  if (ret != INT2FIX(0))
+    return ret;
+  return names;
+}
+
+VALUE
+rf_harness_open(int argc, VALUE *argv, VALUE self) {
+  rf_harness_handle *h;
+  VALUE handle, ret;
+
+  if ((argc < 1) || (argc > 2))
+    rb_raise(rb_eArgError,"wrong number of arguments (%d for 1)",argc);
+  handle = Data_Make_Struct(cHarnessHandle,rf_harness_handle,0,free,h);
+  memset(h,0,sizeof(rf_harness_handle));
+  h->fi.flags = (argc > 1) ? NUM2INT(argv[1]) : O_RDONLY;
+  ret = rf_harness_done(rf_oper.open(STR2CSTR(argv[0]),&h->fi));
+  if (ret != INT2FIX(0))
+    return ret;
+  return handle;
+}
+
+VALUE
+rf_harness_read(VALUE self, VALUE path, VALUE handle, VALUE size,
+                VALUE offset) {
+  size_t len = NUM2ULONG(size);
+  VALUE str = rb_str_new(NULL,len);
+  VALUE ret = rf_harness_done(rf_oper.read(STR2CSTR(path),RSTRING(str)->ptr,
+                                           len,NUM2OFFT(offset),
+                                           rf_harness_fi(handle)));
+  if (NUM2INT(ret) < 0)
+    return ret;
+  rb_str_set_len(str,NUM2INT(ret));
+  return str;
+}
+
+VALUE
+rf_harness_write(VALUE self, VALUE path, VALUE handle, VALUE data,
+                 VALUE offset) {
+  StringValue(data);
+  return rf_harness_done(rf_oper.write(STR2CSTR(path),RSTRING(data)->ptr,
+                                       RSTRING(data)->len,NUM2OFFT(offset),
+                                       rf_harness_fi(handle)));
+}
+
+VALUE
+rf_harness_flush(VALUE self, VALUE path, VALUE handle) {
+  return rf_harness_done(rf_oper.flush(STR2CSTR(path),rf_harness_fi(handle)));
+}
+
+VALUE
+rf_harness_release(VALUE self, VALUE path, VALUE handle) {
+  rf_harness_handle *h;
+  int ret;
+
+  ret = rf_oper.release(STR2CSTR(path),rf_harness_fi(handle));
+  Data_Get_Struct(handle,rf_harness_handle,h);
+  h->fi.fh = 0;
+  h->closed = 1;
+  return rf_harness_done(ret);
+}
+
+VALUE
+rf_harness_truncate(VALUE self, VALUE path, VALUE size) {
+  return rf_harness_done(rf_oper.truncate(STR2CSTR(path),NUM2OFFT(size)));
+}
+
+VALUE
+rf_harness_mknod(VALUE self, VALUE path) {
+  return rf_harness_done(rf_oper.mknod(STR2CSTR(path),S_IFREG | 0644,0));
+}
+
+VALUE
+rf_harness_unlink(VALUE self, VALUE path) {
+  return rf_harness_done(rf_oper.unlink(STR2CSTR(path)));
+}
+
+VALUE
+rf_harness_mkdir(VALUE self, VALUE path) {
+  return rf_harness_done(rf_oper.mkdir(STR2CSTR(path),0755));
+}
+
+VALUE
+rf_harness_rmdir(VALUE self, VALUE path) {
+  return rf_harness_done(rf_oper.rmdir(STR2CSTR(path)));
+}
+
+VALUE
+rf_harness_rename(VALUE self, VALUE path, VALUE dest) {
+  return rf_harness_done(rf_oper.rename(STR2CSTR(path),STR2CSTR(dest)));
+}
+
+/* rf_replay
+ *
+ * Used by: FuseFS.replay(filename, speed = nil)
+ *
+ * Reads a file written by FuseFS.record_to and calls the rf_oper entries
+ *   with each operation in turn, as FuseFS::Harness does. With a speed,
+ *   the recorded gaps between operations are kept, scaled by it (2 is
+ *   twice as fast); without, they run back to back. Recorded file handles
+ *   are mapped to the ones opened now. Written data was not recorded, so
+ *   zeros of the recorded size are written instead.
+ */
+typedef struct rf_replay_file {
+  unsigned long long fh; /* as recorded */
+  char *path;
+  struct fuse_file_info fi;
+  struct rf_replay_file *next;
+} rf_replay_file;
+
+typedef struct {
+  FILE *in;
+  char *path, *dest, *buf;
+  size_t path_capa, dest_capa, buf_capa;
+  rf_replay_file *files;
+  double speed;
+  VALUE name;
+} rf_replay_state;
+
+static void
+rf_replay_truncated(rf_replay_state *st) {
+  rb_raise(rb_eArgError,"%s: truncated recording",STR2CSTR(st->name));
+}
+
+static unsigned long long
+rf_replay_num(rf_replay_state *st) {
+  unsigned long long n = 0;
+  int c;
+  do {
+    if ((c = getc(st->in)) == EOF)
+      rf_replay_truncated(st);
+    n = (n << 7) | (c & 0x7f);
+  } while (c & 0x80);
+  return n;
+}
+
+static char *
+rf_replay_str(rf_replay_state *st, char **str, size_t *capa) {
+  size_t len = rf_replay_num(st);
+  if (len + 1 > *capa) {
+    *capa = len + 1;
+    *str = realloc(*str,*capa);
+    if (!*str)
+      rb_raise(rb_eNoMemError,"replay: out of memory");
+  }
+  if (fread(*str,1,len,st->in) != len)
+    rf_replay_truncated(st);
+  (*str)[len] = '\0';
+  return len ? *str : NULL;
+}
+
+static rf_replay_file *
+rf_replay_find(rf_replay_state *st, unsigned long long fh) {
+  rf_replay_file *file;
+  for (file = st->files; file; file = file->next)
+    if (file->fh == fh)
+      return file;
+  return NULL;
+}
+
+static void
+rf_replay_forget(rf_replay_state *st, rf_replay_file *gone) {
+  rf_replay_file **file;
+  for (file = &st->files; *file; file = &(*file)->next)
+    if (*file == gone) {
+      *file = gone->next;
+      free(gone->path);
+      free(gone);
+      return;
+    }
+}
+
+static int
+rf_replay_filler(void *buf, const char *name, const struct stat *st,
+                 off_t off) {
+  return 0;
+}
+
+static VALUE
+rf_replay_run(VALUE arg) {
+  rf_replay_state *st = (rf_replay_state *) arg;
+  char magic[sizeof(RF_RECORD_MAGIC) - 1];
+  unsigned long long start = rf_nsec(), clock = 0, recorded = 0;
+  unsigned long long mode, fh, wait;
+  unsigned long ops = 0, mismatches = 0;
+  long long expected;
+  off_t offset;
+  size_t size;
+  int op, ret;
+  char *path, *dest;
+  struct fuse_file_info scratch, *fi;
+  rf_replay_file *file;
+  struct stat stbuf;
+  struct timeval tv;
+  VALUE hash;
+
+  if ((fread(magic,1,sizeof(magic),st->in) != sizeof(magic)) ||
+      memcmp(magic,RF_RECORD_MAGIC,sizeof(magic)))
+    rb_raise(rb_eArgError,"%s: not a FuseFS recording",STR2CSTR(st->name));
+
+  while ((op = getc(st->in)) != EOF) {
+    if (op >= RF_OPS)
+      rb_raise(rb_eArgError,"%s: unknown operation %d",
+               STR2CSTR(st->name),op);
+    clock += rf_replay_num(st);
+    recorded += rf_replay_num(st);
+    expected = rf_replay_num(st);
+    expected = (long long) ((unsigned long long) expected >> 1) ^
+               -(expected & 1);
+    mode = rf_replay_num(st);
+    offset = rf_replay_num(st);
+    size = rf_replay_num(st);
+    fh = rf_replay_num(st);
+    path = rf_replay_str(st,&st->path,&st->path_capa);
+    dest = rf_replay_str(st,&st->dest,&st->dest_capa);
+    if (!path)
+      rf_replay_truncated(st);
+
+    if (st->speed > 0) {
+      wait = start + (unsigned long long) (clock / st->speed);
+      if (wait > rf_nsec()) {
+        wait -= rf_nsec();
+        tv.tv_sec = wait / 1000000000ULL;
+        tv.tv_usec = (wait % 1000000000ULL) / 1000;
+        rb_thread_wait_for(tv);
+      }
+    }
+
+    if (((op == RF_OP_READ) || (op == RF_OP_WRITE)) && (size > st->buf_capa)) {
+      free(st->buf);
+      st->buf_capa = size;
+      st->buf = calloc(1,size);
+      if (!st->buf)
+        rb_raise(rb_eNoMemError,"replay: out of memory");
+    }
+
+    file = rf_replay_find(st,fh);
+    memset(&scratch,0,sizeof(scratch));
+    fi = file ? &file->fi : &scratch;
+
+    switch (op) {
+    case RF_OP_GETATTR:
+      ret = rf_oper.getattr(path,&stbuf);
+      break;
+    case RF_OP_READDIR:
+      ret = rf_oper.readdir(path,NULL,rf_replay_filler,offset,
+                            file ? fi : NULL);
+      break;
+    case RF_OP_MKNOD:
+      ret = rf_oper.mknod(path,mode,0);
+      break;
+    case RF_OP_UNLINK:
+      ret = rf_oper.unlink(path);
+      break;
+    case RF_OP_MKDIR:
+      ret = rf_oper.mkdir(path,mode);
+      break;
+    case RF_OP_RMDIR:
+      ret = rf_oper.rmdir(path);
+      break;
+    case RF_OP_TRUNCATE:
+      ret = rf_oper.truncate(path,offset);
+      break;
+    case RF_OP_FTRUNCATE:
+      ret = rf_oper.ftruncate(path,offset,fi);
+      break;
+    case RF_OP_RENAME:
+      ret = rf_oper.rename(path,dest ? dest : "");
+      break;
+    case RF_OP_CHMOD:
+      ret = rf_oper.chmod(path,mode);
+      break;
+    case RF_OP_OPEN:
+      file = ALLOC(rf_replay_file);
+      memset(file,0,sizeof(rf_replay_file));
+      file->fi.flags = mode;
+      ret = rf_oper.open(path,&file->fi);
+      if ((ret == 0) && (expected == 0)) {
+        file->fh = fh;
+        file->path = strdup(path);
+        file->next = st->files;
+        st->files = file;
+      } else if (ret == 0) {
+        rf_oper.release(path,&file->fi);
+        free(file);
+      } else {
+        free(file);
+      }
+      break;
+    case RF_OP_RELEASE:
+      ret = rf_oper.release(path,fi);
+      if (file)
+        rf_replay_forget(st,file);
+      break;
+    case RF_OP_FLUSH:
+      ret = rf_oper.flush(path,fi);
+      break;
+    case RF_OP_FSYNC:
+      ret = rf_oper.fsync(path,mode,fi);
+      break;
+    case RF_OP_UTIME:
+      ret = rf_oper.utime(path,NULL);
+      break;
+    case RF_OP_READ:
+      ret = rf_oper.read(path,st->buf,size,offset,fi);
+      memset(st->buf,0,size);
+      break;
+    default: /* RF_OP_WRITE */
+      ret = rf_oper.write(path,st->buf,size,offset,fi);
+      break;
+    }
+    rf_op_timed_out = 0;
+    rf_flush_stale();
+
+    ops++;
+    if (ret != expected)
+      mismatches++;
+  }
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash,ID2SYM(rb_intern("ops")),ULONG2NUM(ops));
+  rb_hash_aset(hash,ID2SYM(rb_intern("seconds")),
+               rb_float_new((rf_nsec() - start) / 1e9));
+  rb_hash_aset(hash,ID2SYM(rb_intern("recorded_seconds")),
+               rb_float_new(recorded / 1e9));
+  rb_hash_aset(hash,ID2SYM(rb_intern("mismatches")),ULONG2NUM(mismatches));
+  return hash;
+}
+
+static VALUE
+rf_replay_cleanup(VALUE arg) {
+  rf_replay_state *st = (rf_replay_state *) arg;
+  rf_replay_file *file;
+
+  while ((file = st->files)) {
+    st->files = file->next;
+    rf_oper.release(file->path,&file->fi);
+    free(file->path);
+    free(file);
+  }
+  rf_op_timed_out = 0;
+  rf_flush_stale();
+  fclose(st->in);
+  free(st->path);
+  free(st->dest);
+  free(st->buf);
+  return Qnil;
+}
+
+VALUE
+rf_replay(int argc, VALUE *argv, VALUE self) {
+  rf_replay_state st;
+
+  if ((argc < 1) || (argc > 2))
+    rb_raise(rb_eArgError,"wrong number of arguments (%d for 1)",argc);
+  memset(&st,0,sizeof(st));
+  st.name = argv[0];
+  st.speed = ((argc > 1) && !NIL_P(argv[1])) ? NUM2DBL(argv[1]) : 0.0;
+  st.in = fopen(STR2CSTR(st.name),"r");
+  if (!st.in)
+    rb_sys_fail(STR2CSTR(st.name));
+  return rb_ensure(rf_replay_run,(VALUE) &st,rf_replay_cleanup,(VALUE) &st);
+}
+
 struct const_int {
   char *name;
   int val;
@@ -1568,12 +6087,29 @@ Init_fusefs_lib() {
   opened_head = NULL;
   init_time = time(NULL);
 
+  rf_handles = rb_ary_new();
+  rb_global_variable(&rf_handles);
+  rf_readargs = rb_ary_new();
+  rb_global_variable(&rf_readargs);
+  rb_global_variable(&rf_readbuf);
+  rf_slow_log = rb_ary_new();
+  rb_global_variable(&rf_slow_log);
+  rb_global_variable(&rf_slow_backtrace);
+
   /* module FuseFS */
   cFuseFS = rb_define_module("FuseFS");
 
   /* Our exception */
   cFSException = rb_define_class_under(cFuseFS,"FuseFSException",rb_eStandardError);
 
+  /* What FuseFS.call_with_deadline returns for a callback out of time. */
+  rf_timed_out_obj = rb_obj_alloc(rb_cObject);
+  rb_define_const(cFuseFS,"TIMED_OUT",rf_timed_out_obj);
+
+  /* What FuseRoot's rename returns to leave the rename to FuseFS. */
+  rf_fallback_obj = rb_obj_alloc(rb_cObject);
+  rb_define_const(cFuseFS,"FALLBACK",rf_fallback_obj);
+
   /* def Fuse.run */
   rb_define_singleton_method(cFuseFS,"fuse_fd",     (rbfunc) rf_fd, 0);
   rb_define_singleton_method(cFuseFS,"reader_uid",  (rbfunc) rf_uid, 0);
@@ -1581,6 +6117,7 @@ Init_fusefs_lib() {
   rb_define_singleton_method(cFuseFS,"reader_gid",  (rbfunc) rf_gid, 0);
   rb_define_singleton_method(cFuseFS,"gid",         (rbfunc) rf_gid, 0);
   rb_define_singleton_method(cFuseFS,"process",     (rbfunc) rf_process, 0);
+  rb_define_singleton_method(cFuseFS,"flush_stale", (rbfunc) rf_flush_idle, 0);
   rb_define_singleton_method(cFuseFS,"mount_to",    (rbfunc) rf_mount_to, -1);
   rb_define_singleton_method(cFuseFS,"mount_under", (rbfunc) rf_mount_to, -1);
   rb_define_singleton_method(cFuseFS,"mountpoint",  (rbfunc) rf_mount_to, -1);
@@ -1588,6 +6125,78 @@ Init_fusefs_lib() {
   rb_define_singleton_method(cFuseFS,"root=",       (rbfunc) rf_set_root, 1);
   rb_define_singleton_method(cFuseFS,"handle_editor",   (rbfunc) rf_handle_editor, 1);
   rb_define_singleton_method(cFuseFS,"handle_editor=",  (rbfunc) rf_handle_editor, 1);
+  rb_define_singleton_method(cFuseFS,"readahead",   (rbfunc) rf_readahead_get, 0);
+  rb_define_singleton_method(cFuseFS,"readahead=",  (rbfunc) rf_set_readahead, 1);
+  rb_define_singleton_method(cFuseFS,"write_behind",  (rbfunc) rf_writebehind_get, 0);
+  rb_define_singleton_method(cFuseFS,"write_behind=", (rbfunc) rf_set_writebehind, 1);
+  rb_define_singleton_method(cFuseFS,"write_behind_delay",  (rbfunc) rf_writebehind_delay_get, 0);
+  rb_define_singleton_method(cFuseFS,"write_behind_delay=", (rbfunc) rf_set_writebehind_delay, 1);
+  rb_define_singleton_method(cFuseFS,"buffer_budget",  (rbfunc) rf_buffer_budget_get, 0);
+  rb_define_singleton_method(cFuseFS,"buffer_budget=", (rbfunc) rf_set_buffer_budget, 1);
+  rb_define_singleton_method(cFuseFS,"cache_max_bytes",  (rbfunc) rf_cache_max_bytes_get, 0);
+  rb_define_singleton_method(cFuseFS,"cache_max_bytes=", (rbfunc) rf_set_cache_max_bytes, 1);
+  rb_define_singleton_method(cFuseFS,"cache_ttl",   (rbfunc) rf_cache_ttl_get, 0);
+  rb_define_singleton_method(cFuseFS,"cache_ttl=",  (rbfunc) rf_set_cache_ttl, 1);
+  rb_define_singleton_method(cFuseFS,"invalidate",  (rbfunc) rf_invalidate, -1);
+  rb_define_singleton_method(cFuseFS,"attr_ttl",    (rbfunc) rf_attr_ttl_get, 0);
+  rb_define_singleton_method(cFuseFS,"attr_ttl=",   (rbfunc) rf_set_attr_ttl, 1);
+  rb_define_singleton_method(cFuseFS,"stale_ttl",   (rbfunc) rf_stale_ttl_get, 0);
+  rb_define_singleton_method(cFuseFS,"stale_ttl=",  (rbfunc) rf_set_stale_ttl, 1);
+  rb_define_singleton_method(cFuseFS,"callback_timeout",  (rbfunc) rf_callback_timeout_get, 0);
+  rb_define_singleton_method(cFuseFS,"callback_timeout=", (rbfunc) rf_set_callback_timeout, 1);
+  rb_define_singleton_method(cFuseFS,"refresh_pending?",  (rbfunc) rf_refresh_pendingP, 0);
+  rb_define_singleton_method(cFuseFS,"slow_threshold",    (rbfunc) rf_slow_threshold_get, 0);
+  rb_define_singleton_method(cFuseFS,"slow_threshold=",   (rbfunc) rf_set_slow_threshold, 1);
+  rb_define_singleton_method(cFuseFS,"slow_log",          (rbfunc) rf_slow_log_get, 0);
+  rb_define_singleton_method(cFuseFS,"callback_running",  (rbfunc) rf_callback_running, 0);
+  rb_define_singleton_method(cFuseFS,"slow_sample",       (rbfunc) rf_slow_sample, 1);
+  rb_define_singleton_method(cFuseFS,"stats",       (rbfunc) rf_get_stats, 0);
+  rb_define_singleton_method(cFuseFS,"reset_stats", (rbfunc) rf_reset_stats, 0);
+  rb_define_singleton_method(cFuseFS,"dump_trace",  (rbfunc) rf_dump_trace, 1);
+  rb_define_singleton_method(cFuseFS,"record_to",   (rbfunc) rf_record_to, 1);
+  rb_define_singleton_method(cFuseFS,"replay",      (rbfunc) rf_replay, -1);
+  rb_define_singleton_method(cFuseFS,"control_dir",  (rbfunc) rf_control_dir_get, 0);
+  rb_define_singleton_method(cFuseFS,"control_dir=", (rbfunc) rf_set_control_dir, 1);
+
+  /* class FuseFS::NativeMetaDir */
+  cNativeMetaDir = rb_define_class_under(cFuseFS,"NativeMetaDir",rb_cObject);
+  rb_define_alloc_func(cNativeMetaDir,rf_native_alloc);
+  rb_define_method(cNativeMetaDir,"contents",    (rbfunc) rf_native_contents, 1);
+  rb_define_method(cNativeMetaDir,"directory?",  (rbfunc) rf_native_directoryP, 1);
+  rb_define_method(cNativeMetaDir,"file?",       (rbfunc) rf_native_fileP, 1);
+  rb_define_method(cNativeMetaDir,"size",        (rbfunc) rf_native_size, 1);
+  rb_define_method(cNativeMetaDir,"atime",       (rbfunc) rf_native_atime, 1);
+  rb_define_method(cNativeMetaDir,"ctime",       (rbfunc) rf_native_ctime, 1);
+  rb_define_method(cNativeMetaDir,"mtime",       (rbfunc) rf_native_mtime, 1);
+  rb_define_method(cNativeMetaDir,"read_file",   (rbfunc) rf_native_read_file, 1);
+  rb_define_method(cNativeMetaDir,"can_write?",  (rbfunc) rf_native_can_writeP, 1);
+  rb_define_method(cNativeMetaDir,"write_to",    (rbfunc) rf_native_write_to, 2);
+  rb_define_method(cNativeMetaDir,"append_to",   (rbfunc) rf_native_append_to, 2);
+  rb_define_method(cNativeMetaDir,"can_delete?", (rbfunc) rf_native_can_deleteP, 1);
+  rb_define_method(cNativeMetaDir,"delete",      (rbfunc) rf_native_delete, 1);
+  rb_define_method(cNativeMetaDir,"can_mkdir?",  (rbfunc) rf_native_can_mkdirP, 1);
+  rb_define_method(cNativeMetaDir,"mkdir",       (rbfunc) rf_native_mkdir, -1);
+  rb_define_method(cNativeMetaDir,"can_rmdir?",  (rbfunc) rf_native_can_rmdirP, 1);
+  rb_define_method(cNativeMetaDir,"rmdir",       (rbfunc) rf_native_rmdir, 1);
+  rb_define_method(cNativeMetaDir,"rename",      (rbfunc) rf_native_rename, 2);
+
+  /* module FuseFS::Harness */
+  cHarness = rb_define_module_under(cFuseFS,"Harness");
+  cHarnessHandle = rb_define_class_under(cHarness,"Handle",rb_cObject);
+  rb_undef_alloc_func(cHarnessHandle);
+  rb_define_singleton_method(cHarness,"getattr",  (rbfunc) rf_harness_getattr, 1);
+  rb_define_singleton_method(cHarness,"readdir",  (rbfunc) rf_harness_readdir, 1);
+  rb_define_singleton_method(cHarness,"open",     (rbfunc) rf_harness_open, -1);
+  rb_define_singleton_method(cHarness,"read",     (rbfunc) rf_harness_read, 4);
+  rb_define_singleton_method(cHarness,"write",    (rbfunc) rf_harness_write, 4);
+  rb_define_singleton_method(cHarness,"flush",    (rbfunc) rf_harness_flush, 2);
+  rb_define_singleton_method(cHarness,"release",  (rbfunc) rf_harness_release, 2);
+  rb_define_singleton_method(cHarness,"truncate", (rbfunc) rf_harness_truncate, 2);
+  rb_define_singleton_method(cHarness,"mknod",    (rbfunc) rf_harness_mknod, 1);
+  rb_define_singleton_method(cHarness,"unlink",   (rbfunc) rf_harness_unlink, 1);
+  rb_define_singleton_method(cHarness,"mkdir",    (rbfunc) rf_harness_mkdir, 1);
+  rb_define_singleton_method(cHarness,"rmdir",    (rbfunc) rf_harness_rmdir, 1);
+  rb_define_singleton_method(cHarness,"rename",   (rbfunc) rf_harness_rename, 2);
 
   for (vals = constvals; vals->name; vals++) {
     rb_define_const(cFuseFS, vals->name, INT2NUM(vals->val));
@@ -1600,6 +6209,8 @@ Init_fusefs_lib() {
   RMETHOD(id_dir_contents,"contents");
   RMETHOD(id_read_file,"read_file");
   RMETHOD(id_write_to,"write_to");
+  RMETHOD(id_append_to,"append_to");
+  RMETHOD(id_write_extents,"write_extents");
   RMETHOD(id_delete,"delete");
   RMETHOD(id_mkdir,"mkdir");
   RMETHOD(id_rmdir,"rmdir");
@@ -1624,7 +6235,22 @@ Init_fusefs_lib() {
   RMETHOD(id_raw_read,"raw_read");
   RMETHOD(id_raw_write,"raw_write");
   RMETHOD(id_raw_rename,"raw_rename");
+  RMETHOD(id_rename,"rename");
+  RMETHOD(id_raw_read_into,"raw_read_into");
+  RMETHOD(id_raw_truncate,"raw_truncate");
+  RMETHOD(id_truncate,"truncate");
+
+  RMETHOD(id_open_file,"open_file");
+  RMETHOD(id_etag,"etag");
+  RMETHOD(id_call_with_deadline,"call_with_deadline");
+  RMETHOD(id_watch_slow,"watch_slow");
+  RMETHOD(id_backtrace,"backtrace");
+
+  RMETHOD(id_read,"read");
+  RMETHOD(id_read_into,"read_into");
+  RMETHOD(id_write,"write");
+  RMETHOD(id_close,"close");
+  RMETHOD(id_fileno,"fileno");
 
-  RMETHOD(id_dup,"dup");
   RMETHOD(id_to_i,"to_i");
 }
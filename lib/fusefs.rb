@@ -5,6 +5,7 @@
 # This includes helper functions, common uses, etc.
 
 require 'fusefs_lib'
+require 'timeout'
 
 module FuseFS
   VERSION = '0.7.0'
@@ -13,10 +14,38 @@ module FuseFS
     fd = FuseFS.fuse_fd
     io = IO.for_fd(fd)
     while @running
-      reads, foo, errs = IO.select([io],nil,[io])
+      idle = FuseFS.write_behind > 0 ? FuseFS.write_behind_delay : nil
+      idle = 0 if FuseFS.refresh_pending?
+      reads, foo, errs = IO.select([io],nil,[io],idle)
+      if reads.nil? && errs.nil?
+        FuseFS.flush_stale
+        next
+      end
       break unless FuseFS.process
     end
   end
+  # Calls obj.meth(*args), giving up after FuseFS.callback_timeout
+  # seconds. FuseFS calls FuseRoot through this when that is set. Timeout
+  # can't interrupt a method blocked in C or holding the interpreter lock.
+  def FuseFS.call_with_deadline(obj, meth, *args)
+    Timeout.timeout(FuseFS.callback_timeout) { obj.__send__(meth, *args) }
+  rescue Timeout::Error
+    FuseFS::TIMED_OUT
+  end
+  # Started by FuseFS.slow_threshold=. Wakes twice a threshold, and
+  # samples the backtrace of <thread> while FuseFS has waited longer than
+  # that on a FuseRoot method. Needs Thread#backtrace (Ruby 1.9).
+  def FuseFS.watch_slow(thread)
+    return if @slow_watcher && @slow_watcher.alive?
+    return unless thread.respond_to?(:backtrace)
+    @slow_watcher = Thread.new do
+      while (limit = FuseFS.slow_threshold) > 0
+        sleep(limit / 2)
+        running = FuseFS.callback_running
+        FuseFS.slow_sample(thread.backtrace) if running && running >= limit
+      end
+    end
+  end
   def FuseFS.unmount
     system("fusermount -u #{@mountpoint}")
   end
@@ -37,6 +66,17 @@ module FuseFS
     end
   end
   class MetaDir < FuseDir
+    # What rename moves entries around without calling.
+    RENAME_BYPASSES = [:can_write?, :write_to, :can_delete?, :delete,
+                       :read_file]
+
+    # What is called on a MetaDir with a path. The index skips these on
+    # the MetaDirs between the top and the one holding a path.
+    PATH_METHODS = [:size, :time, :atime, :ctime, :mtime, :contents,
+                    :directory?, :file?, :read_file, :can_write?, :write_to,
+                    :append_to, :can_delete?, :delete, :rename, :can_mkdir?,
+                    :mkdir, :can_rmdir?, :rmdir]
+
     def initialize
       @subdirs  = Hash.new(nil)
       @files    = Hash.new(nil)
@@ -47,7 +87,8 @@ module FuseFS
     end
 
     def size(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.size("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         default
@@ -61,7 +102,8 @@ module FuseFS
     end
 
     def time(path,sym,index,default)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.send(sym,"/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         default
@@ -90,11 +132,12 @@ module FuseFS
 
     # Contents of directory.
     def contents(path)
+      dir, base, rest = locate(path)
+      return dir.contents("/#{base}") unless dir.equal?(self)
       @atime = Time.now
-      base, rest = split_path(path)
       case
       when base.nil?
-        (@files.keys + @subdirs.keys).sort.uniq
+        listing
       when ! @subdirs.has_key?(base)
         nil
       when rest.nil?
@@ -106,7 +149,8 @@ module FuseFS
 
     # File types
     def directory?(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.directory?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         true
@@ -119,7 +163,8 @@ module FuseFS
       end
     end
     def file?(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.file?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         false
@@ -134,7 +179,8 @@ module FuseFS
 
     # File Reading
     def read_file(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.read_file("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         nil
@@ -151,7 +197,8 @@ module FuseFS
     # Write to a file
     def can_write?(path)
       return false unless Process.uid == FuseFS.reader_uid
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.can_write?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         true
@@ -164,7 +211,8 @@ module FuseFS
       end
     end
     def write_to(path,file)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.write_to("/#{base}",file) unless dir.equal?(self)
       case
       when base.nil?
         false
@@ -174,6 +222,7 @@ module FuseFS
           @times[base][0] = Time.now # atime
         else
           @times[base] = [Time.now,Time.now,Time.now]
+          listed(base)
         end
         @files[base] = file
       when ! @subdirs.has_key?(base)
@@ -183,10 +232,33 @@ module FuseFS
       end
     end
 
+    # Append to a file. Where read_file or write_to have been overridden,
+    # it goes through them, so they see the whole file as before.
+    def append_to(path,str)
+      unless stock?(:read_file,:write_to)
+        return write_to(path,read_file(path).to_s + str)
+      end
+      dir, base, rest = locate(path)
+      return dir.append_to("/#{base}",str) unless dir.equal?(self)
+      case
+      when base.nil?
+        false
+      when rest.nil?
+        write_to("/#{base}",@files[base].to_s + str)
+      when ! @subdirs.has_key?(base)
+        false
+      when @subdirs[base].respond_to?(:append_to)
+        @subdirs[base].append_to(rest,str)
+      else
+        @subdirs[base].write_to(rest,@subdirs[base].read_file(rest).to_s + str)
+      end
+    end
+
     # Delete a file
     def can_delete?(path)
       return false unless Process.uid == FuseFS.reader_uid
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.can_delete?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         false
@@ -199,7 +271,8 @@ module FuseFS
       end
     end
     def delete(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.delete("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         nil
@@ -207,6 +280,7 @@ module FuseFS
         # Delete it.
         @files.delete(base)
         @times.delete(base)
+        unlisted(base)
         @mtime = Time.now
       when ! @subdirs.has_key?(base)
         nil
@@ -216,10 +290,62 @@ module FuseFS
       end
     end
 
+    # Rename a file or directory, replacing any file (or empty
+    # directory) at <to>. Nothing is read or copied. Where a subclass
+    # overrides the methods a rename would otherwise go through, FuseFS
+    # is left to call those instead.
+    def rename(from,to)
+      return FuseFS::FALLBACK unless stock?(*RENAME_BYPASSES)
+      return false unless Process.uid == FuseFS.reader_uid
+      src = parent_of(from)
+      dst = parent_of(to)
+      return Errno::EXDEV::Errno unless src && dst
+      sdir, sbase = src
+      ddir, dbase = dst
+      entry = sdir.entry(sbase)
+      return Errno::ENOENT::Errno if entry.nil?
+      # A directory can't go inside itself.
+      fparts, tparts = scan_path(from), scan_path(to)
+      if tparts.size > fparts.size && tparts[0,fparts.size] == fparts
+        return Errno::EINVAL::Errno
+      end
+      return true if tparts == fparts
+      old = ddir.entry(dbase)
+      if old
+        kind = old.first
+        return Errno::EISDIR::Errno if kind == :dir && entry.first == :file
+        return Errno::ENOTDIR::Errno if kind == :file && entry.first == :dir
+        if kind == :dir && ! old[1].contents('/').empty?
+          return Errno::ENOTEMPTY::Errno
+        end
+      end
+      sdir.remove_entry(sbase)
+      ddir.add_entry(dbase,entry)
+      true
+    end
+
+    # The MetaDir holding <path>, and <path>'s name in it, or nil if
+    # <path> is not within MetaDirs all the way down.
+    def parent_of(path)
+      dir, base, rest = locate(path)
+      case
+      when base.nil?
+        nil
+      when rest.nil?
+        [ dir, base ]
+      when @subdirs[base].is_a?(MetaDir) &&
+           @subdirs[base].stock?(*RENAME_BYPASSES)
+        @subdirs[base].parent_of(rest)
+      else
+        nil
+      end
+    end
+
     # Make a new directory
     def can_mkdir?(path)
       return false unless Process.uid == FuseFS.reader_uid
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.can_mkdir?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         false
@@ -232,13 +358,17 @@ module FuseFS
       end
     end
     def mkdir(path,dir=nil)
-      base, rest = split_path(path)
+      parent, base, rest = locate(path)
+      return parent.mkdir("/#{base}",dir) unless parent.equal?(self)
       case
       when base.nil?
         false
       when rest.nil?
         dir ||= self.class.new
+        unindex_dir(base)
         @subdirs[base] = dir
+        index_dir(base)
+        listed(base)
         @mtime = Time.now
         true
       when ! @subdirs.has_key?(base)
@@ -251,7 +381,8 @@ module FuseFS
     # Delete an existing directory.
     def can_rmdir?(path)
       return false unless Process.uid == FuseFS.reader_uid
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.can_rmdir?("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         false
@@ -264,12 +395,15 @@ module FuseFS
       end
     end
     def rmdir(path)
-      base, rest = split_path(path)
+      dir, base, rest = locate(path)
+      return dir.rmdir("/#{base}") unless dir.equal?(self)
       case
       when base.nil?
         false
       when rest.nil?
+        unindex_dir(base)
         @subdirs.delete(base)
+        unlisted(base)
         @mtime = Time.now
         true
       when ! @subdirs.has_key?(base)
@@ -278,5 +412,160 @@ module FuseFS
         @subdirs[base].rmdir(rest)
       end
     end
+
+    protected
+
+    # True if <meths> are MetaDir's own here, not overridden by a subclass
+    # or on this object, so shortcuts around them are safe to take.
+    def stock?(*meths)
+      meths.all? { |m| method(m).owner == MetaDir }
+    end
+
+    # Entries as moved around by rename.
+    def entry(base)
+      if @files.has_key?(base)
+        [ :file, @files[base], @times[base] ]
+      elsif @subdirs.has_key?(base)
+        [ :dir, @subdirs[base] ]
+      end
+    end
+    def remove_entry(base)
+      unindex_dir(base)
+      @files.delete(base)
+      @times.delete(base)
+      @subdirs.delete(base)
+      unlisted(base)
+      @mtime = Time.now
+    end
+    def add_entry(base,entry)
+      kind, obj, times = entry
+      remove_entry(base)
+      if kind == :file
+        @files[base] = obj
+        @times[base] = times
+      else
+        @subdirs[base] = obj
+        index_dir(base)
+      end
+      listed(base)
+    end
+
+    # The names in this directory, sorted, as a frozen Array that is
+    # shared until they change. Once it has been asked for, the sorted
+    # list is kept up to date as names come and go, rather than built and
+    # sorted again.
+    def listing
+      @listing ||= (@files.keys | @subdirs.keys).sort
+      @shown ||= @listing.dup.freeze
+    end
+    def listed(base)
+      return unless @listing
+      i = listing_index(base)
+      return if @listing[i] == base
+      @listing.insert(i,base)
+      @shown = nil
+    end
+    def unlisted(base)
+      return unless @listing
+      return if @files.has_key?(base) || @subdirs.has_key?(base)
+      i = listing_index(base)
+      return unless @listing[i] == base
+      @listing.delete_at(i)
+      @shown = nil
+    end
+    def listing_index(base)
+      lo, hi = 0, @listing.size
+      while lo < hi
+        mid = (lo + hi) / 2
+        if @listing[mid] < base
+          lo = mid + 1
+        else
+          hi = mid
+        end
+      end
+      lo
+    end
+
+    # A tree of MetaDirs shares one index of its directories by full
+    # path, so a path is found with a single Hash lookup instead of a
+    # split_path per level. locate returns the MetaDir holding <path> and
+    # <path>'s name in it. Where the index doesn't reach, under a
+    # directory that is not a MetaDir of this class, it returns self and
+    # split_path's base and rest, to recurse into that as before.
+    #
+    # Methods are then called on the MetaDir holding the path, with
+    # "/name", skipping each MetaDir in between. So that no override is
+    # skipped, only MetaDirs whose PATH_METHODS are all MetaDir's own are
+    # indexed; any other keeps recursing a level at a time.
+    def locate(path)
+      reindex if @index.nil?
+      return [ self, *split_path(path) ] unless @index
+      unless path[0] == ?/ && path[-1] != ?/ && ! path.include?('//')
+        path = '/' + scan_path(path).join('/')
+      end
+      return [ self, nil, nil ] if path == '/'
+      full = @prefix ? @prefix + path : path
+      cut = full.rindex('/')
+      dir = @index[full[0,cut]]
+      return [ dir, full[cut+1..-1], nil ] if dir
+      [ self, *split_path(path) ]
+    end
+
+    # Starts a new index, with this MetaDir at its top, or marks it as
+    # not indexed (false) if it overrides any PATH_METHODS.
+    def reindex
+      @prefix = nil
+      @index = stock?(*PATH_METHODS) && { '' => self }
+      @subdirs.each_key { |base| index_dir(base) } if @index
+    end
+
+    # Adds the subdirectory <base>, and those under it, to the index, if
+    # it is a MetaDir of this class, without overrides of its own, that
+    # isn't indexed elsewhere.
+    def index_dir(base)
+      dir = @subdirs[base]
+      return unless @index && dir.instance_of?(self.class)
+      return unless dir.stock?(*PATH_METHODS)
+      return if dir.indexed?(@index)
+      dir.indexed_as(@index,"#{@prefix}/#{base}")
+    end
+    def indexed?(tree)
+      @prefix || @index.equal?(tree)
+    end
+    def indexed_as(tree,prefix)
+      @index, @prefix = tree, prefix
+      tree[prefix] = self
+      @subdirs.each_key { |base| index_dir(base) }
+    end
+
+    # Removes the subdirectory <base>, and those under it, from the index.
+    # Left on its own, it starts an index of its own when next used.
+    def unindex_dir(base)
+      dir = @subdirs[base]
+      return unless @index && dir.instance_of?(self.class)
+      return unless dir.indexed_in?(@index)
+      dir.forget_index
+    end
+    def indexed_in?(tree)
+      @index.equal?(tree) && tree[@prefix].equal?(self)
+    end
+    def forget_index
+      @subdirs.each_key { |base| unindex_dir(base) }
+      @index.delete(@prefix)
+      @index = @prefix = nil
+    end
+
+    # A path method defined on an indexed MetaDir itself takes it, and
+    # the MetaDirs under it, out of the index, so that the override is
+    # called.
+    def singleton_method_added(name)
+      return unless @index && PATH_METHODS.include?(name)
+      if @prefix
+        forget_index if indexed_in?(@index)
+      else
+        @subdirs.each_key { |base| unindex_dir(base) }
+      end
+      @index = @prefix = nil
+    end
   end
 end
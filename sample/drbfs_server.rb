@@ -9,11 +9,41 @@
 
 require 'drb'
 
+# An open file on the server. raw_open hands one of these back to FuseFS,
+# which calls read, write and close on it directly.
+class RemoteFile
+  include DRbUndumped
+
+  def initialize(file)
+    @file = file
+  end
+
+  def read(off, size)
+    @file.seek(off, File::SEEK_SET)
+    @file.read(size)
+  rescue
+    puts $!
+    nil
+  end
+
+  def write(off, buf)
+    @file.seek(off, File::SEEK_SET)
+    @file.write(buf)
+  rescue
+    puts $!
+  end
+
+  def close
+    @file.close
+  rescue
+    puts $!
+  end
+end
+
 # We're basically just passing all requests on to the local filesystem.
 class RemoteDirectory
   def initialize(dir)
     @dir = dir
-    @files = {}
   end
 
   def contents(path)
@@ -43,41 +73,11 @@ class RemoteDirectory
   end
 
   def raw_open(path, mode)
-    return true if @files.has_key? path
-    @files[path] = File.open(File.join(@dir, path), mode)
-    return true
+    RemoteFile.new(File.open(File.join(@dir, path), mode))
   rescue
     puts $!
     false
   end
-
-  def raw_read(path, off, size)
-    file = @files[path]
-    return unless file
-    file.seek(off, File::SEEK_SET)
-    file.read(size)
-  rescue
-    puts $!
-    nil
-  end
-
-  def raw_write(path, off, sz, buf)
-    file = @files[path]
-    return unless file
-    file.seek(off, File::SEEK_SET)
-    file.write(buf[0, sz])
-  rescue
-    puts $!
-  end
-
-  def raw_close(path)
-    file = @files[path]
-    return unless file
-    file.close
-    @files.delete path
-  rescue
-    puts $!
-  end
 end
 
 if $0 == __FILE__
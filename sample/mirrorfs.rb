@@ -0,0 +1,75 @@
+#!/usr/bin/env ruby
+#
+# mirrorfs.rb
+#
+# Mirrors a local directory. raw_open hands FuseFS the opened File itself,
+# so reads and writes are passed straight through to it in C.
+#
+# Usage: mirrorfs.rb <mountpoint> <directory>
+
+require 'fusefs'
+
+class MirrorDir
+  def initialize(dir)
+    @dir = dir
+  end
+
+  def real(path)
+    File.join(@dir, path)
+  end
+
+  def contents(path)
+    Dir.entries(real(path)) - ['.', '..']
+  end
+
+  %w|file? directory? executable? size delete|.each do |name|
+    define_method(name) do |path|
+      File.send name, real(path)
+    end
+  end
+
+  %w|mkdir rmdir|.each do |name|
+    define_method(name) do |path|
+      Dir.send name, real(path)
+    end
+  end
+
+  %w|mtime atime ctime|.each do |name|
+    define_method(name) do |path|
+      File.send(name, real(path)).to_i
+    end
+  end
+
+  %w|can_write? can_delete? can_mkdir? can_rmdir?|.each do |name|
+    define_method(name) do |path|
+      true
+    end
+  end
+
+  def raw_rename(path,dest)
+    File.rename(real(path),real(dest))
+  end
+
+  def raw_open(path, mode)
+    flags = case mode.delete('a')
+            when 'r'  then File::RDONLY
+            when 'w'  then File::WRONLY | File::CREAT
+            else           File::RDWR | File::CREAT
+            end
+    flags |= File::APPEND if mode.include?('a')
+    File.open(real(path), flags)
+  rescue SystemCallError
+    false
+  end
+end
+
+if $0 == __FILE__
+  unless ARGV.size == 2
+    puts "Usage: #$0 <mountpoint> <directory>"
+    exit(1)
+  end
+  mountpoint, dir = ARGV
+  FuseFS.set_root(MirrorDir.new(dir))
+  FuseFS.mount_under(mountpoint)
+  FuseFS.run
+end
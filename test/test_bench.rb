@@ -0,0 +1,75 @@
+#!/usr/bin/env ruby
+#
+# test_bench.rb
+#
+# What bench/suite.rb mounts and reports, checked without mounting: its
+# roots must serve the same trees, and its numbers must add up.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+ENV['BENCH_ENTRIES'] = '10,20'
+ENV['BENCH_SIZES'] = '1'
+require File.expand_path('../../bench/suite', __FILE__)
+require 'test/unit'
+
+class TestBench < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def read(path, size, off = 0)
+    fh = H.open(path)
+    H.read(path, fh, size, off)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_generated_tree
+    FuseFS.set_root(GeneratedDir.new)
+    assert_equal(['.', '..', 'big', 'ls10', 'ls20'], H.readdir('/').sort)
+    assert_equal(12, H.readdir('/ls10').size)
+    assert_equal(SMALL, H.getattr('/ls20/f19')[:size])
+    assert_equal(-Errno::ENOENT::Errno, H.getattr('/ls10/f10'))
+    assert_equal(GeneratedDir::SMALL_DATA, read('/ls10/f3', SMALL))
+  end
+
+  def test_generated_big_file_is_raw
+    FuseFS.set_root(GeneratedDir.new)
+    assert_equal(MB, H.getattr('/big/1')[:size])
+    assert_equal("\0" * 10, read('/big/1', 100, MB - 10))
+    assert_equal(-Errno::EACCES::Errno, H.open('/big/1', File::WRONLY))
+  end
+
+  def test_filled_roots_match_generated
+    generated = GeneratedDir.new
+    [FuseFS::MetaDir, FuseFS::NativeMetaDir].each do |klass|
+      root = filled(klass.new)
+      ENTRIES.each do |n|
+        assert_equal(generated.contents("/ls#{n}").sort,
+                     root.contents("/ls#{n}").sort, klass.name)
+      end
+      assert_equal(GeneratedDir::SMALL_DATA, root.read_file('/ls10/f0'))
+    end
+  end
+
+  def test_percentile
+    sorted = (1..100).to_a
+    assert_equal(50, percentile(sorted, 50))
+    assert_equal(99, percentile(sorted, 99))
+    assert_equal(1, percentile([1], 99))
+    assert_nil(percentile([], 50))
+  end
+
+  def test_result
+    res = result('metadir', 'stat', [0.002, 0.001, 0.003, 0.004])
+    assert_equal(4, res['ops'])
+    assert_in_delta(0.01, res['seconds'], 1e-9)
+    assert_in_delta(400, res['ops_per_sec'], 1e-6)
+    assert_in_delta(2000, res['latency_us']['p50'], 1e-6)
+    assert_in_delta(4000, res['latency_us']['max'], 1e-6)
+  end
+
+  def test_to_json
+    assert_equal('{"a":[1,2.5,null,"q\\"s"]}',
+                 to_json('a' => [1, 2.5, nil, 'q"s']))
+    assert_equal('null', to_json(0.0 / 0))
+  end
+end
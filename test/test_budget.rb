@@ -0,0 +1,80 @@
+#!/usr/bin/env ruby
+#
+# test_budget.rb
+#
+# FuseFS.buffer_budget: open file buffers past it spill to a temporary
+# file, read back whole on release, and give their memory back.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+class TestBudget < Test::Unit::TestCase
+  H = FuseFS::Harness
+  KB = 1024
+
+  def setup
+    FuseFS.buffer_budget = 64 * KB
+    @root = FuseFS::MetaDir.new
+    FuseFS.set_root(@root)
+  end
+
+  def teardown
+    FuseFS.buffer_budget = 0
+  end
+
+  def write_in_chunks(path, fh, body)
+    off = 0
+    body.scan(/.{1,4096}/m) do |chunk|
+      assert_equal(chunk.size, H.write(path, fh, chunk, off))
+      off += chunk.size
+    end
+  end
+
+  def test_small_file_stays_in_memory
+    spills = FuseFS.stats[:spills]
+    fh = H.open('/f', File::WRONLY)
+    write_in_chunks('/f', fh, 'x' * 8 * KB)
+    assert_equal(spills, FuseFS.stats[:spills])
+    assert_equal(0, H.release('/f', fh))
+    assert_equal('x' * 8 * KB, @root.read_file('/f'))
+  end
+
+  def test_write_past_budget_spills
+    spills = FuseFS.stats[:spills]
+    body = (0...200 * KB).map { |i| (i % 251).chr }.join
+    fh = H.open('/f', File::WRONLY)
+    write_in_chunks('/f', fh, body)
+    assert_equal(spills + 1, FuseFS.stats[:spills])
+    assert(FuseFS.stats[:spill_bytes] >= body.size)
+    assert_equal(body[100 * KB, 10], H.read('/f', fh, 10, 100 * KB))
+    assert_equal(0, H.release('/f', fh))
+    assert_equal(body, @root.read_file('/f'))
+  end
+
+  def test_release_gives_memory_back
+    buffered = FuseFS.stats[:buffer_bytes]
+    spilled = FuseFS.stats[:spill_bytes]
+    small = H.open('/s', File::WRONLY)
+    write_in_chunks('/s', small, 's' * 16 * KB)
+    big = H.open('/b', File::WRONLY)
+    write_in_chunks('/b', big, 'b' * 128 * KB)
+    assert(FuseFS.stats[:buffer_bytes] <= 64 * KB)
+    assert_equal(0, H.release('/b', big))
+    assert_equal(0, H.release('/s', small))
+    assert_equal(buffered, FuseFS.stats[:buffer_bytes])
+    assert_equal(spilled, FuseFS.stats[:spill_bytes])
+    assert_equal('b' * 128 * KB, @root.read_file('/b'))
+    assert_equal('s' * 16 * KB, @root.read_file('/s'))
+  end
+
+  def test_read_of_big_file_spills
+    spills = FuseFS.stats[:spills]
+    @root.write_to('/f', 'r' * 100 * KB)
+    fh = H.open('/f')
+    assert_equal(spills + 1, FuseFS.stats[:spills])
+    assert_equal('rrrr', H.read('/f', fh, 4, 99 * KB))
+    assert_equal(0, H.release('/f', fh))
+  end
+end
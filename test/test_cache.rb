@@ -0,0 +1,110 @@
+#!/usr/bin/env ruby
+#
+# test_cache.rb
+#
+# FuseFS.cache_max_bytes: read_file results kept across opens, checked
+# against etag once cache_ttl is up, and dropped by writes through FuseFS.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir that counts read_file calls, with an etag it can be told.
+class TaggedDir < FuseFS::MetaDir
+  attr_accessor :tag
+  attr_reader :reads
+
+  def initialize
+    super
+    @tag = 'v1'
+    @reads = 0
+  end
+  def read_file(path)
+    @reads += 1
+    super
+  end
+  def etag(path)
+    @tag
+  end
+end
+
+class TestCache < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    FuseFS.cache_max_bytes = 1024
+    FuseFS.cache_ttl = 60
+    @root = TaggedDir.new
+    @root.write_to('/f', 'abc')
+    @root.write_to('/g', 'x' * 600)
+    FuseFS.set_root(@root)
+  end
+
+  def teardown
+    FuseFS.cache_max_bytes = 0
+    FuseFS.cache_ttl = 1
+    FuseFS.invalidate
+  end
+
+  def read(path)
+    fh = H.open(path)
+    H.read(path, fh, 4096, 0)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_opens_share_one_read
+    hits = FuseFS.stats[:cache_hits]
+    3.times { assert_equal('abc', read('/f')) }
+    assert_equal(1, @root.reads)
+    assert_equal(hits + 2, FuseFS.stats[:cache_hits])
+  end
+
+  def test_etag_is_checked_after_ttl
+    FuseFS.cache_ttl = 0
+    assert_equal('abc', read('/f'))
+    assert_equal('abc', read('/f'))
+    assert_equal(1, @root.reads)
+    @root.write_to('/f', 'new')
+    @root.tag = 'v2'
+    assert_equal('new', read('/f'))
+    assert_equal(2, @root.reads)
+  end
+
+  def test_write_through_fusefs_drops_copy
+    assert_equal('abc', read('/f'))
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    H.write('/f', fh, 'written', 0)
+    H.release('/f', fh)
+    assert_equal('written', read('/f'))
+  end
+
+  def test_least_recently_used_is_evicted
+    read('/f')
+    read('/g')
+    read('/f')
+    @root.write_to('/h', 'y' * 600)
+    read('/h')
+    reads = @root.reads
+    read('/f')
+    read('/h')
+    assert_equal(reads, @root.reads)
+    read('/g')
+    assert_equal(reads + 1, @root.reads)
+    assert(FuseFS.stats[:cache_bytes] <= 1024)
+  end
+
+  def test_too_big_is_not_kept
+    FuseFS.cache_max_bytes = 100
+    2.times { read('/g') }
+    assert_equal(2, @root.reads)
+  end
+
+  def test_invalidate
+    read('/f')
+    FuseFS.invalidate('/f')
+    read('/f')
+    assert_equal(2, @root.reads)
+  end
+end
@@ -0,0 +1,108 @@
+#!/usr/bin/env ruby
+#
+# test_control.rb
+#
+# FuseFS.control_dir: stats and settings read and written as files, with
+# FuseRoot never asked about them.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir that fails the test if asked about the control directory.
+class NoControlDir < FuseFS::MetaDir
+  [:directory?, :file?, :contents, :read_file, :size].each do |meth|
+    define_method(meth) do |path|
+      raise "#{meth}(#{path}) reached FuseRoot" if path =~ /\.fusefs/
+      super(path)
+    end
+  end
+end
+
+class TestControl < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = NoControlDir.new
+    @root.write_to('/f', 'abc')
+    FuseFS.set_root(@root)
+    FuseFS.control_dir = true
+  end
+
+  def teardown
+    FuseFS.control_dir = nil
+    FuseFS.attr_ttl = 0
+    FuseFS.cache_max_bytes = 0
+    FuseFS.invalidate
+  end
+
+  def read(path)
+    fh = H.open(path)
+    H.read(path, fh, 1024 * 1024, 0)
+  ensure
+    H.release(path, fh)
+  end
+
+  # Writes body to path, returning what flush (that is, close) gave.
+  def write(path, body)
+    fh = H.open(path, File::WRONLY | File::TRUNC)
+    assert_equal(body.size, H.write(path, fh, body, 0))
+    H.flush(path, fh)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_listing
+    assert_equal(['.', '..', 'f'], H.readdir('/'))
+    names = H.readdir('/.fusefs')
+    assert(names.include?('stats'))
+    assert(names.include?('invalidate'))
+    assert(names.include?('attr_ttl'))
+    assert_equal(040000, H.getattr('/.fusefs')[:mode] & 0170000)
+  end
+
+  def test_stats_read
+    read('/f')
+    stats = read('/.fusefs/stats')
+    assert_match(/^# TYPE fusefs_raw_reads_total counter$/, stats)
+    assert_match(/^fusefs_buffer_bytes \d+$/, stats)
+  end
+
+  def test_stats_is_read_only
+    assert_equal(-Errno::EACCES::Errno,
+                 H.open('/.fusefs/stats', File::WRONLY))
+  end
+
+  def test_setting_read_and_write
+    FuseFS.attr_ttl = 0
+    assert_equal("0\n", read('/.fusefs/attr_ttl'))
+    assert_equal(0, write('/.fusefs/attr_ttl', "5\n"))
+    assert_equal(5.0, FuseFS.attr_ttl)
+    assert_equal("5\n", read('/.fusefs/attr_ttl'))
+  end
+
+  def test_bad_setting_fails_close
+    FuseFS.attr_ttl = 2
+    assert_equal(-Errno::EINVAL::Errno, write('/.fusefs/attr_ttl', "bogus\n"))
+    assert_equal(2.0, FuseFS.attr_ttl)
+  end
+
+  def test_invalidate
+    FuseFS.cache_max_bytes = 1024
+    read('/f')
+    @root.write_to('/f', 'new')
+    assert_equal('abc', read('/f'))
+    assert_equal(0, write('/.fusefs/invalidate', "/f\n"))
+    assert_equal('new', read('/f'))
+  end
+
+  def test_open_handle_survives_rename_of_control_dir
+    fh = H.open('/.fusefs/attr_ttl', File::WRONLY | File::TRUNC)
+    FuseFS.control_dir = 'ctl'
+    assert_equal(2, H.write('/.fusefs/attr_ttl', fh, "7\n", 0))
+    assert_equal(0, H.flush('/.fusefs/attr_ttl', fh))
+    assert_equal(0, H.release('/.fusefs/attr_ttl', fh))
+    assert_equal(7.0, FuseFS.attr_ttl)
+  end
+end
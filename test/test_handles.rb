@@ -0,0 +1,181 @@
+#!/usr/bin/env ruby
+#
+# test_handles.rb
+#
+# Objects returned by raw_open: each open keeps its own, and FuseFS calls
+# it in place of the raw_* methods it responds to.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A file open once, over a String it shares with the others.
+class StringHandle
+  attr_reader :closed
+
+  def initialize(data)
+    @data = data
+  end
+  def read(off, sz)
+    @data[off, sz] || ''
+  end
+  def write(off, buf)
+    @data[off, buf.size] = buf
+    buf.size
+  end
+  def truncate(sz)
+    @data.slice!(sz..-1)
+    true
+  end
+  def close
+    @closed = true
+  end
+end
+
+# A handle with only read: writes and closes go to raw_write and raw_close.
+class ReadOnlyHandle
+  def read(off, sz)
+    'h' * sz
+  end
+end
+
+# A handle that fills FuseFS's buffer, and remembers which it was given.
+class IntoHandle
+  attr_reader :bufs
+
+  def initialize(data)
+    @data = data
+    @bufs = []
+  end
+  def read(off, sz)
+    raise 'read_into should be preferred'
+  end
+  def read_into(off, sz, buf)
+    @bufs << buf.object_id
+    buf.replace(@data[off, sz])
+  end
+end
+
+# A raw file read with raw_read_into, returning the count.
+class IntoDir
+  attr_reader :bufs
+
+  def initialize
+    @bufs = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/f' end
+  def contents(path) ['f'] end
+  def size(path) 10 end
+  def raw_open(path, mode) true end
+  def raw_read(path, off, sz)
+    raise 'raw_read_into should be preferred'
+  end
+  def raw_read_into(path, off, sz, buf)
+    @bufs << buf.object_id
+    buf.replace('0123456789'[off, sz] + 'past sz')
+    [sz, 10 - off].min
+  end
+  def raw_close(path) end
+end
+
+class HandleDir
+  attr_reader :handles, :raw_calls
+
+  def initialize
+    @data = 'hello world'
+    @handles = []
+    @raw_calls = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/f' || path == '/r' end
+  def contents(path) ['f', 'r'] end
+  def size(path) @data.size end
+  def can_write?(path) true end
+  def raw_open(path, mode)
+    @handles << ((path == '/r') ? ReadOnlyHandle.new : StringHandle.new(@data))
+    @handles.last
+  end
+  def raw_read(path, off, sz)
+    @raw_calls << :raw_read
+    ''
+  end
+  def raw_write(path, off, sz, buf)
+    @raw_calls << :raw_write
+    sz
+  end
+  def raw_close(path)
+    @raw_calls << :raw_close
+  end
+  def data
+    @data
+  end
+end
+
+class TestHandles < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = HandleDir.new
+    FuseFS.set_root(@root)
+  end
+
+  def test_read_write_close
+    fh = H.open('/f', File::RDWR)
+    assert_equal('hello', H.read('/f', fh, 5, 0))
+    assert_equal(5, H.write('/f', fh, 'there', 6))
+    assert_equal('hello there', H.read('/f', fh, 100, 0))
+    assert_equal(0, H.release('/f', fh))
+    assert(@root.handles.last.closed)
+    assert_equal([], @root.raw_calls)
+  end
+
+  def test_each_open_has_its_own
+    a = H.open('/f')
+    b = H.open('/f', File::WRONLY)
+    assert_equal(2, @root.handles.size)
+    assert_equal(0, H.release('/f', a))
+    assert(@root.handles[0].closed)
+    assert(!@root.handles[1].closed)
+    assert_equal(3, H.write('/f', b, 'HEL', 0))
+    assert_equal(0, H.release('/f', b))
+    assert(@root.handles[1].closed)
+    assert_equal('HELlo world', @root.data)
+  end
+
+  def test_trunc_open_truncates_handle
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    assert_equal('', @root.data)
+    assert_equal(0, H.release('/f', fh))
+  end
+
+  def test_raw_read_into
+    root = IntoDir.new
+    FuseFS.set_root(root)
+    fh = H.open('/f')
+    assert_equal('0123', H.read('/f', fh, 4, 0))
+    assert_equal('89', H.read('/f', fh, 4, 8))
+    assert_equal(0, H.release('/f', fh))
+    assert_equal(1, root.bufs.uniq.size)
+  end
+
+  def test_handle_read_into
+    handle = IntoHandle.new('hello world')
+    def @root.raw_open(path, mode) @into end
+    @root.instance_variable_set(:@into, handle)
+    fh = H.open('/f')
+    assert_equal('hello', H.read('/f', fh, 5, 0))
+    assert_equal('world', H.read('/f', fh, 5, 6))
+    assert_equal(0, H.release('/f', fh))
+    assert_equal(1, handle.bufs.uniq.size)
+  end
+
+  def test_missing_methods_fall_back
+    fh = H.open('/r', File::RDWR)
+    assert_equal('hhh', H.read('/r', fh, 3, 0))
+    assert_equal(3, H.write('/r', fh, 'abc', 0))
+    assert_equal(0, H.release('/r', fh))
+    assert_equal([:raw_write, :raw_close], @root.raw_calls)
+  end
+end
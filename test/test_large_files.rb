@@ -0,0 +1,132 @@
+#!/usr/bin/env ruby
+#
+# test_large_files.rb
+#
+# Offsets and sizes past 4GB, through FuseFS::Harness: nothing is mounted,
+# and no file that size is ever held in memory or on disk.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+GB = 1024 * 1024 * 1024
+BIG = 5 * GB + 123
+
+# A raw file of BIG bytes that remembers what it was asked for.
+class BigRawDir
+  attr_reader :reads, :writes, :truncates
+
+  def initialize
+    @reads, @writes, @truncates = [], [], []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/big' end
+  def contents(path) ['big'] end
+  def size(path) BIG end
+  def can_write?(path) true end
+  def raw_open(path, mode) true end
+  def raw_read(path, off, sz)
+    @reads << [off, sz]
+    'r' * sz
+  end
+  def raw_write(path, off, sz, buf)
+    @writes << [off, buf]
+    sz
+  end
+  def raw_close(path) end
+  def truncate(path, size)
+    @truncates << size
+    true
+  end
+end
+
+# A buffered root that takes sparse files as extents.
+class ExtentsDir < FuseFS::MetaDir
+  attr_reader :extents
+
+  def write_extents(path, size, extents)
+    @extents = [path, size, extents.map { |off, str| [off, str.size] }]
+  end
+end
+
+class TestLargeFiles < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    FuseFS.buffer_budget = 0
+  end
+
+  def test_getattr_size
+    FuseFS.set_root(BigRawDir.new)
+    assert_equal(BIG, H.getattr('/big')[:size])
+  end
+
+  def test_raw_read_offset
+    root = BigRawDir.new
+    FuseFS.set_root(root)
+    fh = H.open('/big')
+    assert_equal('rrrr', H.read('/big', fh, 4, BIG - 4))
+    assert_equal(0, H.release('/big', fh))
+    assert_equal([[BIG - 4, 4]], root.reads)
+  end
+
+  def test_raw_write_offset
+    root = BigRawDir.new
+    FuseFS.set_root(root)
+    fh = H.open('/big', File::WRONLY)
+    assert_equal(3, H.write('/big', fh, 'abc', 4 * GB + 1))
+    assert_equal(0, H.release('/big', fh))
+    assert_equal([[4 * GB + 1, 'abc']], root.writes)
+  end
+
+  def test_truncate_size
+    root = BigRawDir.new
+    FuseFS.set_root(root)
+    assert_equal(0, H.truncate('/big', BIG))
+    assert_equal([BIG], root.truncates)
+  end
+
+  def test_sparse_write_past_4gb
+    root = ExtentsDir.new
+    root.write_to('/f', 'abc')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::RDWR)
+    assert_equal(1, H.write('/f', fh, 'x', 4 * GB + 7))
+    assert_equal('x', H.read('/f', fh, 1, 4 * GB + 7))
+    assert_equal("\0\0", H.read('/f', fh, 2, 4 * GB + 5))
+    assert_equal(0, H.release('/f', fh))
+    path, size, extents = root.extents
+    assert_equal(['/f', 4 * GB + 8], [path, size])
+    # Extents are whole pages where the system can find the holes.
+    off, len = extents.last
+    assert(off <= 4 * GB + 7 && off + len == 4 * GB + 8)
+  end
+
+  def test_sparse_truncate_past_4gb
+    root = ExtentsDir.new
+    root.write_to('/f', 'abc')
+    FuseFS.set_root(root)
+    assert_equal(0, H.truncate('/f', BIG))
+    assert_equal(['/f', BIG, [[0, 3]]], root.extents)
+  end
+
+  def test_sparse_past_budget_without_extents
+    FuseFS.buffer_budget = 1024 * 1024
+    root = FuseFS::MetaDir.new
+    root.write_to('/f', 'abc')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::RDWR)
+    assert_equal(-Errno::EFBIG::Errno, H.write('/f', fh, 'x', 4 * GB))
+    assert_equal(0, H.release('/f', fh))
+    assert_equal(-Errno::EFBIG::Errno, H.truncate('/f', BIG))
+    assert_equal('abc', root.read_file('/f'))
+  end
+
+  def test_open_file_errno_out_of_range
+    root = BigRawDir.new
+    def root.open_file(path, mode) 4 * GB end
+    FuseFS.set_root(root)
+    assert_equal(-Errno::EIO::Errno, H.open('/big'))
+  end
+end
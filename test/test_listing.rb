@@ -0,0 +1,76 @@
+#!/usr/bin/env ruby
+#
+# test_listing.rb
+#
+# MetaDir#contents: a sorted, frozen list kept sorted as the directory
+# changes, and the same Array until it does.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+class TestListing < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = FuseFS::MetaDir.new
+    %w|m c x a|.each { |name| @root.write_to("/#{name}", name) }
+    FuseFS.set_root(@root)
+  end
+
+  def test_sorted_and_frozen
+    list = @root.contents('/')
+    assert_equal(%w|a c m x|, list)
+    assert(list.frozen?)
+    assert_same(list, @root.contents('/'))
+  end
+
+  def test_kept_sorted_through_changes
+    @root.contents('/')
+    @root.write_to('/b', 'b')
+    @root.mkdir('/n')
+    @root.delete('/m')
+    @root.write_to('/c', 'again')
+    assert_equal(%w|a b c n x|, @root.contents('/'))
+    @root.rmdir('/n')
+    @root.rename('/a', '/z')
+    assert_equal(%w|b c x z|, @root.contents('/'))
+  end
+
+  def test_new_list_after_change
+    list = @root.contents('/')
+    @root.write_to('/b', 'b')
+    assert_not_same(list, @root.contents('/'))
+    assert_equal(%w|a c m x|, list)
+  end
+
+  def test_subdirectory_and_readdir
+    @root.mkdir('/d')
+    %w|q e k|.each { |name| @root.write_to("/d/#{name}", name) }
+    assert_equal(%w|e k q|, @root.contents('/d'))
+    assert_equal(%w|. .. e k q|, H.readdir('/d'))
+    H.unlink('/d/k')
+    fh = H.open('/d/f', File::WRONLY)
+    H.write('/d/f', fh, 'f', 0)
+    H.release('/d/f', fh)
+    assert_equal(%w|. .. e f q|, H.readdir('/d'))
+  end
+
+  def test_random_changes_match_sort
+    names = []
+    srand(49)
+    500.times do
+      name = "f#{rand(100)}"
+      if names.include?(name)
+        @root.delete("/#{name}")
+        names.delete(name)
+      else
+        @root.write_to("/#{name}", '')
+        names << name
+      end
+      @root.contents('/') if rand(4) == 0
+    end
+    assert_equal((names + %w|a c m x|).sort, @root.contents('/'))
+  end
+end
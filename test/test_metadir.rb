@@ -0,0 +1,73 @@
+#!/usr/bin/env ruby
+#
+# test_metadir.rb
+#
+# MetaDir's index of its directories must not skip a subclass's overrides
+# on the directories between the root and the one holding a path.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# Hides everything under a directory marked read-only.
+class ReadOnlyDir < FuseFS::MetaDir
+  attr_accessor :readonly
+
+  def can_write?(path)
+    readonly ? false : super
+  end
+  def read_file(path)
+    readonly ? 'censored' : super
+  end
+end
+
+class TestMetaDir < Test::Unit::TestCase
+  def tree(klass)
+    root = klass.new
+    root.mkdir('/ro')
+    root.mkdir('/ro/sub')
+    root.write_to('/ro/sub/f', 'secret')
+    root.mkdir('/rw')
+    root.write_to('/rw/f', 'ok')
+    root
+  end
+
+  def test_subclass_overrides_between
+    root = tree(ReadOnlyDir)
+    root.read_file('/ro/sub/f')
+    ro = root.instance_variable_get(:@subdirs)['ro']
+    ro.readonly = true
+    assert_equal(false, root.can_write?('/ro/sub/f'))
+    assert_equal('censored', root.read_file('/ro/sub/f'))
+    assert_equal('ok', root.read_file('/rw/f'))
+  end
+
+  def test_singleton_overrides_between
+    root = tree(FuseFS::MetaDir)
+    assert_equal('secret', root.read_file('/ro/sub/f'))
+    ro = root.instance_variable_get(:@subdirs)['ro']
+    def ro.read_file(path) 'censored' end
+    assert_equal('censored', root.read_file('/ro/sub/f'))
+    assert_equal('ok', root.read_file('/rw/f'))
+  end
+
+  def test_rename_into_itself
+    root = tree(FuseFS::MetaDir)
+    FuseFS.set_root(root)
+    h = FuseFS::Harness
+    assert_equal(-Errno::EINVAL::Errno, h.rename('/ro', '/ro/sub/x'))
+    assert_equal(Errno::EINVAL::Errno, root.rename('/ro', '/ro/x'))
+    assert_equal(Errno::EINVAL::Errno, root.rename('ro', '//ro/x'))
+    assert_equal('secret', root.read_file('/ro/sub/f'))
+    assert_equal(0, h.rename('/ro', '/rox'))
+    assert_equal('secret', root.read_file('/rox/sub/f'))
+  end
+
+  def test_plain_tree_is_indexed
+    root = tree(FuseFS::MetaDir)
+    assert_equal('secret', root.read_file('/ro/sub/f'))
+    index = root.instance_variable_get(:@index)
+    assert_equal(['', '/ro', '/ro/sub', '/rw'], index.keys.sort)
+  end
+end
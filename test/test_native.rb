@@ -0,0 +1,137 @@
+#!/usr/bin/env ruby
+#
+# test_native.rb
+#
+# FuseFS::NativeMetaDir: the same tree, answers and errors as MetaDir,
+# called directly and through FuseFS.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+class TestNative < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def roots
+    [FuseFS::NativeMetaDir.new, FuseFS::MetaDir.new]
+  end
+
+  # Calls the block on a NativeMetaDir and a MetaDir, and checks both
+  # gave the same.
+  def same
+    native, meta = roots.map { |root| yield root }
+    assert_equal(meta, native)
+    native
+  end
+
+  # Every entry under <path>, with what it is and holds.
+  def walk(root, path = '/', out = [])
+    root.contents(path).sort.each do |name|
+      sub = path == '/' ? "/#{name}" : "#{path}/#{name}"
+      out << [sub, root.file?(sub), root.directory?(sub),
+              root.file?(sub) ? root.read_file(sub) : nil]
+      walk(root, sub, out) if root.directory?(sub)
+    end
+    out
+  end
+
+  def fill(root)
+    root.mkdir('/d')
+    root.mkdir('/d/e')
+    root.write_to('/d/f', 'abc')
+    root.write_to('/g', '')
+    root
+  end
+
+  def test_files_and_directories
+    same do |root|
+      fill(root)
+      root.append_to('/d/f', 'def')
+      [root.contents('/').sort, root.contents('/d').sort,
+       root.contents('/d/f'), root.contents('/x'),
+       root.file?('/d/f'), root.file?('/d'), root.directory?('/d/e'),
+       root.directory?('/d/f'), root.read_file('/d/f'),
+       root.size('/d/f'), root.size('/g')]
+    end
+  end
+
+  def test_delete_and_rmdir
+    same do |root|
+      fill(root)
+      [root.can_rmdir?('/d'), root.can_rmdir?('/d/e'),
+       root.can_delete?('/d/f'), root.can_delete?('/d'),
+       root.rmdir('/d/e') && nil, root.delete('/d/f') && nil,
+       walk(root)]
+    end
+  end
+
+  def test_renames
+    same do |root|
+      fill(root)
+      root.write_to('/d/e/k', '')
+      [root.rename('/d/f', '/h'), root.rename('/x', '/y'),
+       root.rename('/d', '/d/e'), root.rename('/d', '/d/e/d'), root.rename('d', '//d/q'),
+       root.rename('/d', '/d'), root.rename('/h', '/d'),
+       root.rename('/d', '/g'), root.rename('/d/e', '/e'),
+       walk(root)]
+    end
+  end
+
+  def test_through_fusefs
+    same do |root|
+      fill(root)
+      FuseFS.set_root(root)
+      fh = H.open('/d/n', File::WRONLY)
+      H.write('/d/n', fh, 'new', 0)
+      H.release('/d/n', fh)
+      fh = H.open('/d/f')
+      data = H.read('/d/f', fh, 10, 1)
+      H.release('/d/f', fh)
+      [H.readdir('/d').sort, H.getattr('/d/f')[:size],
+       H.getattr('/d/x'), data, H.mkdir('/d/m'), H.unlink('/g'),
+       H.rename('/d', '/d/m/d'), H.rename('/d/n', '/n'),
+       H.rmdir('/d/m'), H.rmdir('/d'), walk(root)]
+    end
+  end
+
+  # Random operations on paths of up to three levels, skipping those
+  # MetaDir leaves to FuseFS to check first (a missing parent, writing
+  # over a directory, reading what isn't a file).
+  def test_random_operations
+    native, meta = roots
+    names = %w|a b c|
+    srand(50)
+    2000.times do |i|
+      from, to = (1..2).map do
+        '/' + (1..rand(3) + 1).map { names[rand(names.size)] }.join('/')
+      end
+      op = [:mkdir, :write_to, :append_to, :rename, :delete, :rmdir,
+            :contents, :file?, :directory?, :read_file, :can_mkdir?,
+            :can_rmdir?, :can_delete?][rand(13)]
+      case op
+      when :mkdir, :write_to, :append_to
+        next if meta.file?(from) && op == :mkdir
+        next if meta.directory?(from) && op != :mkdir
+        next unless meta.directory?(File.dirname(from))
+      when :rename
+        next unless meta.directory?(File.dirname(to))
+        next unless meta.directory?(File.dirname(from))
+      when :read_file
+        next unless meta.file?(from)
+      end
+      results = [native, meta].map do |root|
+        case op
+        when :mkdir then root.mkdir(from) ? true : false
+        when :write_to, :append_to then root.send(op, from, "#{i}"); nil
+        when :delete, :rmdir then root.send(op, from); nil
+        when :rename then root.rename(from, to)
+        when :contents then (list = root.contents(from)) && list.sort
+        else root.send(op, from)
+        end
+      end
+      assert_equal(results[1], results[0], "#{i}: #{op} #{from} #{to}")
+    end
+    assert_equal(walk(meta), walk(native))
+  end
+end
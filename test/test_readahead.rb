@@ -0,0 +1,80 @@
+#!/usr/bin/env ruby
+#
+# test_readahead.rb
+#
+# FuseFS.readahead: sequential raw reads fetch a window that doubles with
+# each refill, and a read anywhere else is passed on as it is.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A raw file whose every byte is its offset mod 251, logging its reads.
+class PatternDir
+  attr_reader :reads
+
+  def initialize
+    @reads = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/f' end
+  def contents(path) ['f'] end
+  def size(path) 1024 * 1024 end
+  def raw_open(path, mode) true end
+  def raw_read(path, off, sz)
+    @reads << [off, sz]
+    PatternDir.bytes(off, sz)
+  end
+  def raw_close(path) end
+
+  def self.bytes(off, sz)
+    (off...off + sz).map { |i| (i % 251).chr }.join
+  end
+end
+
+class TestReadAhead < Test::Unit::TestCase
+  H = FuseFS::Harness
+  KB = 1024
+
+  def setup
+    FuseFS.readahead = 64 * KB
+    @root = PatternDir.new
+    FuseFS.set_root(@root)
+    @fh = H.open('/f')
+  end
+
+  def teardown
+    H.release('/f', @fh)
+    FuseFS.readahead = 0
+  end
+
+  def test_sequential_reads_double_the_window
+    8.times do |i|
+      assert_equal(PatternDir.bytes(i * 4 * KB, 4 * KB),
+                   H.read('/f', @fh, 4 * KB, i * 4 * KB))
+    end
+    assert_equal([[0, 8 * KB], [8 * KB, 16 * KB], [24 * KB, 32 * KB]],
+                 @root.reads)
+  end
+
+  def test_window_stops_at_readahead
+    64.times { |i| H.read('/f', @fh, 4 * KB, i * 4 * KB) }
+    assert_equal(64 * KB, @root.reads.map { |off, sz| sz }.max)
+  end
+
+  def test_random_read_is_passed_on
+    H.read('/f', @fh, 4 * KB, 0)
+    assert_equal(PatternDir.bytes(500 * KB, 4 * KB),
+                 H.read('/f', @fh, 4 * KB, 500 * KB))
+    assert_equal([500 * KB, 4 * KB], @root.reads.last)
+    H.read('/f', @fh, 4 * KB, 100 * KB)
+    assert_equal([100 * KB, 4 * KB], @root.reads.last)
+  end
+
+  def test_off_by_default
+    FuseFS.readahead = 0
+    4.times { |i| H.read('/f', @fh, 4 * KB, i * 4 * KB) }
+    assert_equal((0...4).map { |i| [i * 4 * KB, 4 * KB] }, @root.reads)
+  end
+end
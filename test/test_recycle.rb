@@ -0,0 +1,71 @@
+#!/usr/bin/env ruby
+#
+# test_recycle.rb
+#
+# Open file entries, their paths and small buffers are reused from one
+# open to the next; nothing of one file may show up in another.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+class TestRecycle < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = FuseFS::MetaDir.new
+    FuseFS.set_root(@root)
+  end
+
+  def write(path, body)
+    fh = H.open(path, File::WRONLY | File::TRUNC)
+    assert_equal(body.size, H.write(path, fh, body, 0))
+    assert_equal(0, H.release(path, fh))
+  end
+
+  def read(path)
+    fh = H.open(path)
+    H.read(path, fh, 1024 * 1024, 0)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_buffers_are_reused
+    write('/a', 'a' * 100)
+    hits = FuseFS.stats[:pool_hits]
+    write('/b', 'b' * 100)
+    assert(FuseFS.stats[:pool_hits] > hits)
+    assert_equal('a' * 100, read('/a'))
+    assert_equal('b' * 100, read('/b'))
+  end
+
+  def test_reused_buffer_starts_empty
+    write('/a', 'a' * 1000)
+    write('/b', 'b')
+    assert_equal('b', read('/b'))
+    fh = H.open('/c', File::WRONLY)
+    assert_equal(1, H.write('/c', fh, 'c', 10))
+    assert_equal(0, H.release('/c', fh))
+    assert_equal("\0" * 10 + 'c', read('/c'))
+  end
+
+  def test_many_files_open_at_once
+    names = (0...100).map { |i| "/f#{i}" }
+    handles = names.map { |name| H.open(name, File::WRONLY) }
+    names.zip(handles) do |name, fh|
+      assert_equal(name.size, H.write(name, fh, name, 0))
+    end
+    names.zip(handles) { |name, fh| assert_equal(0, H.release(name, fh)) }
+    names.each { |name| assert_equal(name, @root.read_file(name)) }
+  end
+
+  def test_long_and_short_paths
+    long = '/' + 'x' * 200
+    write(long, 'long')
+    write('/s', 'short')
+    write(long, 'long again')
+    assert_equal('long again', read(long))
+    assert_equal('short', read('/s'))
+  end
+end
@@ -0,0 +1,134 @@
+#!/usr/bin/env ruby
+#
+# test_rename.rb
+#
+# rename(from,to) on FuseRoot, MetaDir's, and FuseFS's own rename when a
+# root has none or returns FuseFS::FALLBACK.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir that logs its write_to calls, so renames that go through
+# FuseFS's fallback can be told apart from MetaDir's own.
+class WriteLogMetaDir < FuseFS::MetaDir
+  attr_reader :writes
+
+  def write_to(path, body)
+    (@writes ||= []) << path
+    super
+  end
+end
+
+# A root with rename that leaves everything to FuseFS.
+class FallbackDir
+  attr_reader :renames
+
+  def initialize
+    @files = { 'a' => 'abc' }
+    @renames = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) @files.key?(path[1..-1]) end
+  def contents(path) @files.keys end
+  def read_file(path) @files[path[1..-1]] end
+  def can_write?(path) true end
+  def can_delete?(path) true end
+  def delete(path) @files.delete(path[1..-1]) end
+  def write_to(path, body) @files[path[1..-1]] = body end
+  def rename(from, to) FuseFS::FALLBACK end
+  def raw_rename(from, to)
+    @renames << [from, to]
+    @files[to[1..-1]] = @files.delete(from[1..-1])
+    true
+  end
+end
+
+class TestRename < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def test_metadir_file
+    root = FuseFS::MetaDir.new
+    root.write_to('/a', 'abc')
+    root.mkdir('/d')
+    FuseFS.set_root(root)
+    assert_equal(0, H.rename('/a', '/d/b'))
+    assert_equal(false, root.file?('/a'))
+    assert_equal('abc', root.read_file('/d/b'))
+  end
+
+  def test_metadir_directory
+    root = FuseFS::MetaDir.new
+    root.mkdir('/d')
+    root.write_to('/d/f', 'abc')
+    FuseFS.set_root(root)
+    assert_equal(0, H.rename('/d', '/e'))
+    assert_equal(false, root.directory?('/d'))
+    assert_equal('abc', root.read_file('/e/f'))
+  end
+
+  def test_metadir_replaces_file
+    root = FuseFS::MetaDir.new
+    root.write_to('/a', 'new')
+    root.write_to('/b', 'old')
+    FuseFS.set_root(root)
+    assert_equal(0, H.rename('/a', '/b'))
+    assert_equal(['b'], root.contents('/'))
+    assert_equal('new', root.read_file('/b'))
+  end
+
+  def test_metadir_onto_itself
+    root = FuseFS::MetaDir.new
+    root.mkdir('/d')
+    root.write_to('/d/f', 'abc')
+    FuseFS.set_root(root)
+    assert_equal(0, H.rename('/d', '/d'))
+    assert_equal(0, H.rename('/d/f', '/d/f'))
+    assert_equal('abc', root.read_file('/d/f'))
+  end
+
+  def test_metadir_errors
+    root = FuseFS::MetaDir.new
+    root.write_to('/a', 'abc')
+    root.mkdir('/d')
+    root.write_to('/d/f', 'abc')
+    root.mkdir('/e')
+    FuseFS.set_root(root)
+    assert_equal(-Errno::ENOENT::Errno, H.rename('/x', '/y'))
+    assert_equal(-Errno::EISDIR::Errno, H.rename('/a', '/d'))
+    assert_equal(-Errno::ENOTDIR::Errno, H.rename('/d', '/a'))
+    assert_equal(-Errno::ENOTEMPTY::Errno, H.rename('/e', '/d'))
+  end
+
+  def test_subclass_falls_back
+    root = WriteLogMetaDir.new
+    root.write_to('/a', 'abc')
+    FuseFS.set_root(root)
+    assert_equal(FuseFS::FALLBACK, root.rename('/a', '/b'))
+    assert_equal(0, H.rename('/a', '/b'))
+    assert_equal(['/a', '/b'], root.writes)
+    assert_equal(false, root.file?('/a'))
+    assert_equal('abc', root.read_file('/b'))
+  end
+
+  def test_fallback_calls_raw_rename
+    root = FallbackDir.new
+    FuseFS.set_root(root)
+    assert_equal(0, H.rename('/a', '/b'))
+    assert_equal([['/a', '/b']], root.renames)
+    assert_equal('abc', root.read_file('/b'))
+  end
+
+  def test_open_file_is_written_to_new_path
+    root = FuseFS::MetaDir.new
+    root.write_to('/a', '')
+    FuseFS.set_root(root)
+    fh = H.open('/a', File::WRONLY)
+    assert_equal(3, H.write('/a', fh, 'abc', 0))
+    assert_equal(0, H.rename('/a', '/b'))
+    assert_equal(0, H.release('/b', fh))
+    assert_equal(false, root.file?('/a'))
+    assert_equal('abc', root.read_file('/b'))
+  end
+end
@@ -0,0 +1,102 @@
+#!/usr/bin/env ruby
+#
+# test_replay.rb
+#
+# FuseFS.record_to and FuseFS.replay: operations recorded against one
+# root, run again against another.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+require 'tmpdir'
+
+class TestReplay < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @rec = File.join(Dir.tmpdir, "fusefs_replay_#{$$}.rec")
+  end
+
+  def teardown
+    FuseFS.record_to(nil)
+    FuseFS.control_dir = nil
+    File.unlink(@rec) if File.exist?(@rec)
+  end
+
+  def tree
+    root = FuseFS::MetaDir.new
+    root.mkdir('/d')
+    root.write_to('/d/a', 'a' * 100)
+    root
+  end
+
+  # The operations to record: a stat, a listing, a read, a new file
+  # written, a rename, a mkdir and a delete, and one that fails.
+  def workload
+    H.getattr('/d/a')
+    H.readdir('/d')
+    fh = H.open('/d/a')
+    H.read('/d/a', fh, 4096, 0)
+    H.release('/d/a', fh)
+    H.mknod('/d/b')
+    fh = H.open('/d/b', File::WRONLY)
+    H.write('/d/b', fh, 'b' * 10, 0)
+    H.release('/d/b', fh)
+    H.rename('/d/b', '/d/c')
+    H.mkdir('/e')
+    H.unlink('/d/a')
+    H.getattr('/missing')
+  end
+
+  def record
+    FuseFS.set_root(tree)
+    FuseFS.record_to(@rec)
+    workload
+    FuseFS.record_to(nil)
+  end
+
+  def test_round_trip
+    record
+    root = tree
+    FuseFS.set_root(root)
+    res = FuseFS.replay(@rec)
+    assert_equal(0, res[:mismatches])
+    assert_equal(13, res[:ops])
+    assert(res[:recorded_seconds] > 0)
+    assert_equal(['c'], root.contents('/d'))
+    assert_equal("\0" * 10, root.read_file('/d/c'))
+    assert(root.directory?('/e'))
+  end
+
+  def test_mismatches_are_counted
+    record
+    root = FuseFS::MetaDir.new
+    root.mkdir('/d')
+    FuseFS.set_root(root)
+    assert(FuseFS.replay(@rec)[:mismatches] > 0)
+  end
+
+  def test_control_dir_is_not_recorded
+    FuseFS.set_root(tree)
+    FuseFS.control_dir = true
+    FuseFS.record_to(@rec)
+    H.getattr('/.fusefs/stats')
+    H.getattr('/d/a')
+    FuseFS.record_to(nil)
+    FuseFS.set_root(tree)
+    assert_equal(1, FuseFS.replay(@rec)[:ops])
+  end
+
+  def test_replay_with_recorded_gaps
+    FuseFS.set_root(tree)
+    FuseFS.record_to(@rec)
+    H.getattr('/d/a')
+    sleep 0.2
+    H.getattr('/d/a')
+    FuseFS.record_to(nil)
+    FuseFS.set_root(tree)
+    assert(FuseFS.replay(@rec)[:seconds] < 0.1)
+    assert(FuseFS.replay(@rec, 2)[:seconds] >= 0.09)
+  end
+end
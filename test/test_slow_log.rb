@@ -0,0 +1,85 @@
+#!/usr/bin/env ruby
+#
+# test_slow_log.rb
+#
+# FuseFS.slow_log: FuseRoot methods that took longer than slow_threshold,
+# or raised, with where they were.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir whose read_file is slow, and whose size raises for /bad.
+class SlowReadDir < FuseFS::MetaDir
+  def read_file(path)
+    sleep 0.3 if path == '/slow'
+    super
+  end
+  def size(path)
+    raise ArgumentError, 'no size' if path == '/bad'
+    super
+  end
+  def file?(path)
+    path == '/bad' || super
+  end
+end
+
+class TestSlowLog < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = SlowReadDir.new
+    @root.write_to('/slow', 'zzz')
+    @root.write_to('/fast', 'abc')
+    FuseFS.set_root(@root)
+    FuseFS.reset_stats
+  end
+
+  def teardown
+    FuseFS.slow_threshold = 0
+  end
+
+  def read(path)
+    fh = H.open(path)
+    H.read(path, fh, 100, 0)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_exception_is_logged
+    H.getattr('/bad')
+    entry = FuseFS.slow_log.last
+    assert_equal('getattr', entry[:op])
+    assert_equal('/bad', entry[:path])
+    assert_equal('size', entry[:callback])
+    assert_kind_of(ArgumentError, entry[:exception])
+    assert_match(/test_slow_log\.rb/, entry[:backtrace].first)
+    assert_equal(1, FuseFS.stats[:exceptions])
+  end
+
+  def test_slow_method_is_logged_and_sampled
+    FuseFS.slow_threshold = 0.1
+    read('/fast')
+    assert_equal([], FuseFS.slow_log)
+    read('/slow')
+    entry = FuseFS.slow_log.last
+    assert_equal('open', entry[:op])
+    assert_equal('/slow', entry[:path])
+    assert_equal('read_file', entry[:callback])
+    assert(entry[:seconds] >= 0.3)
+    assert(entry[:backtrace].any? { |line| line =~ /sleep/ })
+    assert_equal(1, FuseFS.stats[:slow_callbacks])
+  end
+
+  def test_off_by_default
+    read('/slow')
+    assert_equal([], FuseFS.slow_log)
+  end
+
+  def test_reset_stats_empties_it
+    H.getattr('/bad')
+    FuseFS.reset_stats
+    assert_equal([], FuseFS.slow_log)
+  end
+end
@@ -0,0 +1,117 @@
+#!/usr/bin/env ruby
+#
+# test_stale.rb
+#
+# FuseFS.stale_ttl and FuseFS.callback_timeout: what was cached is served
+# past its TTL and refreshed once FuseFS is idle, and methods that take
+# too long are given up on.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir that counts calls, and can be made slow.
+class SlowDir < FuseFS::MetaDir
+  attr_accessor :delay
+  attr_reader :calls
+
+  def initialize
+    super
+    @calls = Hash.new(0)
+  end
+  def size(path)
+    called(:size)
+    super
+  end
+  def read_file(path)
+    called(:read_file)
+    super
+  end
+  def etag(path)
+    called(:etag)
+    read_file(path).hash
+  end
+
+  private
+
+  def called(meth)
+    @calls[meth] += 1
+    sleep(delay) if delay
+  end
+end
+
+class TestStale < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    FuseFS.attr_ttl = 0.2
+    FuseFS.stale_ttl = 60
+    @root = SlowDir.new
+    @root.write_to('/f', 'abc')
+    FuseFS.set_root(@root)
+  end
+
+  def teardown
+    FuseFS.attr_ttl = 0
+    FuseFS.stale_ttl = 0
+    FuseFS.cache_max_bytes = 0
+    FuseFS.cache_ttl = 1
+    FuseFS.callback_timeout = 0
+    FuseFS.invalidate
+  end
+
+  def read(path)
+    fh = H.open(path)
+    H.read(path, fh, 100, 0)
+  ensure
+    H.release(path, fh)
+  end
+
+  def test_stale_attributes_are_served_then_refreshed
+    assert_equal(3, H.getattr('/f')[:size])
+    sleep 0.3
+    @root.write_to('/f', 'abcdef')
+    hits = FuseFS.stats[:stale_hits]
+    assert_equal(3, H.getattr('/f')[:size])
+    assert_equal(1, @root.calls[:size])
+    assert_equal(hits + 1, FuseFS.stats[:stale_hits])
+    assert(FuseFS.refresh_pending?)
+    FuseFS.flush_stale
+    assert(!FuseFS.refresh_pending?)
+    assert_equal(6, H.getattr('/f')[:size])
+    assert_equal(2, @root.calls[:size])
+  end
+
+  def test_stale_contents_are_served_then_refreshed
+    FuseFS.cache_max_bytes = 1024 * 1024
+    FuseFS.cache_ttl = 0.2
+    assert_equal('abc', read('/f'))
+    sleep 0.3
+    @root.write_to('/f', 'xyz')
+    reads = @root.calls[:read_file]
+    assert_equal('abc', read('/f'))
+    assert_equal(reads, @root.calls[:read_file])
+    assert(FuseFS.refresh_pending?)
+    FuseFS.flush_stale
+    assert_equal('xyz', read('/f'))
+  end
+
+  def test_timeout_without_stale_copy
+    FuseFS.callback_timeout = 0.1
+    @root.delay = 0.5
+    timeouts = FuseFS.stats[:timeouts]
+    assert_equal(-Errno::ETIMEDOUT::Errno, H.getattr('/f'))
+    assert_equal(timeouts + 1, FuseFS.stats[:timeouts])
+  end
+
+  def test_timeout_serves_stale_copy
+    assert_equal(3, H.getattr('/f')[:size])
+    sleep 0.3
+    FuseFS.callback_timeout = 0.1
+    @root.delay = 0.5
+    assert_equal(3, H.getattr('/f')[:size])
+    FuseFS.flush_stale
+    assert_equal(3, H.getattr('/f')[:size])
+  end
+end
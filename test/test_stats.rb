@@ -0,0 +1,66 @@
+#!/usr/bin/env ruby
+#
+# test_stats.rb
+#
+# FuseFS.stats: calls, errors and latency histograms for each FUSE
+# operation and each FuseRoot method, and FuseFS.reset_stats.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir whose size takes a known time, and raises for one path.
+class TimedDir < FuseFS::MetaDir
+  def size(path)
+    raise 'broken' if path == '/bad'
+    sleep 0.002
+    super
+  end
+  def file?(path)
+    path == '/bad' || super
+  end
+end
+
+class TestStats < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = TimedDir.new
+    @root.write_to('/f', 'abc')
+    FuseFS.set_root(@root)
+    FuseFS.reset_stats
+  end
+
+  def test_operation_counts
+    3.times { H.getattr('/f') }
+    H.getattr('/missing')
+    op = FuseFS.stats[:ops]['getattr']
+    assert_equal(4, op[:calls])
+    assert_equal(1, op[:errors])
+    assert_equal(4, op[:histogram].inject(0) { |sum, n| sum + n })
+  end
+
+  def test_callback_latency
+    H.getattr('/f')
+    size = FuseFS.stats[:callbacks]['size']
+    assert_equal(1, size[:calls])
+    assert(size[:total_ns] >= 2_000_000)
+    # 2ms is about 2**21 ns; sleep may run over, but not by 4 times.
+    bucket = size[:histogram].index { |n| n > 0 }
+    assert((20..22).include?(bucket), "bucket #{bucket}")
+  end
+
+  def test_callback_exception_is_an_error
+    H.getattr('/bad')
+    assert_equal(1, FuseFS.stats[:callbacks]['size'][:errors])
+    assert_equal(1, FuseFS.stats[:exceptions])
+  end
+
+  def test_reset_stats
+    H.getattr('/f')
+    FuseFS.reset_stats
+    assert_equal({}, FuseFS.stats[:ops])
+    assert_equal({}, FuseFS.stats[:callbacks])
+  end
+end
@@ -0,0 +1,71 @@
+#!/usr/bin/env ruby
+#
+# test_trace.rb
+#
+# FuseFS.dump_trace: the last operations, and the methods each called, as
+# Chrome trace JSON.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+require 'stringio'
+require 'json'
+require 'tmpdir'
+
+class TestTrace < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    @root = FuseFS::MetaDir.new
+    @root.write_to('/f', 'abc')
+    FuseFS.set_root(@root)
+  end
+
+  def events
+    io = StringIO.new
+    FuseFS.dump_trace(io)
+    JSON.parse(io.string)['traceEvents']
+  end
+
+  def fnv1a(str)
+    hash = 0x811c9dc5
+    str.each_byte { |b| hash = ((hash ^ b) * 16777619) & 0xffffffff }
+    '%08x' % hash
+  end
+
+  def test_operation_and_its_callbacks
+    H.getattr('/missing')
+    op = events.last
+    assert_equal('getattr', op['name'])
+    assert_equal('op', op['cat'])
+    assert_equal(fnv1a('/missing'), op['args']['path_hash'])
+    assert_equal(-Errno::ENOENT::Errno, op['args']['result'])
+    calls = events.select { |ev| ev['cat'] == 'callback' }
+    calls = calls.last(op['args']['callbacks'])
+    assert_equal(['directory?', 'file?'], calls.map { |ev| ev['name'] })
+    # Times are in microseconds, to three places.
+    calls.each do |ev|
+      assert(ev['ts'] >= op['ts'] - 0.01)
+      assert(ev['ts'] + ev['dur'] <= op['ts'] + op['dur'] + 0.01)
+    end
+  end
+
+  def test_ring_keeps_the_last_8192
+    9000.times { H.getattr('/f') }
+    H.getattr('/missing')
+    ops = events.select { |ev| ev['cat'] == 'op' }
+    assert(ops.size <= 8192)
+    assert_equal(fnv1a('/missing'), ops.last['args']['path_hash'])
+  end
+
+  def test_dump_to_file_name
+    H.getattr('/f')
+    path = File.join(Dir.tmpdir, "fusefs_trace_#{$$}.json")
+    FuseFS.dump_trace(path)
+    last = JSON.parse(File.read(path))['traceEvents'].last
+    assert_equal('getattr', last['name'])
+  ensure
+    File.unlink(path) if path && File.exist?(path)
+  end
+end
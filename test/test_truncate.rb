@@ -0,0 +1,117 @@
+#!/usr/bin/env ruby
+#
+# test_truncate.rb
+#
+# truncate and O_TRUNC opens, which FUSE passes to open when mounted with
+# atomic_o_trunc: whatever a file is, it must end up empty.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A MetaDir that counts its read_file calls.
+class ReadCountDir < FuseFS::MetaDir
+  attr_reader :reads
+
+  def read_file(path)
+    @reads = (@reads || 0) + 1
+    super
+  end
+end
+
+# A root that decides its opens with open_file.
+class OpenFileDir < FuseFS::MetaDir
+  def open_file(path, mode)
+    file?(path) ? read_file(path) : nil
+  end
+end
+
+# A raw file that takes truncates.
+class RawTruncDir
+  attr_reader :truncates
+
+  def initialize
+    @truncates = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/f' end
+  def contents(path) ['f'] end
+  def size(path) 10 end
+  def can_write?(path) true end
+  def raw_open(path, mode) true end
+  def raw_close(path) end
+  def truncate(path, size)
+    @truncates << size
+    true
+  end
+end
+
+class TestTruncate < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def test_wronly_trunc_without_write
+    root = FuseFS::MetaDir.new
+    root.write_to('/f', 'old contents')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    assert_equal(0, H.release('/f', fh))
+    assert_equal('', root.read_file('/f'))
+  end
+
+  def test_rdwr_trunc_without_write
+    root = ReadCountDir.new
+    root.write_to('/f', 'old contents')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::RDWR | File::TRUNC)
+    assert_equal('', H.read('/f', fh, 100, 0))
+    assert_equal(0, H.release('/f', fh))
+    assert_nil(root.reads)
+    assert_equal('', root.read_file('/f'))
+  end
+
+  def test_trunc_then_write
+    root = FuseFS::MetaDir.new
+    root.write_to('/f', 'old contents')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    assert_equal(3, H.write('/f', fh, 'new', 0))
+    assert_equal(0, H.release('/f', fh))
+    assert_equal('new', root.read_file('/f'))
+  end
+
+  def test_open_file_trunc_without_write
+    root = OpenFileDir.new
+    root.write_to('/f', 'old contents')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    assert_equal(0, H.release('/f', fh))
+    assert_equal('', root.read_file('/f'))
+  end
+
+  def test_wronly_without_trunc_keeps_contents
+    root = FuseFS::MetaDir.new
+    root.write_to('/f', 'old contents')
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::WRONLY)
+    assert_equal(0, H.release('/f', fh))
+    assert_equal('old contents', root.read_file('/f'))
+  end
+
+  def test_raw_trunc_calls_truncate
+    root = RawTruncDir.new
+    FuseFS.set_root(root)
+    fh = H.open('/f', File::WRONLY | File::TRUNC)
+    assert_equal(0, H.release('/f', fh))
+    assert_equal([0], root.truncates)
+  end
+
+  def test_truncate_skips_read_file
+    root = ReadCountDir.new
+    root.write_to('/f', 'abcdef')
+    FuseFS.set_root(root)
+    assert_equal(0, H.truncate('/f', 0))
+    assert_nil(root.reads)
+    assert_equal('', root.read_file('/f'))
+  end
+end
@@ -0,0 +1,100 @@
+#!/usr/bin/env ruby
+#
+# test_writebehind.rb
+#
+# Held-back raw writes: merged while they run on, and their failures
+# reported by whatever comes next on the file.
+
+$:.unshift File.join(File.dirname(__FILE__), '..', 'lib')
+$:.unshift File.join(File.dirname(__FILE__), '..', 'ext')
+require 'fusefs'
+require 'test/unit'
+
+# A raw file that logs its raw_writes, and fails them when told to.
+class WriteLogDir
+  attr_reader :writes
+  attr_accessor :fail
+
+  def initialize
+    @writes = []
+  end
+  def directory?(path) path == '/' end
+  def file?(path) path == '/f' end
+  def contents(path) ['f'] end
+  def size(path) 0 end
+  def can_write?(path) true end
+  def raw_open(path, mode) true end
+  def raw_read(path, off, sz) '' end
+  def raw_write(path, off, sz, buf)
+    return false if fail
+    @writes << [off, buf]
+    sz
+  end
+  def raw_close(path) end
+end
+
+class TestWriteBehind < Test::Unit::TestCase
+  H = FuseFS::Harness
+
+  def setup
+    FuseFS.write_behind = 4096
+    @root = WriteLogDir.new
+    FuseFS.set_root(@root)
+  end
+
+  def teardown
+    FuseFS.write_behind = 0
+  end
+
+  def test_sequential_writes_are_merged
+    fh = H.open('/f', File::WRONLY)
+    assert_equal(3, H.write('/f', fh, 'abc', 0))
+    assert_equal(3, H.write('/f', fh, 'def', 3))
+    assert_equal(3, H.write('/f', fh, 'ghi', 6))
+    assert_equal([], @root.writes)
+    assert_equal(0, H.flush('/f', fh))
+    assert_equal([[0, 'abcdefghi']], @root.writes)
+    assert_equal(0, H.release('/f', fh))
+  end
+
+  def test_seek_flushes_what_is_held
+    fh = H.open('/f', File::WRONLY)
+    H.write('/f', fh, 'abc', 0)
+    H.write('/f', fh, 'xyz', 100)
+    assert_equal([[0, 'abc']], @root.writes)
+    assert_equal(0, H.release('/f', fh))
+    assert_equal([[0, 'abc'], [100, 'xyz']], @root.writes)
+  end
+
+  def test_full_buffer_is_passed_on
+    fh = H.open('/f', File::WRONLY)
+    H.write('/f', fh, 'a' * 4000, 0)
+    H.write('/f', fh, 'b' * 96, 4000)
+    assert_equal([[0, 'a' * 4000 + 'b' * 96]], @root.writes)
+    assert_equal(0, H.release('/f', fh))
+  end
+
+  def test_failure_is_reported_by_flush
+    fh = H.open('/f', File::WRONLY)
+    @root.fail = true
+    assert_equal(3, H.write('/f', fh, 'abc', 0))
+    assert_equal(-Errno::EIO::Errno, H.flush('/f', fh))
+    assert_equal(0, H.flush('/f', fh))
+    assert_equal(0, H.release('/f', fh))
+  end
+
+  def test_failure_is_reported_by_next_write
+    fh = H.open('/f', File::WRONLY)
+    @root.fail = true
+    H.write('/f', fh, 'abc', 0)
+    assert_equal(-Errno::EIO::Errno, H.write('/f', fh, 'xyz', 100))
+    assert_equal(0, H.release('/f', fh))
+  end
+
+  def test_failure_is_reported_by_release
+    fh = H.open('/f', File::WRONLY)
+    @root.fail = true
+    H.write('/f', fh, 'abc', 0)
+    assert_equal(-Errno::EIO::Errno, H.release('/f', fh))
+  end
+end